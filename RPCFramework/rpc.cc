@@ -1,15 +1,23 @@
 #include <cstdio>
+#include <cerrno>
+#include <cmath>
 #include <memory>
 #include <cstring>
+#include <climits>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "rpc.h"
 
@@ -17,39 +25,56 @@ namespace rpc {
 
 // Network stuff
 
-// SlidingBuffer is a lot easier. It needs memory copy, but should be rare if
-// most of requests are small.
-//
-// It has one major advantage: it presents continuous buffer space.
-struct SlidingBuffer {
-  uint8_t *p = nullptr;
-  uint32_t start = 0;
-  uint32_t end = 0;
-  uint32_t size = 0;
-
-  bool Slide(uint32_t reserve) {
-    if (residual_size() <= reserve) {
-      memmove(p, p + start, end - start);
-      end = end - start;
-      start = 0;
-    }
-    return residual_size() > reserve;
-  }
-
-  uint32_t residual_size() const { return size - end; }
-  uint8_t *residual() { return p + end; }
-  uint32_t data_size() const { return end - start; }
-  uint8_t *data() { return p + start; }
-
-};
-
 class Connection final {
   friend class Server;
   static constexpr size_t kMaxInBuf = 2 * BaseService::kMaxRequestSize;
   static constexpr size_t kMaxOutBuf = 2 * BaseService::kMaxResponseSize;
 
+  // Instances this client holds reply leases on, so revocations reach it.
+  struct LeaseHold {
+    int instance_id;
+    uint64_t until_us;
+    bool revoked;  // the revocation waits for room in outbuf
+  };
+  static constexpr size_t kMaxLeaseHolds = 8;
+
   SlidingBuffer inbuf;
   SlidingBuffer outbuf;
+  std::array<LeaseHold, kMaxLeaseHolds> leases;
+  size_t nr_leases = 0;
+  int revoked_instance = -1;
+  bool compression_acked = false;  // told the client we take compressed calls
+  bool compact_acked = false;      // and compact headers
+  bool compact_calls = false;      // calls come with compact headers
+  bool compact_replies = false;    // and so do our replies
+  std::vector<uint8_t> zbuf;       // compressed bodies, (de)compressed
+  std::vector<uint8_t> compound_args; // of the operation being run
+  uint32_t nr_one_way = 0;         // calls run since the last ack
+  // The stream being answered, if items isn't null. Requests after its call
+  // wait until it ends.
+  struct OpenStream {
+    std::unique_ptr<BaseStream> items;
+    unsigned int xid;     // of its call, as on the wire
+    uint32_t flags;       // on every reply
+    bool compression;
+    bool cancelled;
+    bool input;           // the client may send more chunks
+    bool needs_input;     // nothing to send until it does
+    bool ack_owed;        // for the chunk being fed
+    bool last_chunk;
+    uint32_t chunk_left;  // bytes of it still in inbuf
+  } stream;
+  // The call waiting for the coalesced run of its procedure, if proc isn't
+  // null. Requests after it wait until it is answered.
+  struct ParkedCall {
+    BaseProcedure *proc;
+    size_t index;         // its slot in the procedure's queue
+    unsigned int xid;
+    uint32_t flags;
+    uint32_t header_len;
+    bool compression;
+    WireFormat wire;
+  } parked = {};
   Connection *next_lru;
   Connection *next_mru;
   uint64_t last_active_sec;
@@ -65,15 +90,21 @@ class Connection final {
  private:
   bool HandleRequest(uint8_t *in_bytes, uint32_t *in_len,
                      uint8_t *out_bytes, uint32_t *out_len);
+  uint32_t FillReply(uint8_t *out_bytes, uint32_t header_len, unsigned int xid,
+                     uint32_t lease_ms, uint32_t flags, bool compression, uint32_t len);
+  bool AnswerParked();
+  bool RunCompound(uint8_t *in_bytes, uint32_t *in_len,
+                   uint8_t *out_bytes, uint32_t *out_len, bool *ok, WireFormat wire);
+  bool StreamReply(uint8_t *out_bytes, uint32_t *out_len);
+  bool TakeChunk(bool *ok);
+  bool TakeCancel();
   void DeleteFromLRU();
-  template <typename T, typename ...Args> bool FillErrorResponse(
-      uint8_t *out_bytes, uint32_t *out_len, Args... args) {
-    if (*out_len < sizeof(T)) return false;
-    has_error = true;
-    *out_len = sizeof(T);
-    new (out_bytes) T(args...);
-    return true;
-  }
+  bool HoldLease(int instance_id, uint64_t until_us);
+  bool RevokeLease(int instance_id, uint64_t now_us);
+  void PutRevocations();
+  uint32_t PutCallback(uint8_t *out_bytes, unsigned int prog, unsigned int proc);
+  template <typename T> bool FillErrorResponse(
+      uint8_t *out_bytes, uint32_t *out_len, unsigned int xid, unsigned int stat);
 };
 
 
@@ -87,6 +118,15 @@ static bool SetSocketNonBlocking(int sock)
   return true;
 }
 
+// Both ends coalesce pipelined messages themselves, so Nagle would only add
+// delayed-ACK stalls between a batch and its replies.
+static void SetSocketNoDelay(int sock)
+{
+  int one = 1;
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(int)) < 0)
+    perror("setsockopt(TCP_NODELAY)");
+}
+
 static bool SetSocketBlocking(int sock)
 {
   int fl = fcntl(sock, F_GETFL);
@@ -97,6 +137,22 @@ static bool SetSocketBlocking(int sock)
   return true;
 }
 
+// Writes all len bytes to a non-blocking socket, blocking until it can.
+static bool WriteAll(int fd, const uint8_t *p, size_t len)
+{
+  SetSocketBlocking(fd);
+  for (size_t sent = 0; sent < len;) {
+    auto nbytes = write(fd, p + sent, len - sent);
+    if (nbytes < 0 && errno == EINTR)
+      continue;
+    if (nbytes <= 0)
+      return false;
+    sent += nbytes;
+  }
+  SetSocketNonBlocking(fd);
+  return true;
+}
+
 static uint64_t GetTimestamp()
 {
   struct timeval tv;
@@ -104,6 +160,13 @@ static uint64_t GetTimestamp()
   return tv.tv_sec;
 }
 
+static uint64_t GetMicroseconds()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
 Connection::Connection(Server *srv, int fd)
     : srv(srv), fd(fd), has_error(false)
 {
@@ -185,6 +248,317 @@ struct SunRpcAcceptHeader : public SunRpcReplyHeader {
       : SunRpcReplyHeader(xid), verf_null(0), verf_len(0), accept_stat(htonl(accept_stat)) {}
 };
 
+// rpcxx extensions to Sun RPC. Calls carry flags in the program version,
+// which we don't otherwise use. Replies carry extra data in a verifier of
+// our own flavor, which a plain Sun RPC peer never asks for.
+static constexpr unsigned int kCallWantsLease = 1;
+// The caller can take compressed replies.
+static constexpr unsigned int kCallTakesCompression = 2;
+// The arguments are a CompressedBody.
+static constexpr unsigned int kCallCompressed = 4;
+// The arguments come after a BodyChecksum, and so will the result.
+static constexpr unsigned int kCallChecksummed = 8;
+// The last chunk of a stream from the client.
+static constexpr unsigned int kCallEndsStream = 16;
+// The arguments are a batch of calls to the procedure: their number, as an
+// XDR unsigned int, then the arguments of each. Their results are streamed
+// back like items, each reply a count and that many results.
+static constexpr unsigned int kCallBatch = 32;
+// Nothing answers the call, unless it fails. See BaseClient::SendOneWay().
+static constexpr unsigned int kCallOneWay = 64;
+// The caller can switch to compact headers.
+static constexpr unsigned int kCallTakesCompactHeader = 128;
+// Bits 8-15 of the version hold the WireFormat of the arguments. The reply
+// uses the same one.
+static constexpr unsigned int kCallWireShift = 8;
+static constexpr unsigned int kCallWireMask = 0xff << kCallWireShift;
+// Every message after this call, both ways, has a compact header. Only sent
+// once the server has said it takes them, on a call it answers with one
+// reply.
+static constexpr unsigned int kCallSwitchesHeader = 1 << 16;
+static constexpr unsigned int kRpcxxVerfFlavor = 0x52505858; // "RPXX"
+static constexpr unsigned int kMaxVerfBody = 16;
+
+// Server-to-client callback (a CALL on the reply stream) that drops cached
+// replies of the instance in prog.
+static constexpr unsigned int kRevokeLeasesProc = 0xffffffff;
+// Client-to-server call, with no arguments, that ends the stream opened by
+// the call with the same xid. Nothing answers it but the end of the stream.
+static constexpr unsigned int kCancelStreamProc = 0xfffffffe;
+// Client-to-server call whose arguments are a chain of calls, run in order
+// by Connection::RunCompound(). prog is unused.
+static constexpr unsigned int kCompoundProc = 0xfffffffc;
+// Client-to-server call, with no arguments, answered with the number of
+// one-way calls run on the connection since the last one, as an XDR unsigned
+// int. prog is unused.
+static constexpr unsigned int kAckOneWayProc = 0xfffffffb;
+// Client-to-server call, the first on the connection, with a Sun RPC
+// header. Its arguments are the client's kProtocolVersion and Feature bits,
+// as XDR unsigned ints; it is answered, with a Sun RPC header too, by the
+// fields of a PeerInfo. If the client takes compact headers and so does the
+// server, every call and reply after it has one. prog and vers are unused.
+static constexpr unsigned int kHandshakeProc = 0xfffffffa;
+// Client-to-server call carrying items for the stream opened by the call
+// with the same xid, in its wire format: their length, or a BodyChecksum if
+// the chunk is kCallChecksummed, then the items. Answered with an ack once
+// the handler has had them all.
+static constexpr unsigned int kStreamChunkProc = 0xfffffffd;
+
+// Flags in our verifier. The server takes compressed calls on this
+// connection from now on; sent once, on the first reply to a call offering
+// compression.
+static constexpr unsigned int kReplyTakesCompression = 1;
+// The result is a CompressedBody.
+static constexpr unsigned int kReplyCompressed = 2;
+// The result comes after a BodyChecksum.
+static constexpr unsigned int kReplyChecksummed = 4;
+// Every reply but the last to a streaming call carries one item. This one,
+// with no result, ends the stream.
+static constexpr unsigned int kReplyEndsStream = 8;
+// No result: acks the oldest chunk of the client's stream not acked yet.
+static constexpr unsigned int kReplyStreamAck = 16;
+// The server takes compact headers on this connection; sent once, like
+// kReplyTakesCompression.
+static constexpr unsigned int kReplyTakesCompactHeader = 32;
+// Answers the kCallSwitchesHeader call. The last reply with a Sun RPC
+// header.
+static constexpr unsigned int kReplySwitchesHeader = 64;
+
+struct SunRpcRpcxxAcceptHeader : public SunRpcReplyHeader {
+  unsigned int verf_flavor;
+  unsigned int verf_len;
+  unsigned int lease_ms;
+  unsigned int flags;
+  unsigned int accept_stat;
+
+  SunRpcRpcxxAcceptHeader(unsigned int xid, unsigned int lease_ms, unsigned int flags)
+      : SunRpcReplyHeader(xid), verf_flavor(htonl(kRpcxxVerfFlavor)),
+        verf_len(htonl(2 * sizeof(unsigned int))), lease_ms(htonl(lease_ms)),
+        flags(htonl(flags)), accept_stat(0) {}
+};
+
+// Compact headers replace the Sun RPC ones once a connection switches to
+// them. A call's is the VarintLength of its xid, prog, proc plus
+// kCompactProcBias, which puts our own procedures at the top of the range in
+// one byte too, and vers. A reply's is the VarintLength of its xid, then of
+// its flags << kCompactFlagsShift, kCompactLeased if the VarintLength of the
+// lease follows, and its accept_stat, or kCompactCallback for a call from
+// the server, whose prog and proc follow as in a call. Nothing is left of
+// the rest of the Sun RPC headers: we only ever send them empty.
+static constexpr unsigned int kCompactProcBias = 8;
+static constexpr unsigned int kCompactStatMask = 7;
+static constexpr unsigned int kCompactCallback = 7;
+static constexpr unsigned int kCompactLeased = 8;
+static constexpr unsigned int kCompactFlagsShift = 4;
+static constexpr uint32_t kMaxCompactCallHeader = 4 * VarintLength::MAX_SIZE;
+static constexpr uint32_t kMaxCompactReplyHeader = 3 * VarintLength::MAX_SIZE;
+
+// Writes the header of call, whose fields are in network order, compact or
+// not. Returns its size.
+static uint32_t PutCallHeader(uint8_t *p, const SunRpcCallBody &call, bool compact)
+{
+  if (!compact) {
+    memcpy(p, &call, sizeof(SunRpcCallBody));
+    return sizeof(SunRpcCallBody);
+  }
+  uint32_t n = VarintLength::Encode(p, ntohl(call.xid));
+  n += VarintLength::Encode(p + n, ntohl(call.prog));
+  n += VarintLength::Encode(p + n, ntohl(call.proc) + kCompactProcBias);
+  n += VarintLength::Encode(p + n, ntohl(call.vers));
+  return n;
+}
+
+// Reads a call header, compact or not, into *call, in network order. Like a
+// Decode(), returns false if it hasn't all arrived, and also clears *ok if
+// it can't be one. Sets *len to its size.
+static bool TakeCallHeader(const uint8_t *p, uint32_t *len, bool compact,
+                           SunRpcCallBody *call, bool *ok)
+{
+  if (!compact) {
+    if (*len < sizeof(SunRpcCallBody)) return false;
+    memcpy(call, p, sizeof(SunRpcCallBody));
+    *len = sizeof(SunRpcCallBody);
+    return true;
+  }
+  uint32_t v[4], off = 0, used;
+  for (auto &x: v) {
+    if (!VarintLength::Decode(p + off, *len - off, ok, &x, &used)) return false;
+    off += used;
+  }
+  memset(call, 0, sizeof(SunRpcCallBody));
+  call->xid = htonl(v[0]);
+  call->rpcvers = htonl(2);
+  call->prog = htonl(v[1]);
+  call->proc = htonl(v[2] - kCompactProcBias);
+  call->vers = htonl(v[3]);
+  *len = off;
+  return true;
+}
+
+// Size of the reply header PutReplyHeader() writes.
+static uint32_t ReplyHeaderSize(unsigned int xid, unsigned int accept_stat,
+                                uint32_t lease_ms, uint32_t flags, bool compact)
+{
+  if (!compact) {
+    return accept_stat == 0 && (lease_ms || flags)
+        ? sizeof(SunRpcRpcxxAcceptHeader) : sizeof(SunRpcAcceptHeader);
+  }
+  return VarintLength::Size(ntohl(xid))
+      + VarintLength::Size(flags << kCompactFlagsShift
+                           | (lease_ms ? kCompactLeased : 0) | accept_stat)
+      + (lease_ms ? VarintLength::Size(lease_ms) : 0);
+}
+
+// Writes the header of a reply to the call with xid, as on the wire. A Sun
+// RPC one has our verifier if lease_ms or flags need it, which a failed call
+// never does. Returns its size.
+static uint32_t PutReplyHeader(uint8_t *p, unsigned int xid, unsigned int accept_stat,
+                               uint32_t lease_ms, uint32_t flags, bool compact)
+{
+  if (!compact) {
+    if (accept_stat == 0 && (lease_ms || flags)) {
+      new (p) SunRpcRpcxxAcceptHeader(xid, lease_ms, flags);
+      return sizeof(SunRpcRpcxxAcceptHeader);
+    }
+    new (p) SunRpcAcceptHeader(xid, accept_stat);
+    return sizeof(SunRpcAcceptHeader);
+  }
+  uint32_t n = VarintLength::Encode(p, ntohl(xid));
+  n += VarintLength::Encode(p + n, flags << kCompactFlagsShift
+                            | (lease_ms ? kCompactLeased : 0) | accept_stat);
+  if (lease_ms)
+    n += VarintLength::Encode(p + n, lease_ms);
+  return n;
+}
+
+// Fails the call with xid, and with it the connection. A compact header has
+// no credentials to reject nor versions to mismatch, so only a Sun RPC one
+// is a T.
+template <typename T>
+bool Connection::FillErrorResponse(uint8_t *out_bytes, uint32_t *out_len,
+                                   unsigned int xid, unsigned int stat)
+{
+  if (*out_len < sizeof(T)) return false;
+  has_error = true;
+  if (compact_replies) {
+    *out_len = PutReplyHeader(out_bytes, xid, stat, 0, 0, true);
+  } else {
+    *out_len = sizeof(T);
+    new (out_bytes) T(xid, stat);
+  }
+  return true;
+}
+
+// Sits between a message's header and its body, which is len bytes long.
+// crc is the CRC32C of the header, len and the body, so corruption anywhere
+// but in crc itself is caught before anything is decoded.
+struct BodyChecksum {
+  unsigned int len;
+  unsigned int crc;
+};
+
+// Fills in the BodyChecksum after the header_len bytes at p, for a body of
+// len bytes after it, into which the gather list, if any, is spliced.
+static void FillChecksum(uint8_t *p, uint32_t header_len, uint32_t len,
+                         const std::vector<GatherSlice> *gather = nullptr)
+{
+  auto body = p + header_len + sizeof(BodyChecksum);
+  size_t body_len = len;
+  if (gather) {
+    for (auto &slice: *gather) body_len += slice.len;
+  }
+  BodyChecksum sum;
+  sum.len = htonl(body_len);
+  memcpy(p + header_len, &sum.len, sizeof(unsigned int));
+  auto crc = Crc32c(0, p, header_len + sizeof(unsigned int));
+  uint32_t from = 0;
+  if (gather) {
+    for (auto &slice: *gather) {
+      crc = Crc32c(crc, body + from, slice.offset - from);
+      crc = Crc32c(crc, slice.data, slice.len);
+      from = slice.offset;
+    }
+  }
+  sum.crc = htonl(Crc32c(crc, body + from, len - from));
+  memcpy(p + header_len, &sum, sizeof(BodyChecksum));
+}
+
+// Checks the BodyChecksum after the header_len bytes at p, which *len more
+// bytes follow. Like a Decode(), returns false if the body hasn't all
+// arrived yet, and also clears *ok if it is corrupt or longer than max_len.
+// Sets *len to the length of the body.
+static bool VerifyChecksum(const uint8_t *p, uint32_t header_len, uint32_t *len,
+                           bool *ok, uint32_t max_len)
+{
+  BodyChecksum sum;
+  if (*len < sizeof(BodyChecksum)) return false;
+  memcpy(&sum, p + header_len, sizeof(BodyChecksum));
+  uint32_t body_len = ntohl(sum.len);
+  if (body_len > max_len) {
+    *ok = false;
+    return false;
+  }
+  if (*len - sizeof(BodyChecksum) < body_len) return false;
+  auto crc = Crc32c(0, p, header_len + sizeof(unsigned int));
+  if (Crc32c(crc, p + header_len + sizeof(BodyChecksum), body_len) != ntohl(sum.crc)) {
+    *ok = false;
+    return false;
+  }
+  *len = body_len;
+  return true;
+}
+
+// A body compressed with CompressBlock(): its decompressed size, the size of
+// the block, then the block.
+struct CompressedBody {
+  unsigned int raw_len;
+  unsigned int len;
+};
+
+// Compresses the len bytes at p in place, if that makes them smaller.
+// Returns the new length.
+static uint32_t CompressBody(uint8_t *p, uint32_t len, std::vector<uint8_t> *scratch)
+{
+  if (len <= sizeof(CompressedBody) + 1)
+    return len;
+  if (scratch->size() < CompressBlockBound(len))
+    scratch->resize(CompressBlockBound(len));
+  auto n = CompressBlock(scratch->data(), len - sizeof(CompressedBody) - 1, p, len);
+  if (n == 0)
+    return len;
+  CompressedBody body{htonl(len), htonl((uint32_t) n)};
+  memcpy(p, &body, sizeof(CompressedBody));
+  memcpy(p + sizeof(CompressedBody), scratch->data(), n);
+  return sizeof(CompressedBody) + n;
+}
+
+// Decompresses the CompressedBody at p into scratch and sets *raw_len to its
+// size. Like a Decode(), returns false if *in_len doesn't hold all of it yet,
+// and also clears *ok if it is corrupt or decompresses to more than max_len.
+static bool DecompressBody(const uint8_t *p, uint32_t *in_len, bool *ok,
+                           std::vector<uint8_t> *scratch, uint32_t max_len,
+                           uint32_t *raw_len)
+{
+  CompressedBody body;
+  if (*in_len < sizeof(CompressedBody)) return false;
+  memcpy(&body, p, sizeof(CompressedBody));
+  *raw_len = ntohl(body.raw_len);
+  uint32_t len = ntohl(body.len);
+  if (*raw_len > max_len) {
+    *ok = false;
+    return false;
+  }
+  if (*in_len - sizeof(CompressedBody) < len) return false;
+  if (scratch->size() < *raw_len)
+    scratch->resize(*raw_len);
+  if (!DecompressBlock(scratch->data(), *raw_len, p + sizeof(CompressedBody), len)) {
+    *ok = false;
+    return false;
+  }
+  *in_len = sizeof(CompressedBody) + len;
+  return true;
+}
+
 struct SunRpcAcceptMismatch : public SunRpcAcceptHeader {
   unsigned int lo = 0, hi = 0;
   using SunRpcAcceptHeader::SunRpcAcceptHeader;
@@ -195,35 +569,182 @@ bool Connection::HandleRequest(uint8_t *in_bytes, uint32_t *in_len,
                                uint8_t *out_bytes, uint32_t *out_len)
 {
   // Since we don't support authentications, our RpcCallBody is fixed-size.
-  if (*in_len < sizeof(SunRpcCallBody))
-    return false;
   SunRpcCallBody callbody;
-  memcpy(&callbody, in_bytes, sizeof(SunRpcCallBody));
+  uint32_t call_len = *in_len;
+  bool ok = true;
+  if (!TakeCallHeader(in_bytes, &call_len, compact_calls, &callbody, &ok)) {
+    if (ok)
+      return false;
+    fprintf(stderr, "Call header is corrupt\n");
+    // GARBAGE_ARGS
+    *in_len = 0;
+    return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, 0, 4);
+  }
   if (callbody.type != 0 || callbody.cred_null != 0 || callbody.cred_length != 0
       || callbody.verf_null != 0 || callbody.verf_length != 0) {
     *in_len = 0;
     return FillErrorResponse<SunRpcRejectAuthBody>(out_bytes, out_len, callbody.xid, 2);
   }
+  // Nothing in a checksummed call is trusted before all of it has arrived
+  // intact.
+  auto vers = ntohl(callbody.vers);
+  bool checksummed = vers & kCallChecksummed;
+  auto args = in_bytes + call_len;
+  uint32_t args_len = *in_len - call_len;
+  uint32_t frame_len = checksummed ? sizeof(BodyChecksum) : 0;
+  if (checksummed) {
+    if (!VerifyChecksum(in_bytes, call_len, &args_len, &ok,
+                        BaseService::kMaxLargeRequestSize)) {
+      if (ok)
+        return false;
+      fprintf(stderr, "Call fails its checksum\n");
+      // GARBAGE_ARGS
+      *in_len = 0;
+      return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+    }
+    args += sizeof(BodyChecksum);
+  }
+
   auto instance_id = ntohl(callbody.prog);
   auto func_id = ntohl(callbody.proc);
-  auto svc = srv->LookupService(instance_id, func_id);
-  if (svc == nullptr) {
+  bool compound = func_id == kCompoundProc;
+  bool ack = func_id == kAckOneWayProc;
+  bool handshake = func_id == kHandshakeProc;
+  auto svc = compound || ack || handshake ? nullptr : srv->LookupService(instance_id, func_id);
+  if (svc == nullptr && !compound && !ack && !handshake) {
     // PROG_MISMATCH
     fprintf(stderr, "Server cannot find instance %d and procedure %d\n", instance_id, func_id);
     *in_len = 0;
     return FillErrorResponse<SunRpcAcceptMismatch>(out_bytes, out_len, callbody.xid, 2);
   }
-  uint32_t param_in_len = *in_len - sizeof(SunRpcCallBody);
-  uint32_t param_out_len = *out_len - sizeof(SunRpcAcceptHeader);
-  bool ok = true;
+  auto wire = (vers & kCallWireMask) >> kCallWireShift;
+  if (wire >= kNrWireFormats) {
+    fprintf(stderr, "Call uses unknown wire format %u\n", wire);
+    // GARBAGE_ARGS
+    *in_len = 0;
+    return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+  }
+  bool compression = (vers & kCallTakesCompression) && srv->compression_min_bytes > 0;
+  if ((vers & kCallCompressed) && srv->compression_min_bytes == 0) {
+    fprintf(stderr, "Call is compressed, but compression is off\n");
+    // GARBAGE_ARGS
+    *in_len = 0;
+    return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+  }
+  if (handshake && (compact_acked || vers != 0)) {
+    fprintf(stderr, "Handshake comes too late or with flags\n");
+    // GARBAGE_ARGS
+    *in_len = 0;
+    return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+  }
+  auto proc = svc ? svc->proc_entries[func_id] : nullptr;
+  bool one_way = vers & kCallOneWay;
+  if (one_way && (!proc || !proc->one_way || (vers & kCallBatch))) {
+    fprintf(stderr, "Call is one-way, but procedure %d doesn't allow it\n", func_id);
+    // GARBAGE_ARGS
+    *in_len = 0;
+    return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+  }
+  // The reply to the call that switches headers must be the last before the
+  // switch, so the call must be answered by one.
+  bool switches = vers & kCallSwitchesHeader;
+  if (switches && (!compact_acked || compact_calls || one_way || (vers & kCallBatch)
+                   || (proc && proc->streams))) {
+    fprintf(stderr, "Call cannot switch to compact headers\n");
+    // GARBAGE_ARGS
+    *in_len = 0;
+    return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+  }
+  // Coalesced calls are answered later, after any revocation sent meanwhile,
+  // so they must not hand out leases.
+  bool coalesce = proc && srv->coalescing && proc->batches && proc->lease_ms == 0
+      && !proc->revokes_leases && !(vers & (kCallBatch | kCallOneWay))
+      && proc->nr_queued < BaseService::kMaxBatchCalls;
+  // The lease itself waits for the arguments to decode.
+  bool leases = (vers & kCallWantsLease) && proc && proc->lease_ms > 0;
+  uint32_t flags = compression && !compression_acked ? kReplyTakesCompression : 0;
+  if (checksummed) flags |= kReplyChecksummed;
+  if ((vers & kCallTakesCompactHeader) && !compact_acked) flags |= kReplyTakesCompactHeader;
+  if (switches) flags |= kReplySwitchesHeader;
+  // Room for our verifier whenever the reply might need it.
+  uint32_t header_len = compact_replies ? kMaxCompactReplyHeader
+      : leases || compression || flags
+      ? sizeof(SunRpcRpcxxAcceptHeader) : sizeof(SunRpcAcceptHeader);
+  if (*out_len < header_len + frame_len)
+    return false;
+
+  // With a checksum or compression, we know where the arguments end, and
+  // they must decode to exactly that.
+  bool sized = checksummed;
+  uint32_t param_in_len = args_len;
+  uint32_t param_out_len = *out_len - header_len - frame_len;
+
+  if (vers & kCallCompressed) {
+    uint32_t len = args_len;
+    if (!DecompressBody(args, &len, &ok, &zbuf,
+                        BaseService::kMaxLargeRequestSize, &param_in_len)
+        || (checksummed && len != args_len)) {
+      if (ok && !checksummed)
+        return false;
+      fprintf(stderr, "Cannot decompress arguments!\n");
+      // GARBAGE_ARGS
+      *in_len = 0;
+      return FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, callbody.xid, 4);
+    }
+    args = zbuf.data();
+    args_len = len;
+    sized = true;
+  }
+  uint32_t raw_len = param_in_len;
 
-  auto proc = svc->proc_entries[func_id];
   if (srv->log_enabled)
     printf("Server invoking instance %d procedure %d\n", instance_id, func_id);
-  bool consume = proc->DecodeAndExecute(
-      in_bytes + sizeof(SunRpcCallBody), &param_in_len,
-      out_bytes + sizeof(SunRpcAcceptHeader), &param_out_len,
-      &ok);
+  auto body = out_bytes + header_len + frame_len;
+  std::unique_ptr<BaseStream> items;
+  bool consume;
+  uint32_t client_features = 0;
+  if (handshake) {
+    unsigned int hello[2];
+    consume = args_len >= sizeof(hello);
+    if (consume) {
+      memcpy(hello, args, sizeof(hello));
+      client_features = ntohl(hello[1]);
+      uint32_t features = kFeatureChecksums | kFeatureCompactHeaders | kFeatureStreams
+          | kFeatureBatches | kFeatureCompound | kFeatureOneWay | kFeatureWireFormats
+          | (srv->compression_min_bytes > 0 ? kFeatureCompression : 0);
+      unsigned int info[4] = {
+        htonl(std::min(ntohl(hello[0]), kProtocolVersion)), htonl(features),
+        htonl(BaseService::kMaxLargeRequestSize), htonl(BaseService::kMaxResponseSize)};
+      memcpy(body, info, sizeof(info));
+      param_in_len = sizeof(hello);
+      param_out_len = sizeof(info);
+    }
+  } else if (ack) {
+    param_out_len = sizeof(unsigned int);
+    auto n = htonl(nr_one_way);
+    memcpy(body, &n, sizeof(unsigned int));
+    nr_one_way = 0;
+    param_in_len = 0;
+    consume = true;
+  } else if (compound) {
+    consume = RunCompound(args, &param_in_len, body, &param_out_len, &ok,
+                          (WireFormat) wire);
+  } else if (vers & kCallBatch) {
+    items.reset(proc->DecodeAndRunBatch(args, &param_in_len, &ok, (WireFormat) wire));
+    consume = items != nullptr;
+  } else if (proc->streams) {
+    items.reset(proc->DecodeAndOpen(args, &param_in_len, &ok, (WireFormat) wire));
+    consume = items != nullptr;
+  } else if (coalesce) {
+    consume = proc->DecodeQueued(args, &param_in_len, &ok, (WireFormat) wire);
+  } else {
+    consume = proc->DecodeAndExecute(
+        args, &param_in_len,
+        body, &param_out_len,
+        &ok, (WireFormat) wire);
+  }
+  if (sized && consume && param_in_len != raw_len)
+    ok = false;
   if (!ok) {
     fprintf(stderr, "Procedure::DecodeAndExecute() fail to parse arguments!\n");
     // GARBAGE_ARGS
@@ -232,12 +753,436 @@ bool Connection::HandleRequest(uint8_t *in_bytes, uint32_t *in_len,
   }
   if (!consume)
     return false;
-  new (out_bytes) SunRpcAcceptHeader(callbody.xid, 0);
-  *in_len = sizeof(SunRpcCallBody) + param_in_len;
-  *out_len = sizeof(SunRpcAcceptHeader) + param_out_len;
+  uint32_t lease_ms = 0;
+  if (leases && HoldLease(instance_id, GetMicroseconds() + proc->lease_ms * 1000ULL))
+    lease_ms = proc->lease_ms;
+  if (!(vers & kCallCompressed))
+    args_len = param_in_len;
+  if (proc && proc->revokes_leases)
+    revoked_instance = instance_id;
+  *in_len = call_len + frame_len + args_len;
+  if (switches)
+    compact_calls = true;
+
+  if (items) {
+    // Nothing to send yet: StreamReply() answers with one item at a time.
+    bool input = items->takes_input();
+    stream = OpenStream{std::move(items), callbody.xid, flags, compression, false,
+                        input, false, false, false, 0};
+    if (flags & kReplyTakesCompression)
+      compression_acked = true;
+    if (flags & kReplyTakesCompactHeader)
+      compact_acked = true;
+    *out_len = 0;
+    return true;
+  }
+  if (one_way) {
+    nr_one_way++;
+    *out_len = 0;
+    return true;
+  }
+  if (coalesce) {
+    // Answered by AnswerParked() once the server has run the queue.
+    if (proc->nr_queued == 0)
+      srv->coalesced_procs.push_back(proc);
+    parked = ParkedCall{proc, proc->nr_queued++, callbody.xid, flags, header_len,
+                        compression, (WireFormat) wire};
+    srv->coalesced.push_back(this);
+    *out_len = 0;
+    return true;
+  }
+  *out_len = FillReply(out_bytes, header_len, callbody.xid, lease_ms, flags,
+                       compression, param_out_len);
+  // The handshake's reply is the last with a Sun RPC header, as if it had
+  // switched them.
+  if (handshake && (client_features & kFeatureCompactHeaders))
+    compact_acked = compact_calls = compact_replies = true;
+  if (handshake && (client_features & kFeatureCompression) && srv->compression_min_bytes > 0)
+    compression_acked = true;
+  return true;
+}
+
+// A compound call's arguments, as XDR unsigned ints: the number of
+// operations, then for each its instance, procedure, flags and number of
+// arguments, each of which is a piece: kCompoundRef plus the index of an
+// earlier operation, whose result it is, or the length of the argument
+// encoded in the call, followed by it.
+static constexpr unsigned int kCompoundRef = 0x80000000;
+// The operation's result is part of the reply.
+static constexpr unsigned int kCompoundOpReturned = 1;
+
+static bool TakeUint(const uint8_t *p, uint32_t len, uint32_t *off, unsigned int *x)
+{
+  if (len - *off < sizeof(unsigned int)) return false;
+  memcpy(x, p + *off, sizeof(unsigned int));
+  *x = ntohl(*x);
+  *off += sizeof(unsigned int);
+  return true;
+}
+
+// Runs the operations of a compound call in order. A result stands in for
+// an argument just as it was encoded, so chaining calls takes no knowledge
+// of their types. The reply holds the results the call asks for, back to
+// back. Like DecodeAndExecute() otherwise. An operation that fails ends the
+// chain, after the ones before it have run.
+bool Connection::RunCompound(uint8_t *in_bytes, uint32_t *in_len,
+                             uint8_t *out_bytes, uint32_t *out_len,
+                             bool *ok, WireFormat wire)
+{
+  // All of it must be here before anything runs, since nothing can be run
+  // twice.
+  uint32_t off = 0;
+  unsigned int nr_ops, op[4]; // instance, procedure, flags, arguments
+  if (!TakeUint(in_bytes, *in_len, &off, &nr_ops))
+    return false;
+  if (nr_ops == 0 || nr_ops > BaseService::kMaxCompoundOps) {
+    *ok = false;
+    return false;
+  }
+  for (unsigned int i = 0; i < nr_ops; i++) {
+    for (auto &x: op) {
+      if (!TakeUint(in_bytes, *in_len, &off, &x)) return false;
+    }
+    for (unsigned int j = 0; j < op[3]; j++) {
+      unsigned int piece;
+      if (!TakeUint(in_bytes, *in_len, &off, &piece)) return false;
+      if (piece & kCompoundRef) {
+        if ((piece & ~kCompoundRef) >= i) {
+          *ok = false;
+          return false;
+        }
+      } else if (*in_len - off < piece) {
+        return false;
+      } else {
+        off += piece;
+      }
+    }
+  }
+  *in_len = off;
+
+  std::array<uint8_t, BaseService::kMaxCompoundOps * BaseService::kMaxResponseSize> results;
+  std::array<uint32_t, BaseService::kMaxCompoundOps> result_len;
+  uint32_t used = 0;
+  off = sizeof(unsigned int);
+  for (unsigned int i = 0; i < nr_ops; i++) {
+    for (auto &x: op)
+      TakeUint(in_bytes, *in_len, &off, &x);
+    auto svc = srv->LookupService(op[0], op[1]);
+    if (svc == nullptr || svc->proc_entries[op[1]]->streams) {
+      fprintf(stderr, "Compound call cannot run instance %d procedure %d\n", op[0], op[1]);
+      *ok = false;
+      return false;
+    }
+    auto proc = svc->proc_entries[op[1]];
+    compound_args.clear();
+    for (unsigned int j = 0; j < op[3]; j++) {
+      unsigned int piece = 0;
+      TakeUint(in_bytes, *in_len, &off, &piece);
+      if (piece & kCompoundRef) {
+        auto result = results.data() + (piece & ~kCompoundRef) * BaseService::kMaxResponseSize;
+        compound_args.insert(compound_args.end(), result,
+                             result + result_len[piece & ~kCompoundRef]);
+      } else {
+        compound_args.insert(compound_args.end(), in_bytes + off, in_bytes + off + piece);
+        off += piece;
+      }
+    }
+    uint32_t args_len = compound_args.size();
+    auto result = results.data() + i * BaseService::kMaxResponseSize;
+    result_len[i] = BaseService::kMaxResponseSize;
+    if (!proc->DecodeAndExecute(compound_args.data(), &args_len, result, &result_len[i],
+                                ok, wire)
+        || args_len != compound_args.size()) {
+      *ok = false;
+      return false;
+    }
+    if (proc->revokes_leases)
+      revoked_instance = op[0];
+    if (op[2] & kCompoundOpReturned) {
+      if (*out_len - used < result_len[i]) {
+        *ok = false;
+        return false;
+      }
+      memcpy(out_bytes + used, result, result_len[i]);
+      used += result_len[i];
+    }
+  }
+  *out_len = used;
+  return true;
+}
+
+// Puts the reply header, and the checksum if flags ask for one, in front of
+// the len bytes of result after header_len and the checksum's room,
+// compressing them first if the client takes that. Returns the reply's size.
+uint32_t Connection::FillReply(uint8_t *out_bytes, uint32_t header_len, unsigned int xid,
+                               uint32_t lease_ms, uint32_t flags, bool compression,
+                               uint32_t len)
+{
+  uint32_t frame_len = flags & kReplyChecksummed ? sizeof(BodyChecksum) : 0;
+  auto body = out_bytes + header_len + frame_len;
+  if (compression && len >= srv->compression_min_bytes) {
+    auto n = CompressBody(body, len, &zbuf);
+    if (n < len) flags |= kReplyCompressed;
+    len = n;
+  }
+  auto n = ReplyHeaderSize(xid, 0, lease_ms, flags, compact_replies);
+  if (n < header_len) {
+    // Nothing for the verifier after all, or a compact header.
+    memmove(out_bytes + n + frame_len, body, len);
+    header_len = n;
+  }
+  PutReplyHeader(out_bytes, xid, 0, lease_ms, flags, compact_replies);
+  if (frame_len)
+    FillChecksum(out_bytes, header_len, len);
+  if (flags & kReplyTakesCompression)
+    compression_acked = true;
+  if (flags & kReplyTakesCompactHeader)
+    compact_acked = true;
+  if (flags & kReplySwitchesHeader)
+    compact_replies = true;
+  return header_len + frame_len + len;
+}
+
+// Appends the reply to the parked call, whose procedure has run. Returns
+// false if outbuf has no room for it.
+bool Connection::AnswerParked()
+{
+  auto call = parked;
+  parked.proc = nullptr;
+  if (!outbuf.Slide(BaseService::kMaxResponseSize))
+    return false;
+  uint32_t frame_len = call.flags & kReplyChecksummed ? sizeof(BodyChecksum) : 0;
+  uint32_t len = outbuf.residual_size() - call.header_len - frame_len;
+  if (!call.proc->EncodeQueued(call.index, outbuf.residual() + call.header_len + frame_len,
+                               &len, call.wire)) {
+    fprintf(stderr, "Procedure::EncodeQueued() fail to encode the result!\n");
+    uint32_t out_len = outbuf.residual_size();
+    // SYSTEM_ERR
+    FillErrorResponse<SunRpcAcceptHeader>(outbuf.residual(), &out_len, call.xid, 5);
+    outbuf.end += out_len;
+    return true;
+  }
+  outbuf.end += FillReply(outbuf.residual(), call.header_len, call.xid, 0, call.flags,
+                          call.compression, len);
+  return true;
+}
+
+// Writes the next reply to the open stream's call: an item, the ack of a
+// chunk from the client, or once there is nothing more, the reply that ends
+// the stream. Returns false if that has to wait for the client's next chunk.
+// *out_len must have room for a reply of kMaxResponseSize.
+bool Connection::StreamReply(uint8_t *out_bytes, uint32_t *out_len)
+{
+  uint32_t flags = stream.flags;
+  uint32_t frame_len = flags & kReplyChecksummed ? sizeof(BodyChecksum) : 0;
+  // Room for our verifier, even after a plain header.
+  auto body = out_bytes + sizeof(SunRpcRpcxxAcceptHeader) + frame_len;
+  uint32_t len = BaseService::kMaxResponseSize - sizeof(SunRpcRpcxxAcceptHeader) - frame_len;
+  bool ok = true;
+  bool item = false;
+  unsigned int accept_stat = 5; // SYSTEM_ERR: an item doesn't fit in a reply
+  stream.needs_input = false;
+  // The handler's replies to the items of a chunk go out before its ack, and
+  // the next chunk is only taken after that.
+  while (!stream.cancelled) {
+    if ((item = stream.items->Next(body, &len, &ok)) || !ok || !stream.input)
+      break;
+    accept_stat = 4; // GARBAGE_ARGS
+    if (stream.chunk_left > 0) {
+      uint32_t n = stream.chunk_left;
+      if (!stream.items->Feed(inbuf.data(), &n, &ok)) {
+        ok = false;
+        break;
+      }
+      inbuf.start += n;
+      stream.chunk_left -= n;
+      continue;
+    }
+    if (stream.ack_owed) {
+      stream.ack_owed = false;
+      if (stream.last_chunk) {
+        stream.input = false;
+        stream.items->EndInput();
+      }
+      flags |= kReplyStreamAck;
+      len = 0;
+      break;
+    }
+    if (!TakeChunk(&ok)) {
+      if (ok) {
+        stream.needs_input = true;
+        return false;
+      }
+      break;
+    }
+  }
+  if (!ok) {
+    fprintf(stderr, "Stream fails with %u\n", accept_stat);
+    FillErrorResponse<SunRpcAcceptHeader>(out_bytes, out_len, stream.xid, accept_stat);
+    stream.items.reset();
+    return true;
+  }
+  if (!item && !(flags & kReplyStreamAck)) {
+    flags |= kReplyEndsStream;
+    len = 0;
+    stream.items.reset();
+  }
+  if (item && stream.compression && len >= srv->compression_min_bytes) {
+    auto n = CompressBody(body, len, &zbuf);
+    if (n < len) flags |= kReplyCompressed;
+    len = n;
+  }
+  auto header_len = ReplyHeaderSize(stream.xid, 0, 0, flags, compact_replies);
+  if (header_len < sizeof(SunRpcRpcxxAcceptHeader))
+    memmove(out_bytes + header_len + frame_len, body, len);
+  PutReplyHeader(out_bytes, stream.xid, 0, 0, flags, compact_replies);
+  if (frame_len)
+    FillChecksum(out_bytes, header_len, len);
+  stream.flags &= ~(kReplyTakesCompression | kReplyTakesCompactHeader);
+  *out_len = header_len + frame_len + len;
+  return true;
+}
+
+// Takes the header of the client's next chunk off inbuf, once all of the
+// chunk has arrived. Like a Decode(), clears *ok if it isn't one.
+bool Connection::TakeChunk(bool *ok)
+{
+  SunRpcCallBody call;
+  uint32_t len = inbuf.data_size();
+  uint32_t call_len = len;
+  if (!TakeCallHeader(inbuf.data(), &call_len, compact_calls, &call, ok))
+    return false;
+  if (call.type != 0 || ntohl(call.proc) != kStreamChunkProc || call.xid != stream.xid) {
+    *ok = false;
+    return false;
+  }
+  auto vers = ntohl(call.vers);
+  len -= call_len;
+  uint32_t frame_len = sizeof(unsigned int);
+  if (vers & kCallChecksummed) {
+    if (!VerifyChecksum(inbuf.data(), call_len, &len, ok,
+                        BaseService::kMaxRequestSize))
+      return false;
+    frame_len = sizeof(BodyChecksum);
+  } else {
+    unsigned int n;
+    if (len < sizeof(unsigned int)) return false;
+    memcpy(&n, inbuf.data() + call_len, sizeof(unsigned int));
+    n = ntohl(n);
+    if (n > BaseService::kMaxRequestSize) {
+      *ok = false;
+      return false;
+    }
+    if (len - sizeof(unsigned int) < n) return false;
+    len = n;
+  }
+  inbuf.start += call_len + frame_len;
+  stream.chunk_left = len;
+  stream.ack_owed = true;
+  stream.last_chunk = vers & kCallEndsStream;
+  return true;
+}
+
+// Consumes a cancellation at the head of inbuf. The stream it names, if it
+// is still open, ends with its next reply.
+bool Connection::TakeCancel()
+{
+  SunRpcCallBody call;
+  uint32_t call_len = inbuf.data_size();
+  bool ok = true;
+  // Not in the middle of a chunk, which holds items rather than calls. A
+  // corrupt header is left for HandleRequest() to fail.
+  if (stream.chunk_left > 0
+      || !TakeCallHeader(inbuf.data(), &call_len, compact_calls, &call, &ok))
+    return false;
+  if (call.type != 0 || ntohl(call.proc) != kCancelStreamProc)
+    return false;
+  if (stream.items && call.xid == stream.xid)
+    stream.cancelled = true;
+  inbuf.start += call_len;
+  return true;
+}
+
+// Writes a call from the server, with no xid nor arguments, to the client.
+// Returns its size, at most that of a SunRpcCallBody.
+uint32_t Connection::PutCallback(uint8_t *out_bytes, unsigned int prog, unsigned int proc)
+{
+  if (!compact_replies) {
+    SunRpcCallBody call;
+    memset(&call, 0, sizeof(SunRpcCallBody));
+    call.rpcvers = htonl(2);
+    call.prog = htonl(prog);
+    call.proc = htonl(proc);
+    memcpy(out_bytes, &call, sizeof(SunRpcCallBody));
+    return sizeof(SunRpcCallBody);
+  }
+  uint32_t n = VarintLength::Encode(out_bytes, 0);
+  n += VarintLength::Encode(out_bytes + n, kCompactCallback);
+  n += VarintLength::Encode(out_bytes + n, prog);
+  n += VarintLength::Encode(out_bytes + n, proc + kCompactProcBias);
+  return n;
+}
+
+bool Connection::HoldLease(int instance_id, uint64_t until_us)
+{
+  auto now = GetMicroseconds();
+  LeaseHold *slot = nullptr;
+  for (size_t i = 0; i < nr_leases; i++) {
+    if (leases[i].instance_id == instance_id) {
+      // Its revocation would reach the client after this reply.
+      if (leases[i].revoked)
+        return false;
+      leases[i].until_us = std::max(leases[i].until_us, until_us);
+      return true;
+    }
+    if (leases[i].until_us <= now) slot = &leases[i];
+  }
+  if (slot == nullptr && nr_leases < kMaxLeaseHolds)
+    slot = &leases[nr_leases++];
+  // Without a slot we couldn't tell this client about revocations.
+  if (slot == nullptr)
+    return false;
+  *slot = LeaseHold{instance_id, until_us, false};
   return true;
 }
 
+// Marks the lease on the instance revoked, if it is live. PutRevocations()
+// tells the client.
+bool Connection::RevokeLease(int instance_id, uint64_t now_us)
+{
+  for (size_t i = 0; i < nr_leases; i++) {
+    if (leases[i].instance_id == instance_id && !leases[i].revoked) {
+      if (leases[i].until_us <= now_us)
+        return false;
+      leases[i].revoked = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Puts the revocations of revoked leases in outbuf, as many as it has room
+// for, and forgets those leases. The rest wait for the client to read.
+void Connection::PutRevocations()
+{
+  // A parked call keeps room for its reply.
+  size_t reserve = (parked.proc ? BaseService::kMaxResponseSize : 0)
+      + sizeof(SunRpcCallBody) - 1;
+  for (size_t i = 0; i < nr_leases;) {
+    if (!leases[i].revoked) {
+      i++;
+      continue;
+    }
+    if (!outbuf.Slide(reserve))
+      return;
+    outbuf.end += PutCallback(outbuf.residual(), leases[i].instance_id, kRevokeLeasesProc);
+    if (srv->log_enabled)
+      printf("Server revokes leases on instance %d for connection %d\n",
+             leases[i].instance_id, fd);
+    leases[i] = leases[--nr_leases];
+  }
+}
+
 Server::Server()
     : should_stop(false)
 {
@@ -396,29 +1341,66 @@ void Server::MainLoop()
 
       auto ok = OnConnectionEvent(conn, e->events);
       if (!ok) continue;
-
-      auto new_mask = ConnectionPollMask(conn);
-      if (((new_mask & EPOLLOUT) == 0 && conn->has_error)
-          || new_mask == 0) {
-        CloseConnection(conn);
-      } else if (new_mask != mask) {
-        event.data.ptr = conn;
-        event.events = new_mask | EPOLLERR;
-
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
-          perror("Error when changing event mask! (Rare)");
-        }
-      }
+      UpdatePollMask(conn, mask);
     }
+    RunCoalesced();
     CheckTimeout();
   }
 }
 
-void Server::OnNewConnection()
+// Closes a connection with nothing left to do. Otherwise, if what it waits
+// for is no longer mask, tells epoll.
+void Server::UpdatePollMask(Connection *conn, uint32_t mask)
 {
-  struct sockaddr_in soaddr = {0};
-  socklen_t len = 0;
-  int newfd = 0;
+  struct epoll_event event;
+  auto new_mask = ConnectionPollMask(conn);
+  if (((new_mask & EPOLLOUT) == 0 && conn->has_error)
+      || new_mask == 0) {
+    CloseConnection(conn);
+  } else if (new_mask != mask) {
+    event.data.ptr = conn;
+    event.events = new_mask | EPOLLERR;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+      perror("Error when changing event mask! (Rare)");
+    }
+  }
+}
+
+// Runs the calls parked in this tick, each procedure's with one call to its
+// batch handler, and answers them. Their connections then go on with the
+// requests after them, which may park calls for another round.
+void Server::RunCoalesced()
+{
+  while (!coalesced.empty()) {
+    running_procs.swap(coalesced_procs);
+    coalesced_procs.clear();
+    for (auto proc: running_procs)
+      proc->RunQueued();
+
+    size_t n = coalesced.size();
+    for (size_t i = 0; i < n; i++) {
+      auto conn = coalesced[i];
+      if (!conn)
+        continue;
+      auto mask = ConnectionPollMask(conn);
+      if (!conn->AnswerParked()) {
+        fprintf(stderr, "No room to answer a coalesced call on connection %d\n", conn->fd);
+        CloseConnection(conn);
+        continue;
+      }
+      if (ServeConnection(conn))
+        UpdatePollMask(conn, mask);
+    }
+    coalesced.erase(coalesced.begin(), coalesced.begin() + n);
+  }
+}
+
+void Server::OnNewConnection()
+{
+  struct sockaddr_in soaddr = {0};
+  socklen_t len = 0;
+  int newfd = 0;
 
   memset(&soaddr, 0, sizeof(struct sockaddr_in));
   if ((newfd = accept(sock, (struct sockaddr *) &soaddr, &len)) < 0) {
@@ -430,6 +1412,7 @@ void Server::OnNewConnection()
   if (SetSocketNonBlocking(newfd) == false) {
     goto fail;
   }
+  SetSocketNoDelay(newfd);
 
   struct epoll_event event;
   event.data.ptr = new Connection(this, newfd);
@@ -453,7 +1436,8 @@ bool Server::CloseConnection(Connection *conn)
   if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr) == 0) {
     if (log_enabled)
       printf("Server closes connection %p %d\n", conn, conn->fd);
-
+    if (conn->parked.proc)
+      std::replace(coalesced.begin(), coalesced.end(), conn, (Connection *) nullptr);
     delete conn;
     return true;
   }
@@ -464,7 +1448,13 @@ uint32_t Server::ConnectionPollMask(Connection *conn)
 {
   uint32_t mask = 0;
   if (conn->inbuf.residual_size() > 0 || conn->inbuf.start > 0) mask |= EPOLLIN;
-  if (conn->outbuf.data_size() > 0) mask |= EPOLLOUT;
+  // A full buffer holding part of one large request grows on the next read.
+  if (conn->outbuf.data_size() == 0
+      && conn->inbuf.size < BaseService::kMaxLargeRequestSize) mask |= EPOLLIN;
+  // An open stream goes on whenever the socket can take more of it, unless
+  // it waits for the client.
+  if (conn->outbuf.data_size() > 0
+      || (conn->stream.items && !conn->stream.needs_input)) mask |= EPOLLOUT;
   return mask;
 }
 
@@ -479,36 +1469,106 @@ bool Server::OnConnectionEvent(Connection *conn, uint32_t event_mask)
   if (event_mask & EPOLLOUT) {
     if (!WriteConnectionBuffer(conn))
       return false;
+    conn->PutRevocations();
   }
 
   if (event_mask & EPOLLIN) {
-    if (!conn->inbuf.Slide(0))
-      return true;
+    if (!conn->inbuf.Slide(0)) {
+      // Nothing left to answer, so the buffer holds a single request that
+      // doesn't fit. Otherwise wait for the client to read its replies.
+      if (conn->outbuf.data_size() > 0
+          || conn->inbuf.size >= BaseService::kMaxLargeRequestSize)
+        return true;
+      conn->inbuf.Resize(std::min<size_t>(2 * conn->inbuf.size,
+                                          BaseService::kMaxLargeRequestSize));
+    }
 
     // Read from the network
     if (!ReadConnectionBuffer(conn))
       return false;
+  } else if (!conn->stream.items) {
+    return true;
+  }
+  return ServeConnection(conn);
+}
 
-    // printf("haserror %d outbuf %d\n", conn->has_error, conn->outbuf.residual_size());
-    // Process pipelined requests
-    while (conn->outbuf.Slide(BaseService::kMaxResponseSize) && !conn->has_error) {
-      uint32_t out_len = conn->outbuf.residual_size();
-      uint32_t in_len = conn->inbuf.data_size();
-      if (!conn->HandleRequest(conn->inbuf.data(), &in_len,
-                               conn->outbuf.residual(), &out_len)) {
-        break;
-      }
-      if (log_enabled)
-        printf("Server procedure consumes %d bytes generates %d bytes\n", in_len, out_len);
-      conn->outbuf.end += out_len;
-      conn->inbuf.start += in_len;
+// Answers the requests in inbuf, and the open stream, while outbuf can be
+// written out. A stream pauses when the socket is full, and after
+// kMaxStreamReplies replies so that other connections get their turn.
+bool Server::ServeConnection(Connection *conn)
+{
+  size_t nr_stream_replies = 0;
+
+  // printf("haserror %d outbuf %d\n", conn->has_error, conn->outbuf.residual_size());
+  // Process pipelined requests. Replies are collected in outbuf and written
+  // together, so a batch of calls is answered with one segment instead of
+  // one small write per reply.
+  while (!conn->has_error && !conn->parked.proc) {
+    // Revocations that found no room go out ahead of the replies.
+    conn->PutRevocations();
+    if (!conn->outbuf.Slide(BaseService::kMaxResponseSize)) {
       if (!WriteConnectionBuffer(conn))
         return false;
+      if (!conn->outbuf.Slide(BaseService::kMaxResponseSize))
+        break;
+    }
+    uint32_t out_len = conn->outbuf.residual_size();
+    if (conn->TakeCancel())
+      continue;
+    if (conn->stream.items) {
+      if (nr_stream_replies++ == kMaxStreamReplies)
+        break;
+      if (!conn->StreamReply(conn->outbuf.residual(), &out_len))
+        break;
+      conn->outbuf.end += out_len;
+      continue;
+    }
+    uint32_t in_len = conn->inbuf.data_size();
+    if (!conn->HandleRequest(conn->inbuf.data(), &in_len,
+                             conn->outbuf.residual(), &out_len)) {
+      break;
+    }
+    if (log_enabled)
+      printf("Server procedure consumes %d bytes generates %d bytes\n", in_len, out_len);
+    conn->outbuf.end += out_len;
+    conn->inbuf.start += in_len;
+    if (conn->revoked_instance >= 0) {
+      RevokeLeases(conn->revoked_instance, conn);
+      conn->revoked_instance = -1;
     }
   }
-  return true;
+  // A parked call may still refer to the arguments in inbuf.
+  if (conn->inbuf.size > Connection::kMaxInBuf && !conn->parked.proc
+      && conn->inbuf.data_size() <= BaseService::kMaxRequestSize)
+    conn->inbuf.Resize(Connection::kMaxInBuf);
+  return WriteConnectionBuffer(conn);
+}
 
+// Tells every client holding a lease on the instance to drop its cached
+// replies. The current connection's revocation goes out after its replies.
+// The others' go out on their own EPOLLOUT: writing could close them, and
+// their events may still be due in this batch.
+void Server::RevokeLeases(int instance_id, Connection *current)
+{
+  auto now = GetMicroseconds();
+  for (auto conn = mru; conn; conn = conn->next_mru) {
+    if (!conn->RevokeLease(instance_id, now))
+      continue;
+    // Without room, the revocation goes out once the client has read some
+    // replies, ahead of any later ones.
+    auto mask = ConnectionPollMask(conn);
+    conn->PutRevocations();
 
+    auto new_mask = ConnectionPollMask(conn);
+    if (conn == current || new_mask == mask)
+      continue;
+    struct epoll_event event;
+    event.data.ptr = conn;
+    event.events = new_mask | EPOLLERR;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) {
+      perror("Error when changing event mask! (Rare)");
+    }
+  }
 }
 
 bool Server::ReadConnectionBuffer(Connection *conn)
@@ -536,186 +1596,1639 @@ bool Server::WriteConnectionBuffer(Connection *conn)
   return true;
 }
 
-BaseClient::BaseClient()
-    : bufsz(0), nr_pending(0), error(false), xid(1), log_enabled(true)
+// Byte order
+
+SimdLevel DetectSimdLevel()
 {
-  fd = socket(AF_INET, SOCK_STREAM, 0);
-  buf = new uint8_t[BaseService::kMaxRequestSize * BaseService::kMaxPipelineRequests];
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return SimdLevel::kAvx2;
+  if (__builtin_cpu_supports("ssse3")) return SimdLevel::kSsse3;
+#endif
+  return SimdLevel::kScalar;
 }
 
-BaseClient::~BaseClient()
+static SimdLevel BestSimdLevel()
 {
-  delete [] buf;
-  close(fd);
+  static const SimdLevel level = DetectSimdLevel();
+  return level;
 }
 
-bool BaseClient::Connect(const char *addr, unsigned int port)
+// pshufb control that reverses every width-byte group of a 16-byte lane.
+template <size_t Width>
+struct ByteSwapMask {
+  uint8_t bytes[32];
+  ByteSwapMask() {
+    for (size_t i = 0; i < sizeof(bytes); i++)
+      bytes[i] = i % 16 / Width * Width + Width - 1 - i % Width;
+  }
+};
+
+template <size_t Width>
+static void ByteSwapScalar(uint8_t *dst, const uint8_t *src, size_t n)
 {
-  if (fd < 0) return false; // socket creation failed?
-  struct sockaddr_in soaddr;
-  memset(&soaddr, 0, sizeof(struct sockaddr_in));
-  soaddr.sin_family = AF_INET;
-  soaddr.sin_port = htons(port);
-  inet_aton(addr, &soaddr.sin_addr);
+  for (size_t i = 0; i < n; i++, dst += Width, src += Width) {
+    if (Width == 4) {
+      uint32_t v;
+      memcpy(&v, src, 4);
+      v = __builtin_bswap32(v);
+      memcpy(dst, &v, 4);
+    } else {
+      uint64_t v;
+      memcpy(&v, src, 8);
+      v = __builtin_bswap64(v);
+      memcpy(dst, &v, 8);
+    }
+  }
+}
 
-  if (connect(fd, (const sockaddr *) &soaddr, sizeof(sockaddr_in)) < 0) {
-    perror("connect");
-    return false;
+// The vector kernels handle whole registers and return how many bytes that
+// was; the scalar loop does the tail.
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("ssse3")))
+static size_t ByteSwapSsse3(uint8_t *dst, const uint8_t *src, size_t nbytes,
+                            const uint8_t *mask)
+{
+  auto m = _mm_loadu_si128((const __m128i *) mask);
+  size_t i = 0;
+  for (; i + 16 <= nbytes; i += 16) {
+    auto v = _mm_loadu_si128((const __m128i *) (src + i));
+    _mm_storeu_si128((__m128i *) (dst + i), _mm_shuffle_epi8(v, m));
   }
-  error = false;
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t ByteSwapAvx2(uint8_t *dst, const uint8_t *src, size_t nbytes,
+                           const uint8_t *mask)
+{
+  auto m = _mm256_loadu_si256((const __m256i *) mask);
+  size_t i = 0;
+  for (; i + 64 <= nbytes; i += 64) {
+    auto a = _mm256_loadu_si256((const __m256i *) (src + i));
+    auto b = _mm256_loadu_si256((const __m256i *) (src + i + 32));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(a, m));
+    _mm256_storeu_si256((__m256i *) (dst + i + 32), _mm256_shuffle_epi8(b, m));
+  }
+  for (; i + 32 <= nbytes; i += 32) {
+    auto v = _mm256_loadu_si256((const __m256i *) (src + i));
+    _mm256_storeu_si256((__m256i *) (dst + i), _mm256_shuffle_epi8(v, m));
+  }
+  return i;
+}
+#endif
+
+template <size_t Width>
+static void ByteSwap(void *dst, const void *src, size_t n, SimdLevel level)
+{
+  auto d = (uint8_t *) dst;
+  auto s = (const uint8_t *) src;
+  size_t done = 0;
+#if defined(__x86_64__) || defined(__i386__)
+  static const ByteSwapMask<Width> mask;
+  if (level == SimdLevel::kAvx2)
+    done = ByteSwapAvx2(d, s, n * Width, mask.bytes);
+  else if (level == SimdLevel::kSsse3)
+    done = ByteSwapSsse3(d, s, n * Width, mask.bytes);
+#endif
+  ByteSwapScalar<Width>(d + done, s + done, n - done / Width);
+}
+
+void ByteSwap32(void *dst, const void *src, size_t n, SimdLevel level)
+{
+  ByteSwap<4>(dst, src, n, level);
+}
+
+void ByteSwap64(void *dst, const void *src, size_t n, SimdLevel level)
+{
+  ByteSwap<8>(dst, src, n, level);
+}
+
+void ByteSwap32(void *dst, const void *src, size_t n)
+{
+  ByteSwap<4>(dst, src, n, BestSimdLevel());
+}
+
+void ByteSwap64(void *dst, const void *src, size_t n)
+{
+  ByteSwap<8>(dst, src, n, BestSimdLevel());
+}
+
+// Compression
+
+// An LZ4 block is a run of sequences: a token holding 4-bit literal and match
+// lengths (15 means more length bytes follow, each adding up to 255), the
+// literals, a 2-byte little-endian offset and the match. The last sequence
+// has literals only. As in LZ4, the last 5 bytes are always literals and no
+// match starts in the last 12, so the blocks stay readable by other decoders.
+static constexpr size_t kMinMatch = 4;
+static constexpr size_t kLastLiterals = 5;
+static constexpr size_t kMatchLimit = 12;
+static constexpr size_t kMaxOffset = 65535;
+static constexpr int kHashBits = 12;
+
+static inline uint32_t Load32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(uint32_t));
+  return v;
+}
+
+// How many bytes a and b have in common, up to limit.
+static inline size_t MatchLength(const uint8_t *a, const uint8_t *b, size_t limit)
+{
+  size_t len = 0;
+  for (; len + sizeof(uint64_t) <= limit; len += sizeof(uint64_t)) {
+    uint64_t x, y;
+    memcpy(&x, a + len, sizeof(uint64_t));
+    memcpy(&y, b + len, sizeof(uint64_t));
+    if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+      return len + __builtin_ctzll(x ^ y) / 8;
+#else
+      return len + __builtin_clzll(x ^ y) / 8;
+#endif
+    }
+  }
+  while (len < limit && a[len] == b[len]) len++;
+  return len;
+}
+
+static inline uint8_t *PutLength(uint8_t *op, size_t len)
+{
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+static inline bool GetLength(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+  uint8_t b;
+  do {
+    if (*ip == iend) return false;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
   return true;
 }
 
-void BaseClient::Flush()
+// Appends literals [lit, lit + nr_lit) and, unless match_len is 0, a match.
+static inline uint8_t *PutSequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+                                   size_t nr_lit, size_t offset, size_t match_len)
 {
-  ssize_t sent = 0;
-  static constexpr size_t kInBufferSize = BaseService::kMaxPipelineRequests * BaseService::kMaxResponseSize;
-  uint8_t *inbuf = new uint8_t[kInBufferSize];
-  uint32_t insz = 0, instart = 0;
-  struct pollfd pfd;
-  int nr_replied = 0;
+  size_t extra = match_len ? match_len - kMinMatch : 0;
+  if ((size_t) (oend - op) < 1 + nr_lit / 255 + 1 + nr_lit + 2 + extra / 255 + 1)
+    return nullptr;
+  auto token = op++;
+  *token = std::min<size_t>(nr_lit, 15) << 4;
+  if (nr_lit >= 15) op = PutLength(op, nr_lit - 15);
+  if (nr_lit > 0) memcpy(op, lit, nr_lit);
+  op += nr_lit;
+  if (match_len == 0)
+    return op;
+  *op++ = offset;
+  *op++ = offset >> 8;
+  *token |= std::min<size_t>(extra, 15);
+  if (extra >= 15) op = PutLength(op, extra - 15);
+  return op;
+}
 
-  pfd.fd = fd;
-  pfd.events = POLLIN;
+size_t CompressBlockBound(size_t n)
+{
+  return n + n / 255 + 16;
+}
 
-  SetSocketBlocking(fd);
-  while (sent < (ssize_t) bufsz) {
-    auto nbytes = write(fd, buf + sent, bufsz - sent);
-    if (IsIOError(nbytes)) {
-      goto fail;
+size_t CompressBlock(uint8_t *dst, size_t cap, const uint8_t *src, size_t n)
+{
+  // Small bodies get a smaller table, which is cheaper to clear.
+  int bits = kHashBits;
+  while (bits > 8 && (size_t(1) << bits) > n) bits--;
+  uint32_t table[1 << kHashBits];
+  std::fill(table, table + (1 << bits), 0);
+  uint8_t *op = dst, *oend = dst + cap;
+  size_t anchor = 0;
+
+  for (size_t i = 0; n >= kMatchLimit && i + kMatchLimit <= n;) {
+    auto seq = Load32(src + i);
+    auto h = (seq * 2654435761u) >> (32 - bits);
+    size_t ref = table[h];
+    table[h] = i;
+    if (ref >= i || i - ref > kMaxOffset || Load32(src + ref) != seq) {
+      // Skip ahead faster the longer nothing matched.
+      i += 1 + ((i - anchor) >> 6);
+      continue;
     }
-    sent += nbytes;
+    while (i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+      i--;
+      ref--;
+    }
+    size_t len = kMinMatch + MatchLength(src + i + kMinMatch, src + ref + kMinMatch,
+                                         n - kLastLiterals - i - kMinMatch);
+    op = PutSequence(op, oend, src + anchor, i - anchor, i - ref, len);
+    if (op == nullptr)
+      return 0;
+    i += len;
+    anchor = i;
   }
-  SetSocketNonBlocking(fd);
+  op = PutSequence(op, oend, src + anchor, n - anchor, 0, 0);
+  return op ? op - dst : 0;
+}
 
-  nr_replied = 0;
-  while (nr_replied < (int) nr_pending) {
-    auto r = poll(&pfd, 1, 0);
-    if (r < 0 && errno == EINTR)
+bool DecompressBlock(uint8_t *dst, size_t n, const uint8_t *src, size_t len)
+{
+  const uint8_t *ip = src, *iend = src + len;
+  uint8_t *op = dst, *oend = dst + n;
+  while (ip < iend) {
+    unsigned int token = *ip++;
+    size_t nr_lit = token >> 4;
+    if (nr_lit == 15 && !GetLength(&ip, iend, &nr_lit))
+      return false;
+    if (nr_lit > (size_t) (iend - ip) || nr_lit > (size_t) (oend - op))
+      return false;
+    // Short runs are copied 16 bytes at a time when there is room for it.
+    if (nr_lit <= 16 && iend - ip >= 16 && oend - op >= 16)
+      memcpy(op, ip, 16);
+    else if (nr_lit > 0)
+      memcpy(op, ip, nr_lit);
+    op += nr_lit;
+    ip += nr_lit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return false;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (match_len == 15 && !GetLength(&ip, iend, &match_len))
+      return false;
+    match_len += kMinMatch;
+    if (offset == 0 || offset > (size_t) (op - dst) || match_len > (size_t) (oend - op))
+      return false;
+    // The match may overlap what it produces. Every copy doubles the
+    // distance to its source, so short periods take few steps.
+    const uint8_t *match = op - offset;
+    if (offset >= 16 && (size_t) (oend - op) >= match_len + 16) {
+      for (size_t i = 0; i < match_len; i += 16)
+        memcpy(op + i, match + i, 16);
+      op += match_len;
       continue;
-    if (r < 0) {
-      perror("poll");
-      goto fail;
     }
-    if (pfd.revents & POLLERR) {
-      fprintf(stderr, "poll return POLLERR on client\n");
-      goto fail;
+    while (match_len > 0) {
+      size_t chunk = std::min<size_t>(op - match, match_len);
+      memcpy(op, match, chunk);
+      op += chunk;
+      match_len -= chunk;
     }
-    if (pfd.revents & POLLIN) {
-      int nbytes = read(fd, inbuf + insz, kInBufferSize - insz);
-      if (IsIOError(nbytes)) {
-        goto fail;
-      } else if (nbytes > 0) {
-        insz += nbytes;
-      }
-      bool ok = true;
-      while (true) {
-        uint32_t len = insz - instart;
-        bool result = ParseBuffer(inbuf + instart, &len, nr_replied, &ok);
-        if (!ok) {
-          fprintf(stderr, "Client Result::HandleResponse() parsing error\n");
-          goto fail;
-        }
-        if (!result) {
-          break;
-        }
-        instart += len;
-        nr_replied++;
-      }
-      if (log_enabled)
-        printf("Client receives replied requests %d/%lu\n", nr_replied, nr_pending);
+  }
+  return op == oend;
+}
+
+// Checksums
+
+// Slicing-by-8 tables: table[k][b] is the CRC of byte b followed by k zeros.
+struct Crc32cTable {
+  uint32_t table[8][256];
+
+  Crc32cTable() {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+      for (int k = 1; k < 8; k++)
+        table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
     }
   }
+};
 
-  if (instart < insz) {
-    fprintf(stderr, "Garbage buffer left unparsed %u < %u\n", instart, insz);
-    goto fail;
+static uint32_t Crc32cScalar(uint32_t crc, const uint8_t *p, size_t n)
+{
+  static const Crc32cTable t;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    v ^= crc;
+    crc = t.table[7][v & 0xff] ^ t.table[6][(v >> 8) & 0xff]
+        ^ t.table[5][(v >> 16) & 0xff] ^ t.table[4][(v >> 24) & 0xff]
+        ^ t.table[3][(v >> 32) & 0xff] ^ t.table[2][(v >> 40) & 0xff]
+        ^ t.table[1][(v >> 48) & 0xff] ^ t.table[0][v >> 56];
   }
-  goto finalize;
+  for (; n > 0; n--, p++) crc = (crc >> 8) ^ t.table[0][(crc ^ *p) & 0xff];
+  return crc;
+}
 
-fail:
-  close(fd);
-  error = true;
-  for (int i = nr_replied; i < (int) nr_pending; i++) {
-    pending[i]->error = true;
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSse42(uint32_t crc, const uint8_t *p, size_t n)
+{
+  uint64_t crc64 = crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(uint64_t));
+    crc64 = _mm_crc32_u64(crc64, v);
   }
-finalize:
-  nr_replied = nr_pending = 0;
-  bufsz = 0;
-  delete [] inbuf;
+  crc = crc64;
+  for (; n > 0; n--, p++) crc = _mm_crc32_u8(crc, *p);
+  return crc;
 }
+#endif
 
-bool BaseClient::ParseBuffer(uint8_t *buf, uint32_t *in_len, int nr_replied, bool *ok)
+bool HasCrc32cInstruction()
 {
-  auto reply_header = (SunRpcReplyHeader *) buf;
-  if (*in_len < sizeof(SunRpcReplyHeader)) return false;
+#if defined(__x86_64__)
+  static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+  return has;
+#else
+  return false;
+#endif
+}
 
-  if (reply_header->type != htonl(1) || reply_header->reply_stat != 0) {
-    *ok = false;
-    return false;
+uint32_t Crc32c(uint32_t crc, const void *data, size_t n, bool hardware)
+{
+  auto p = (const uint8_t *) data;
+#if defined(__x86_64__)
+  if (hardware && HasCrc32cInstruction())
+    return ~Crc32cSse42(~crc, p, n);
+#endif
+  return ~Crc32cScalar(~crc, p, n);
+}
+
+uint32_t Crc32c(uint32_t crc, const void *data, size_t n)
+{
+  return Crc32c(crc, data, n, true);
+}
+
+uint32_t LatencyWindow::Percentile(double p) const
+{
+  auto n = size();
+  if (n == 0) return 0;
+  std::array<uint32_t, kNrSamples> sorted;
+  std::copy(samples.begin(), samples.begin() + n, sorted.begin());
+  auto nth = sorted.begin() + std::min<size_t>(n - 1, p * n);
+  std::nth_element(sorted.begin(), nth, sorted.begin() + n);
+  return *nth;
+}
+
+void ConcurrencyLimit::SetLimit(size_t new_limit, uint64_t now_us)
+{
+  if (new_limit < kMinLimit) new_limit = kMinLimit;
+  if (new_limit > kMaxLimit) new_limit = kMaxLimit;
+  if (new_limit == limit)
+    return;
+  if (new_limit > limit) nr_increases++; else nr_decreases++;
+  limit = new_limit;
+  changes[nr_changes++ % kHistorySize] = Change{now_us, (uint32_t) limit};
+}
+
+void ConcurrencyLimit::Update(size_t in_flight, bool failed, uint64_t now_us)
+{
+  auto nr = flush_nr;
+  auto mean = nr ? flush_sum_us / nr : 0;
+  auto lowest = flush_min_us;
+  flush_sum_us = flush_min_us = flush_nr = 0;
+
+  if (failed) {
+    SetLimit(limit / 2, now_us);
+    return;
   }
+  if (nr == 0)
+    return;
 
-  auto accept_header = (SunRpcAcceptHeader *) buf;
-  if (*in_len < sizeof(SunRpcAcceptHeader)) return false;
-  if (accept_header->accept_stat != 0) {
-    fprintf(stderr, "Accept Message respond with error code %d\n",
-            accept_header->accept_stat);
-    *ok = false;
-    return false;
+  if (nr_updates++ % kProbeInterval == 0 || lowest < min_rtt_us)
+    min_rtt_us = lowest;
+  rtt_us = mean;
+
+  // Thresholds grow with log10(limit) like Netflix's Vegas limiter, but never
+  // go below one and two calls so that small limits still move.
+  double log_limit = std::log10((double) limit);
+  double alpha = std::max(1.0, 3 * log_limit);
+  double beta = std::max(2.0, 6 * log_limit);
+  double queued = limit * (1.0 - (double) min_rtt_us / std::max<uint64_t>(mean, 1));
+
+  if (queued > beta) {
+    SetLimit(limit - 1, now_us);
+  } else if (queued < alpha && in_flight >= limit) {
+    // Only grow when the limit was what held us back.
+    SetLimit(limit + 1, now_us);
+  }
+}
+
+static constexpr size_t kClientInBufSize =
+    2 * BaseService::kMaxPipelineRequests * BaseService::kMaxResponseSize;
+static constexpr size_t kClientOutBufSize =
+    BaseService::kMaxRequestSize * BaseService::kMaxPipelineRequests;
+
+BaseClient::BaseClient()
+    : bufsz(0), nr_sent(0), nr_pending(0), nr_done(0), error(false), xid(1), log_enabled(true),
+      batch_start_us(0), batch_max_delay_us(0), batch_max_bytes(0),
+      flush_sent_us(0), nr_hedge_policies(0), cache_capacity(0), nr_cache_hits(0),
+      wire(WireFormat::kNative), compression_min_bytes(0), nr_compressed_calls(0),
+      nr_compressed_replies(0), checksums(false), compact_headers(true), handshake(true),
+      nr_bytes_sent(0), nr_bytes_received(0), stream(nullptr), stream_xid(0),
+      stream_wire(WireFormat::kNative), chunk_len(0), nr_unacked_chunks(0),
+      stream_input(false)
+{
+  primary.fd = socket(AF_INET, SOCK_STREAM, 0);
+  buf = new uint8_t[kClientOutBufSize];
+  for (auto ch: {&primary, &backup}) {
+    ch->inbuf.p = new uint8_t[kClientInBufSize];
+    ch->inbuf.size = kClientInBufSize;
+  }
+}
+
+BaseClient::~BaseClient()
+{
+  if (stream) stream->client = nullptr;
+  delete [] buf;
+  for (auto ch: {&primary, &backup}) {
+    delete [] ch->inbuf.p;
+    if (ch->fd >= 0) close(ch->fd);
   }
-  uint32_t len = *in_len - sizeof(SunRpcAcceptHeader);
-  if (!pending[nr_replied]->HandleResponse(buf  + sizeof(SunRpcAcceptHeader), &len, ok)) {
+}
+
+static bool ConnectSocket(int fd, const char *addr, unsigned int port)
+{
+  if (fd < 0) return false; // socket creation failed?
+  struct sockaddr_in soaddr;
+  memset(&soaddr, 0, sizeof(struct sockaddr_in));
+  soaddr.sin_family = AF_INET;
+  soaddr.sin_port = htons(port);
+  inet_aton(addr, &soaddr.sin_addr);
+
+  if (connect(fd, (const sockaddr *) &soaddr, sizeof(sockaddr_in)) < 0) {
+    perror("connect");
     return false;
   }
-  if (log_enabled)
-    printf("Client received a result of %lu bytes\n", sizeof(SunRpcAcceptHeader) + len);
-  *in_len = sizeof(SunRpcAcceptHeader) + len;
+  SetSocketNoDelay(fd);
   return true;
 }
 
-bool BaseClient::Send(int instance_id, int func_id, BaseParams *params, BaseResult *result)
+// Connects the socket of ch, and handshakes on it if enabled. A server that
+// refuses the handshake, or doesn't answer it in time, gets a new
+// connection without one.
+bool BaseClient::ConnectChannel(Channel *ch, const char *addr, unsigned int port)
 {
-  std::unique_ptr<BaseParams> _(params);
-  if (nr_pending == BaseService::kMaxPipelineRequests)
+  if (!ConnectSocket(ch->fd, addr, port))
     return false;
+  bool refused = false;
+  ch->features = ~0u;
+  if (handshake && !Handshake(ch, &refused)) {
+    close(ch->fd);
+    ch->fd = socket(AF_INET, SOCK_STREAM, 0);
+    ch->inbuf.start = ch->inbuf.end = 0;
+    // An old server: nothing beyond what each call negotiates.
+    ch->features = 0;
+    if (!refused || !ConnectSocket(ch->fd, addr, port))
+      return false;
+  }
+  return true;
+}
 
-  uint32_t len = BaseService::kMaxRequestSize * BaseService::kMaxPipelineRequests - bufsz;
-  if (len < sizeof(SunRpcCallBody))
+bool BaseClient::Connect(const char *addr, unsigned int port)
+{
+  if (!ConnectChannel(&primary, addr, port))
     return false;
+  error = false;
+  return true;
+}
 
-  len -= sizeof(SunRpcCallBody);
-  bool r = params->Encode(buf + bufsz + sizeof(SunRpcCallBody), &len);
-  if (!r) return false;
-
-  if (log_enabled)
-    printf("Client send call to instance %d func %d\n", instance_id, func_id);
-
-  SunRpcCallBody call;
-  memset(&call, 0, sizeof(SunRpcCallBody));
-  call.xid = htonl(xid++);
-  call.rpcvers = htonl(2);
-  call.prog = htonl(instance_id);
-  call.proc = htonl(func_id);
-  memcpy(buf + bufsz, &call, sizeof(SunRpcCallBody));
-
-  bufsz += sizeof(SunRpcCallBody) + len;
-  pending[nr_pending++] = result;
+bool BaseClient::ConnectHedge(const char *addr, unsigned int port)
+{
+  DropChannel(&backup);
+  backup.fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (!ConnectChannel(&backup, addr, port) || !SetSocketNonBlocking(backup.fd)) {
+    close(backup.fd);
+    backup.fd = -1;
+    return false;
+  }
   return true;
 }
 
-BaseService::~BaseService() 
+int BaseClient::FindHedgePolicy(int instance_id, int func_id) const
 {
-    for (decltype(nr_entries) i = 0; i < nr_entries; i++) {
-        delete proc_entries[i];
-    }
+  for (size_t i = 0; i < nr_hedge_policies; i++) {
+    if (hedge_policies[i].instance_id == instance_id
+        && hedge_policies[i].func_id == func_id)
+      return i;
+  }
+  return -1;
 }
 
-int BaseService::LookupExportFunction(MemberFunctionPtr func_ptr) 
+bool BaseClient::SetHedgePolicy(int instance_id, int func_id, double percentile,
+                                double max_extra_load, uint32_t min_delay_us)
 {
-    auto it = std::find_if(
-        proc_entries.begin(), proc_entries.begin() + nr_entries,
-        [func_ptr](BaseProcedure *proc) {
-            return proc->func_ptr == func_ptr;
+  if (instance_id < 0 || func_id < 0)
+    return false;
+  auto idx = FindHedgePolicy(instance_id, func_id);
+  if (idx < 0) {
+    if (nr_hedge_policies == kMaxHedgePolicies) {
+      fprintf(stderr, "Cannot hedge more than %lu methods\n", kMaxHedgePolicies);
+      return false;
+    }
+    idx = nr_hedge_policies++;
+    hedge_policies[idx] = HedgePolicy();
+  }
+  auto &policy = hedge_policies[idx];
+  policy.instance_id = instance_id;
+  policy.func_id = func_id;
+  policy.percentile = percentile;
+  policy.max_extra_load = max_extra_load;
+  policy.min_delay_us = min_delay_us;
+  return true;
+}
+
+const HedgePolicy *BaseClient::hedge_policy(int instance_id, int func_id) const
+{
+  auto idx = FindHedgePolicy(instance_id, func_id);
+  return idx < 0 ? nullptr : &hedge_policies[idx];
+}
+
+void BaseClient::DropChannel(Channel *ch)
+{
+  if (ch->fd >= 0) close(ch->fd);
+  ch->fd = -1;
+  ch->compression = false;
+  ch->takes_compact = ch->compact_calls = ch->compact_replies = false;
+  ch->peer = PeerInfo();
+  ch->nr_owed = 0;
+  ch->inbuf.start = ch->inbuf.end = 0;
+}
+
+int64_t BaseClient::MaybeHedge()
+{
+  if (backup.fd < 0 || nr_done == nr_pending)
+    return -1;
+
+  int64_t next_us = -1;
+  auto waited = GetMicroseconds() - flush_sent_us;
+  for (size_t i = 0; i < nr_pending; i++) {
+    auto &call = pending[i];
+    if (call.done || call.hedged || call.policy < 0)
+      continue;
+    auto &policy = hedge_policies[call.policy];
+    auto delay = policy.HedgeDelay();
+    if (delay == 0 || policy.tokens < 1.0)
+      continue;
+    if (waited < delay) {
+      if (next_us < 0 || delay - waited < (uint64_t) next_us)
+        next_us = delay - waited;
+      continue;
+    }
+    // Reading the backup's replies frees owed slots and wakes us up anyway.
+    if (backup.nr_owed == Channel::kMaxOwed)
+      return -1;
+
+    uint32_t sent = 0;
+    while (sent < call.len) {
+      auto nbytes = write(backup.fd, buf + call.offset + sent, call.len - sent);
+      if (IsIOError(nbytes)) {
+        fprintf(stderr, "Hedge connection failed, hedging disabled\n");
+        DropChannel(&backup);
+        return -1;
+      }
+      if (nbytes > 0) sent += nbytes;
+    }
+    nr_bytes_sent += call.len;
+    policy.tokens -= 1.0;
+    policy.nr_hedged++;
+    call.hedged = true;
+    backup.PushOwed(i, call.discard, call.wire);
+    if (log_enabled)
+      printf("Client hedges call %lu after %lu us\n", i, waited);
+  }
+  return next_us;
+}
+
+static bool IsCallback(const uint8_t *buf, uint32_t len, bool compact)
+{
+  unsigned int type;
+  if (compact) {
+    uint32_t xid, head, used, used2;
+    bool ok = true;
+    return VarintLength::Decode(buf, len, &ok, &xid, &used)
+        && VarintLength::Decode(buf + used, len - used, &ok, &head, &used2)
+        && (head & kCompactStatMask) == kCompactCallback;
+  }
+  if (len < 2 * sizeof(unsigned int)) return false;
+  memcpy(&type, buf + sizeof(unsigned int), sizeof(unsigned int));
+  return type == 0;
+}
+
+bool BaseClient::ReadChannel(Channel *ch, bool *ok)
+{
+  ch->inbuf.Slide(0);
+  auto nbytes = read(ch->fd, ch->inbuf.residual(), ch->inbuf.residual_size());
+  if (IsIOError(nbytes)) {
+    return false;
+  } else if (nbytes > 0) {
+    ch->inbuf.end += nbytes;
+    nr_bytes_received += nbytes;
+  }
+  return ParseChannel(ch, ok);
+}
+
+// Parses the replies read so far. An item of the open stream stops it, so
+// the stream's result holds one item at a time.
+bool BaseClient::ParseChannel(Channel *ch, bool *ok)
+{
+  while (true) {
+    uint32_t len = ch->inbuf.data_size();
+    if (IsCallback(ch->inbuf.data(), len, ch->compact_replies)) {
+      if (!ParseCallback(ch->inbuf.data(), &len, ok, ch->compact_replies))
+        return *ok;
+      ch->inbuf.start += len;
+      continue;
+    }
+    if (ch->nr_owed == 0)
+      break;
+
+    auto &owed = ch->owed_front();
+    BaseResult *result = nullptr;
+    if (owed.call >= 0 && !pending[owed.call].done)
+      result = pending[owed.call].result;
+    else if (owed.call == Channel::kStream)
+      result = stream; // null once it is closed, and the rest dropped
+
+    uint32_t lease_ms, flags, body_len;
+    const uint8_t *body;
+    if (!ParseBuffer(ch->inbuf.data(), &len, result, owed.discard, owed.wire,
+                     ch->compact_replies, ok, &lease_ms, &flags, &body, &body_len))
+      return *ok;
+    if (flags & kReplyTakesCompression)
+      ch->compression = true;
+    if (flags & kReplyTakesCompactHeader)
+      ch->takes_compact = true;
+    if (flags & kReplySwitchesHeader)
+      ch->compact_replies = true;
+
+    if (owed.call == Channel::kStream) {
+      ch->inbuf.start += len;
+      if (flags & kReplyStreamAck) {
+        nr_unacked_chunks--;
+        continue;
+      }
+      if (!(flags & kReplyEndsStream)) {
+        // One item at a time, unless the result keeps them all.
+        if (stream && !stream->queues_items) return true;
+        continue;
+      }
+      ch->PopOwed();
+      if (stream) {
+        stream->client = nullptr;
+        stream = nullptr;
+      }
+      stream_input = false;
+      continue;
+    }
+    if (owed.batch && !(flags & kReplyEndsStream)) {
+      // Some of the batch's results; more replies follow.
+      ch->inbuf.start += len;
+      continue;
+    }
+    if (result) {
+      auto &call = pending[owed.call];
+      // The reply that ends a batch has no result, but completes it.
+      if (owed.batch) result->ready = true;
+      call.done = true;
+      nr_done++;
+      if (call.policy >= 0 || concurrency.enabled) {
+        auto latency = GetMicroseconds() - flush_sent_us;
+        if (concurrency.enabled)
+          concurrency.Sample(latency);
+        if (call.policy >= 0) {
+          auto &policy = hedge_policies[call.policy];
+          policy.latency.Add(latency);
+          if (ch == &backup) policy.nr_backup_wins++;
+        }
+      }
+      if (lease_ms > 0)
+        CacheReply(&call, body, body_len, lease_ms);
+    }
+    ch->inbuf.start += len;
+    ch->PopOwed();
+  }
+  return true;
+}
+
+void BaseClient::Flush()
+{
+  ssize_t sent = 0;
+  bool ok = true;
+  struct pollfd pfd[2];
+
+  // Nothing is ever pending behind an open stream.
+  if (stream)
+    return;
+  // Taken before the write: the server may well answer before write()
+  // returns to us, and latencies must not come out as zero.
+  flush_sent_us = GetMicroseconds();
+  // SendGathered() may have written some calls already, or lost the channel.
+  sent = nr_sent;
+  if (primary.fd < 0 && nr_pending > 0)
+    goto fail;
+  SetSocketBlocking(primary.fd);
+  while (sent < (ssize_t) bufsz) {
+    auto nbytes = write(primary.fd, buf + sent, bufsz - sent);
+    if (IsIOError(nbytes)) {
+      goto fail;
+    }
+    sent += nbytes;
+  }
+  SetSocketNonBlocking(primary.fd);
+  nr_bytes_sent += bufsz - nr_sent;
+
+  // The primary answers every call. Leftovers from earlier flushes, if any,
+  // come first.
+  for (size_t i = 0; i < nr_pending; i++) {
+    primary.PushOwed(i, pending[i].discard, pending[i].wire, pending[i].batch);
+  }
+
+  // Keep reading until every call is answered, by either channel.
+  while (nr_done < nr_pending) {
+    // Sleep until a reply comes in or a call is due for hedging. Spinning
+    // here would take the CPU away from a server on the same machine right
+    // when it is overloaded.
+    auto hedge_in_us = MaybeHedge();
+    struct timespec timeout;
+    timeout.tv_sec = hedge_in_us / 1000000;
+    timeout.tv_nsec = hedge_in_us % 1000000 * 1000;
+
+    pfd[0].fd = primary.fd;
+    pfd[1].fd = backup.fd; // poll() skips it when negative
+    pfd[0].events = pfd[1].events = POLLIN;
+    auto r = ppoll(pfd, 2, hedge_in_us < 0 ? nullptr : &timeout, nullptr);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0) {
+      perror("poll");
+      goto fail;
+    }
+    if (pfd[1].revents & (POLLIN | POLLERR | POLLHUP)) {
+      if (!ReadChannel(&backup, &ok)) {
+        fprintf(stderr, "Hedge connection failed, hedging disabled\n");
+        DropChannel(&backup);
+        ok = true;
+      }
+    }
+    if (pfd[0].revents & POLLERR) {
+      fprintf(stderr, "poll return POLLERR on client\n");
+      goto fail;
+    }
+    if (pfd[0].revents & POLLIN) {
+      if (!ReadChannel(&primary, &ok)) {
+        if (!ok)
+          fprintf(stderr, "Client Result::HandleResponse() parsing error\n");
+        goto fail;
+      }
+      if (log_enabled)
+        printf("Client receives replied requests %lu/%lu\n", nr_done, nr_pending);
+    }
+  }
+
+  if (primary.nr_owed == 0 && primary.inbuf.data_size() > 0) {
+    fprintf(stderr, "Garbage buffer left unparsed %u < %u\n",
+            primary.inbuf.start, primary.inbuf.end);
+    goto fail;
+  }
+  // Whatever is still owed was answered by the other channel. Those replies
+  // get dropped as they arrive, after this batch's results are gone.
+  for (auto ch: {&primary, &backup}) {
+    for (size_t i = 0; i < ch->nr_owed; i++) {
+      auto &owed = ch->owed[(ch->owed_head + i) % Channel::kMaxOwed];
+      if (owed.call >= 0) owed.call = -1;
+    }
+  }
+  // A channel owing so many stale replies that the next Flush() couldn't
+  // queue a full pipeline behind them is stuck, and waiting for it is what
+  // hedging avoids. A stuck primary hands over to the backup, which answered
+  // for it; either way the stuck one is dropped, and hedging with it.
+  if (primary.nr_owed > BaseService::kMaxPipelineRequests && backup.fd >= 0) {
+    fprintf(stderr, "Primary connection fell behind, switching to the hedge\n");
+    std::swap(primary, backup);
+    // Leases were held for the other connection.
+    cache.clear();
+  }
+  if (backup.nr_owed > BaseService::kMaxPipelineRequests) {
+    fprintf(stderr, "Hedge connection fell behind, hedging disabled\n");
+    DropChannel(&backup);
+  }
+  if (primary.nr_owed > BaseService::kMaxPipelineRequests) {
+    fprintf(stderr, "Primary connection fell behind\n");
+    DropChannel(&primary);
+    error = true;
+  }
+  if (concurrency.enabled && nr_pending > 0)
+    concurrency.Update(nr_pending, false, GetMicroseconds());
+  goto finalize;
+
+fail:
+  DropChannel(&primary);
+  error = true;
+  for (size_t i = 0; i < nr_pending; i++) {
+    if (!pending[i].done) pending[i].result->error = true;
+  }
+  if (concurrency.enabled)
+    concurrency.Update(nr_pending, true, GetMicroseconds());
+finalize:
+  nr_pending = nr_done = 0;
+  bufsz = nr_sent = 0;
+}
+
+// Takes the Sun RPC reply header at buf, our verifier included. Like a
+// Decode(), returns false if it hasn't all arrived, and also clears *ok if
+// it isn't one or the call failed. Sets *in_len to its size.
+static bool TakeReplyHeader(const uint8_t *buf, uint32_t *in_len, bool *ok,
+                            uint32_t *lease_ms, uint32_t *flags)
+{
+  auto reply_header = (const SunRpcReplyHeader *) buf;
+  if (*in_len < sizeof(SunRpcReplyHeader)) return false;
+
+  if (reply_header->type != htonl(1) || reply_header->reply_stat != 0) {
+    *ok = false;
+    return false;
+  }
+
+  auto accept_header = (const SunRpcAcceptHeader *) buf;
+  if (*in_len < sizeof(SunRpcAcceptHeader)) return false;
+  uint32_t verf_len = ntohl(accept_header->verf_len);
+  if (verf_len > kMaxVerfBody || verf_len % sizeof(unsigned int) != 0) {
+    fprintf(stderr, "Reply verifier of %u bytes isn't supported\n", verf_len);
+    *ok = false;
+    return false;
+  }
+  uint32_t header_len = sizeof(SunRpcAcceptHeader) + verf_len;
+  if (*in_len < header_len) return false;
+
+  // The verifier body, if any, sits between verf_len and accept_stat.
+  unsigned int accept_stat;
+  memcpy(&accept_stat, buf + header_len - sizeof(unsigned int), sizeof(unsigned int));
+  if (accept_stat != 0) {
+    fprintf(stderr, "Accept Message respond with error code %d\n", accept_stat);
+    *ok = false;
+    return false;
+  }
+  *lease_ms = *flags = 0;
+  if (ntohl(accept_header->verf_null) == kRpcxxVerfFlavor) {
+    auto verf = (const SunRpcRpcxxAcceptHeader *) buf;
+    if (verf_len >= sizeof(unsigned int))
+      *lease_ms = ntohl(verf->lease_ms);
+    if (verf_len >= 2 * sizeof(unsigned int))
+      *flags = ntohl(verf->flags);
+  }
+  *in_len = header_len;
+  return true;
+}
+
+// Same, for a compact reply header.
+static bool TakeCompactReplyHeader(const uint8_t *buf, uint32_t *in_len, bool *ok,
+                                   uint32_t *lease_ms, uint32_t *flags)
+{
+  uint32_t xid, head, used, off = 0;
+  if (!VarintLength::Decode(buf, *in_len, ok, &xid, &used)) return false;
+  off += used;
+  if (!VarintLength::Decode(buf + off, *in_len - off, ok, &head, &used)) return false;
+  off += used;
+  if ((head & kCompactStatMask) != 0) {
+    fprintf(stderr, "Accept Message respond with error code %d\n", head & kCompactStatMask);
+    *ok = false;
+    return false;
+  }
+  *lease_ms = 0;
+  *flags = head >> kCompactFlagsShift;
+  if (head & kCompactLeased) {
+    if (!VarintLength::Decode(buf + off, *in_len - off, ok, lease_ms, &used)) return false;
+    off += used;
+  }
+  *in_len = off;
+  return true;
+}
+
+// Sends the handshake on the unused socket of ch and waits for its reply,
+// for up to kHandshakeTimeoutMs. Sets *refused if the server answered with
+// an error or closed the connection, as one that doesn't know the handshake
+// does, or if it didn't answer in time.
+bool BaseClient::Handshake(Channel *ch, bool *refused)
+{
+  uint8_t call_bytes[sizeof(SunRpcCallBody) + 2 * sizeof(unsigned int)];
+  SunRpcCallBody call;
+  memset(&call, 0, sizeof(SunRpcCallBody));
+  call.xid = htonl(xid++);
+  call.rpcvers = htonl(2);
+  call.proc = htonl(kHandshakeProc);
+  PutCallHeader(call_bytes, call, false);
+  unsigned int hello[2] = {
+    htonl(kProtocolVersion),
+    htonl((compact_headers ? kFeatureCompactHeaders : 0)
+          | (compression_min_bytes > 0 ? kFeatureCompression : 0)
+          | (checksums ? kFeatureChecksums : 0))};
+  memcpy(call_bytes + sizeof(SunRpcCallBody), hello, sizeof(hello));
+  if (!WriteAll(ch->fd, call_bytes, sizeof(call_bytes)))
+    return false;
+  nr_bytes_sent += sizeof(call_bytes);
+
+  unsigned int info[4];
+  auto &in = ch->inbuf;
+  in.start = in.end = 0;
+  auto deadline_us = GetMicroseconds() + kHandshakeTimeoutMs * 1000ULL;
+  while (true) {
+    bool ok = true;
+    uint32_t len = in.data_size(), lease_ms, flags;
+    if (TakeReplyHeader(in.data(), &len, &ok, &lease_ms, &flags)
+        && in.data_size() - len >= sizeof(info)) {
+      memcpy(info, in.data() + len, sizeof(info));
+      in.start = in.end = 0;
+      break;
+    }
+    if (!ok) {
+      *refused = true;
+      return false;
+    }
+    auto nbytes = read(ch->fd, in.residual(), in.residual_size());
+    if (nbytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+      // WriteAll() left the socket non-blocking.
+      auto now_us = GetMicroseconds();
+      pollfd pfd = {ch->fd, POLLIN, 0};
+      if (now_us >= deadline_us || poll(&pfd, 1, (deadline_us - now_us + 999) / 1000) == 0) {
+        fprintf(stderr, "Server doesn't answer the handshake\n");
+        *refused = true;
+        return false;
+      }
+      continue;
+    }
+    if (nbytes <= 0) {
+      // Closed on us, which is also how an old server refuses.
+      *refused = nbytes == 0 || errno == ECONNRESET;
+      return false;
+    }
+    in.end += nbytes;
+    nr_bytes_received += nbytes;
+  }
+
+  ch->peer = PeerInfo{ntohl(info[0]), ntohl(info[1]), ntohl(info[2]), ntohl(info[3])};
+  ch->features = ch->peer.features;
+  ch->compression = ch->peer.features & kFeatureCompression;
+  if (compact_headers && (ch->peer.features & kFeatureCompactHeaders))
+    ch->takes_compact = ch->compact_calls = ch->compact_replies = true;
+  return true;
+}
+
+bool BaseClient::ParseBuffer(uint8_t *buf, uint32_t *in_len, BaseResult *result,
+                             DiscardFn discard, WireFormat wire, bool compact, bool *ok,
+                             uint32_t *lease_ms, uint32_t *flags,
+                             const uint8_t **body, uint32_t *body_len)
+{
+  uint32_t header_len = *in_len;
+  if (compact) {
+    if (!TakeCompactReplyHeader(buf, &header_len, ok, lease_ms, flags))
+      return false;
+  } else if (!TakeReplyHeader(buf, &header_len, ok, lease_ms, flags)) {
+    return false;
+  }
+
+  uint32_t wire_len = *in_len - header_len;
+  auto data = buf + header_len;
+  uint32_t frame_len = 0;
+  if (*flags & kReplyChecksummed) {
+    if (!VerifyChecksum(buf, header_len, &wire_len, ok, BaseService::kMaxResponseSize)) {
+      if (!*ok)
+        fprintf(stderr, "Reply fails its checksum\n");
+      return false;
+    }
+    frame_len = sizeof(BodyChecksum);
+    data += frame_len;
+  }
+  // With a checksum or compression, the result must decode to exactly the
+  // bytes we have for it.
+  bool sized = *flags & (kReplyChecksummed | kReplyCompressed);
+  *body_len = wire_len;
+  if (*flags & kReplyCompressed) {
+    uint32_t len = wire_len;
+    if (!DecompressBody(data, &len, ok, &zbuf, BaseService::kMaxResponseSize, body_len)
+        || (frame_len && len != wire_len)) {
+      if (!*ok || frame_len) {
+        fprintf(stderr, "Cannot decompress reply\n");
+        *ok = false;
+      }
+      return false;
+    }
+    wire_len = len;
+    data = zbuf.data();
+  }
+
+  uint32_t len = *body_len;
+  // Nor do those that end a stream or ack a chunk of one.
+  bool no_result = *flags & (kReplyEndsStream | kReplyStreamAck);
+  if (no_result) {
+    len = 0;
+  } else if (!(result ? result->HandleResponse(data, &len, ok, wire)
+                     : discard(data, &len, ok, wire))) {
+    if (sized)
+      *ok = false; // the whole result is there
+    return false;
+  }
+  if (sized && len != *body_len) {
+    *ok = false;
+    return false;
+  }
+  if (!sized)
+    *body_len = wire_len = len;
+  if (*flags & kReplyCompressed)
+    nr_compressed_replies++;
+  *body = data;
+  if (result)
+    result->ready = !no_result;
+  if (log_enabled)
+    printf("Client received a result of %u bytes\n", header_len + frame_len + wire_len);
+  *in_len = header_len + frame_len + wire_len;
+  return true;
+}
+
+bool BaseClient::ParseCallback(uint8_t *buf, uint32_t *in_len, bool *ok, bool compact)
+{
+  SunRpcCallBody callback;
+  if (compact) {
+    // The xid and head, then prog and proc.
+    uint32_t v[4], off = 0, used;
+    for (auto &x: v) {
+      if (!VarintLength::Decode(buf + off, *in_len - off, ok, &x, &used)) return false;
+      off += used;
+    }
+    callback.prog = htonl(v[2]);
+    callback.proc = htonl(v[3] - kCompactProcBias);
+    *in_len = off;
+  } else {
+    if (*in_len < sizeof(SunRpcCallBody)) return false;
+    memcpy(&callback, buf, sizeof(SunRpcCallBody));
+    *in_len = sizeof(SunRpcCallBody);
+  }
+  if (ntohl(callback.proc) != kRevokeLeasesProc) {
+    fprintf(stderr, "Unknown callback procedure %u from server\n", ntohl(callback.proc));
+    *ok = false;
+    return false;
+  }
+  RevokeCache(ntohl(callback.prog));
+  return true;
+}
+
+void BaseClient::enable_result_cache(size_t max_entries)
+{
+  cache_capacity = max_entries;
+  if (max_entries == 0)
+    cache.clear();
+}
+
+bool BaseClient::ServeFromCache(const std::string &key, WireFormat wire, BaseResult *result)
+{
+  // A call of ours still held or unanswered may write what this one reads,
+  // and its reply must not come first.
+  if (cache.empty() || bufsz > 0 || nr_pending > 0)
+    return false;
+  // A client living off the cache would never read otherwise, and never
+  // see revocations. Anything else read is a stale reply, dropped; a
+  // stream's items are left for Next(). Failures show in the next Flush().
+  if (!stream && primary.fd >= 0) {
+    bool ok = true;
+    ReadChannel(&primary, &ok);
+  }
+  auto it = cache.find(key);
+  if (it == cache.end())
+    return false;
+
+  auto &entry = it->second;
+  if (entry.expires_us > GetMicroseconds()) {
+    uint32_t len = entry.reply.size();
+    bool ok = true;
+    result->error = false;
+    if (result->HandleResponse((uint8_t *) &entry.reply[0], &len, &ok, wire) && ok) {
+      result->ready = true;
+      nr_cache_hits++;
+      return true;
+    }
+  }
+  cache.erase(it);
+  return false;
+}
+
+void BaseClient::CacheReply(PendingCall *call, const uint8_t *reply, uint32_t len,
+                            uint32_t lease_ms)
+{
+  if (call->cache_key.empty())
+    return;
+  auto now = GetMicroseconds();
+  if (cache.size() >= cache_capacity) {
+    for (auto it = cache.begin(); it != cache.end();) {
+      it = it->second.expires_us <= now ? cache.erase(it) : std::next(it);
+    }
+    if (cache.size() >= cache_capacity)
+      cache.erase(cache.begin());
+  }
+  // The server started the lease when it answered, which is after we sent
+  // the call. Counting from the send keeps us on the safe side.
+  CachedReply entry;
+  entry.reply.assign((const char *) reply, len);
+  entry.expires_us = flush_sent_us + lease_ms * 1000ULL;
+  memcpy(&entry.instance_id, call->cache_key.data(), sizeof(int));
+  cache[std::move(call->cache_key)] = std::move(entry);
+}
+
+void BaseClient::RevokeCache(int instance_id)
+{
+  if (log_enabled)
+    printf("Client drops cached replies of instance %d\n", instance_id);
+  for (auto it = cache.begin(); it != cache.end();) {
+    it = it->second.instance_id == instance_id ? cache.erase(it) : std::next(it);
+  }
+}
+
+void BaseClient::enable_concurrency_limit(bool enabled)
+{
+  if (enabled && !concurrency.enabled)
+    concurrency = ConcurrencyLimit();
+  concurrency.enabled = enabled;
+}
+
+bool BaseClient::BatchWindowExpired() const
+{
+  if (nr_pending >= PipelineLimit())
+    return true;
+  if (batch_max_bytes != 0 && bufsz >= batch_max_bytes)
+    return true;
+  return batch_max_delay_us != 0
+      && GetMicroseconds() - batch_start_us >= batch_max_delay_us;
+}
+
+bool BaseClient::Send(int instance_id, int func_id, const BaseParams &params, BaseResult *result)
+{
+  CloseStream();
+  return SendCall(instance_id, func_id, params, result, CallKind::kOne);
+}
+
+bool BaseClient::SendBatch(int instance_id, int func_id, const BaseParams &params,
+                           BaseResult *result)
+{
+  CloseStream();
+  return SendCall(instance_id, func_id, params, result, CallKind::kBatch);
+}
+
+bool BaseClient::SendOneWay(int instance_id, int func_id, const BaseParams &params)
+{
+  CloseStream();
+  return SendCall(instance_id, func_id, params, nullptr, CallKind::kOneWay);
+}
+
+// Arguments of a call that has none.
+class NoParams : public BaseParams {
+ protected:
+  size_t Size(WireFormat wire, size_t *gathered) const override {
+    if (gathered) *gathered = 0;
+    return 0;
+  }
+  bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire,
+              std::vector<GatherSlice> *gather) const override {
+    *out_len = 0;
+    return true;
+  }
+};
+
+bool BaseClient::AckOneWay(OneWayAck *ack)
+{
+  CloseStream();
+  return SendCall(0, kAckOneWayProc, NoParams(), ack, CallKind::kControl);
+}
+
+static bool DecodeOneWayAck(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                            uint32_t *n)
+{
+  if (*in_len < sizeof(uint32_t)) return false;
+  memcpy(n, in_bytes, sizeof(uint32_t));
+  *n = ntohl(*n);
+  *in_len = sizeof(uint32_t);
+  return true;
+}
+
+static bool DiscardOneWayAck(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                             WireFormat wire)
+{
+  uint32_t unused;
+  return DecodeOneWayAck(in_bytes, in_len, ok, &unused);
+}
+
+bool OneWayAck::HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                               WireFormat wire)
+{
+  return DecodeOneWayAck(in_bytes, in_len, ok, &n);
+}
+
+DiscardFn OneWayAck::discard_fn() const
+{
+  return &DiscardOneWayAck;
+}
+
+bool BaseClient::SendCompound(const BaseParams &params, BaseResult *result)
+{
+  CloseStream();
+  return SendCall(0, kCompoundProc, params, result, CallKind::kControl);
+}
+
+// Only a single call is ever cached or hedged, and a streamed one is never
+// held for batching.
+bool BaseClient::SendCall(int instance_id, int func_id, const BaseParams &params,
+                          BaseResult *result, CallKind kind)
+{
+  // One-way calls take no room in the pipeline.
+  bool one_way = kind == CallKind::kOneWay;
+  if (!one_way && concurrency.enabled && nr_pending >= concurrency.limit)
+    Flush();
+  if (!one_way && nr_pending == BaseService::kMaxPipelineRequests)
+    return false;
+
+  // What the server didn't agree to in the handshake stays off.
+  bool checksummed = UsesChecksums(primary);
+  auto call_wire = WireFormatFor(primary);
+
+  // The arguments are sized first, so the call is encoded once, into exactly
+  // the room it needs. Large blobs are written from where they are and
+  // take no room in buf.
+  size_t header_len = sizeof(SunRpcCallBody) + (checksummed ? sizeof(BodyChecksum) : 0);
+  size_t gathered = 0;
+  size_t size = params.Size(call_wire, &gathered);
+  size -= gathered;
+  size_t max_size = primary.peer.max_request_size > 0
+      ? primary.peer.max_request_size : BaseService::kMaxLargeRequestSize;
+  if (size > kClientOutBufSize - header_len || size + gathered > max_size - header_len)
+    return false;
+  if (bufsz + header_len + size > kClientOutBufSize) {
+    // The held batch left no room for this call. Push it out first. Nothing
+    // waits on one-way calls, so they never wait for a Flush() either.
+    if ((!batching_enabled() && !one_way) || bufsz == 0)
+      return false;
+    Flush();
+  }
+  // A compact header's size is only known once it is filled in, after the
+  // arguments. They move up to it then.
+  bool compact = primary.compact_calls;
+  size_t frame_len = checksummed ? sizeof(BodyChecksum) : 0;
+  if (compact)
+    header_len = kMaxCompactCallHeader + frame_len;
+  auto args = buf + bufsz + header_len;
+  uint32_t len = size;
+  gather.clear();
+  if (!params.Encode(args, &len, call_wire, gathered > 0 ? &gather : nullptr))
+    return false;
+
+  std::string cache_key;
+  if (cache_capacity > 0 && gathered == 0 && kind == CallKind::kOne) {
+    cache_key.reserve(2 * sizeof(int) + 1 + len);
+    cache_key.append((const char *) &instance_id, sizeof(int));
+    cache_key.append((const char *) &func_id, sizeof(int));
+    cache_key.push_back((char) call_wire);
+    cache_key.append((const char *) args, len);
+    if (ServeFromCache(cache_key, call_wire, result))
+      return true;
+  }
+
+  // Cache keys are the uncompressed arguments, so this comes after.
+  bool compressed = false;
+  if (compression_min_bytes > 0 && primary.compression && gathered == 0
+      && len >= compression_min_bytes) {
+    auto n = CompressBody(args, len, &zbuf);
+    compressed = n < len;
+    len = n;
+    if (compressed) nr_compressed_calls++;
+  }
+
+  if (log_enabled)
+    printf("Client send call to instance %d func %d\n", instance_id, func_id);
+
+  // Switching takes a call with a single reply, the last before the switch.
+  // After a handshake, there is nothing left to agree on.
+  bool offers = compact_headers && !compact && primary.peer.version == 0;
+  bool switches = offers && primary.takes_compact
+      && (kind == CallKind::kOne || kind == CallKind::kControl);
+  SunRpcCallBody call;
+  memset(&call, 0, sizeof(SunRpcCallBody));
+  call.xid = htonl(xid++);
+  call.rpcvers = htonl(2);
+  call.prog = htonl(instance_id);
+  call.vers = htonl((cache_key.empty() ? 0 : kCallWantsLease)
+                    | (compression_min_bytes > 0 ? kCallTakesCompression : 0)
+                    | (compressed ? kCallCompressed : 0)
+                    | (checksummed ? kCallChecksummed : 0)
+                    | (kind == CallKind::kBatch ? kCallBatch : 0)
+                    | (one_way ? kCallOneWay : 0)
+                    | (offers ? kCallTakesCompactHeader : 0)
+                    | (switches ? kCallSwitchesHeader : 0)
+                    | (unsigned int) call_wire << kCallWireShift);
+  call.proc = htonl(func_id);
+  if (compact) {
+    uint8_t header[kMaxCompactCallHeader];
+    auto n = PutCallHeader(header, call, true);
+    memmove(buf + bufsz + n + frame_len, args, len);
+    memcpy(buf + bufsz, header, n);
+    header_len = n + frame_len;
+  } else {
+    PutCallHeader(buf + bufsz, call, false);
+  }
+  if (checksummed)
+    FillChecksum(buf + bufsz, header_len - frame_len, len, gathered > 0 ? &gather : nullptr);
+  // Every call after this one has a compact header.
+  if (switches)
+    primary.compact_calls = true;
+
+  // The gathered bytes are only valid until we return, so the call goes out
+  // now and can't be hedged later.
+  if (gathered > 0 && !SendGathered(bufsz, header_len, header_len + len))
+    return false;
+  // Nor can a compressed call go to a backup that hasn't agreed to it, nor
+  // one whose header the backup doesn't take or that changes them.
+  auto policy = gathered > 0 || kind != CallKind::kOne || (compressed && !backup.compression)
+      || compact != backup.compact_calls || switches
+      || checksummed != UsesChecksums(backup) || call_wire != WireFormatFor(backup)
+      ? -1 : FindHedgePolicy(instance_id, func_id);
+  if (policy >= 0) {
+    auto &p = hedge_policies[policy];
+    p.nr_calls++;
+    p.tokens = std::min<double>(p.tokens + p.max_extra_load,
+                                BaseService::kMaxPipelineRequests);
+  }
+
+  if (bufsz == 0)
+    batch_start_us = GetMicroseconds();
+  if (!one_way) {
+    result->ready = result->error = false;
+    pending[nr_pending++] = PendingCall{
+      result, result->discard_fn(), call_wire, (uint32_t) bufsz,
+      (uint32_t) (header_len + len), policy, false, false,
+      kind == CallKind::kBatch, std::move(cache_key)};
+  }
+  bufsz += header_len + len;
+
+  if (kind != CallKind::kStream && batching_enabled() && BatchWindowExpired())
+    Flush();
+  return true;
+}
+
+bool BaseClient::OpenStream(int instance_id, int func_id, const BaseParams &params,
+                            BaseStreamResult *result)
+{
+  CloseStream();
+  if (nr_pending > 0)
+    Flush();
+  if (primary.fd < 0 || !SendCall(instance_id, func_id, params, result, CallKind::kStream))
+    return false;
+
+  // The stream's replies are read by Next(), not Flush().
+  nr_pending = 0;
+  bool sent = WriteAll(primary.fd, buf + nr_sent, bufsz - nr_sent);
+  nr_bytes_sent += bufsz - nr_sent;
+  bufsz = nr_sent = 0;
+  if (!sent) {
+    DropChannel(&primary);
+    error = result->error = true;
+    return false;
+  }
+
+  stream_wire = WireFormatFor(primary);
+  primary.PushOwed(Channel::kStream, result->discard_fn(), stream_wire);
+  stream = result;
+  stream_xid = xid - 1;
+  chunk_len = nr_unacked_chunks = 0;
+  stream_input = true;
+  result->client = this;
+  return true;
+}
+
+// Sleeps until the channel has something to read, then reads it.
+bool BaseClient::WaitChannel(Channel *ch, bool *ok)
+{
+  struct pollfd pfd;
+  pfd.fd = ch->fd;
+  pfd.events = POLLIN;
+  while (poll(&pfd, 1, -1) < 0) {
+    if (errno != EINTR) {
+      perror("poll");
+      return false;
+    }
+  }
+  return ReadChannel(ch, ok);
+}
+
+bool BaseClient::NextItem(BaseStreamResult *result)
+{
+  bool ok = true;
+  if (!ParseChannel(&primary, &ok))
+    goto fail;
+  while (!result->TakeItem()) {
+    if (stream != result)
+      return false;
+    // What the server would answer may be held back with the chunk.
+    if (chunk_len > 0 && !SendChunk(false))
+      return false;
+    if (!WaitChannel(&primary, &ok))
+      goto fail;
+  }
+  return true;
+
+fail:
+  if (!ok)
+    fprintf(stderr, "Client Result::HandleResponse() parsing error\n");
+  FailStream();
+  return false;
+}
+
+// Room for the header of a chunk ahead of its items, which start at
+// buf + kMaxChunkHeader. Without a checksum, the header starts later.
+static constexpr size_t kMaxChunkHeader = sizeof(SunRpcCallBody) + sizeof(BodyChecksum);
+
+bool BaseClient::WriteItem(const BaseParams &item)
+{
+  if (!stream_input)
+    return false;
+  size_t size = item.Size(stream_wire);
+  if (size > BaseService::kMaxRequestSize)
+    return false;
+  if (chunk_len + size > BaseService::kMaxRequestSize && !SendChunk(false))
+    return false;
+  uint32_t len = size;
+  if (!item.Encode(buf + kMaxChunkHeader + chunk_len, &len, stream_wire))
+    return false;
+  chunk_len += len;
+  return true;
+}
+
+// Sends the items held in buf as the stream's next chunk, once the server
+// has acked enough of the earlier ones.
+bool BaseClient::SendChunk(bool last)
+{
+  bool ok = true;
+  if (!stream_input)
+    return false;
+  while (nr_unacked_chunks >= BaseStreamResult::kMaxStreamWindow) {
+    if (!WaitChannel(&primary, &ok)) {
+      FailStream();
+      return false;
+    }
+    // The server may end the stream without waiting for the rest.
+    if (!stream_input)
+      return false;
+  }
+
+  bool checksummed = UsesChecksums(primary);
+  size_t frame_len = checksummed ? sizeof(BodyChecksum) : sizeof(unsigned int);
+  SunRpcCallBody call;
+  memset(&call, 0, sizeof(SunRpcCallBody));
+  call.xid = htonl(stream_xid);
+  call.rpcvers = htonl(2);
+  call.vers = htonl((checksummed ? kCallChecksummed : 0)
+                    | (last ? kCallEndsStream : 0)
+                    | (unsigned int) stream_wire << kCallWireShift);
+  call.proc = htonl(kStreamChunkProc);
+  uint8_t header[sizeof(SunRpcCallBody)];
+  auto header_len = PutCallHeader(header, call, primary.compact_calls);
+  auto p = buf + kMaxChunkHeader - frame_len - header_len;
+  memcpy(p, header, header_len);
+  if (checksummed) {
+    FillChecksum(p, header_len, chunk_len);
+  } else {
+    unsigned int len = htonl(chunk_len);
+    memcpy(p + header_len, &len, sizeof(unsigned int));
+  }
+  if (!WriteAll(primary.fd, p, header_len + frame_len + chunk_len)) {
+    FailStream();
+    return false;
+  }
+  nr_bytes_sent += header_len + frame_len + chunk_len;
+  nr_unacked_chunks++;
+  chunk_len = 0;
+  if (last)
+    stream_input = false;
+  return true;
+}
+
+void BaseClient::FailStream()
+{
+  DropChannel(&primary);
+  error = true;
+  stream_input = false;
+  if (stream) {
+    stream->error = true;
+    stream->client = nullptr;
+    stream = nullptr;
+  }
+}
+
+// Tells the server to stop the open stream, then drops the items that were
+// already on their way.
+void BaseClient::CloseStream()
+{
+  if (stream == nullptr)
+    return;
+  stream->client = nullptr;
+  stream = nullptr;
+
+  stream_input = false;
+  chunk_len = 0;
+
+  SunRpcCallBody cancel;
+  memset(&cancel, 0, sizeof(SunRpcCallBody));
+  cancel.xid = htonl(stream_xid);
+  cancel.rpcvers = htonl(2);
+  cancel.proc = htonl(kCancelStreamProc);
+  uint8_t header[sizeof(SunRpcCallBody)];
+  auto header_len = PutCallHeader(header, cancel, primary.compact_calls);
+  bool ok = true;
+  if (!WriteAll(primary.fd, header, header_len))
+    goto fail;
+  nr_bytes_sent += header_len;
+  if (!ParseChannel(&primary, &ok))
+    goto fail;
+  while (primary.nr_owed > 0) {
+    if (!WaitChannel(&primary, &ok))
+      goto fail;
+  }
+  return;
+
+fail:
+  DropChannel(&primary);
+  error = true;
+}
+
+bool BaseStreamResult::Next()
+{
+  // Items queued before the end of the stream are still there after it.
+  return client ? client->NextItem(this) : TakeItem();
+}
+
+bool BaseStreamResult::Write(const BaseParams &item)
+{
+  return client && client->WriteItem(item);
+}
+
+bool BaseStreamResult::CloseWrite()
+{
+  return client && client->SendChunk(true);
+}
+
+void BaseStreamResult::Close()
+{
+  if (client) client->CloseStream();
+}
+
+// Writes what is held in buf, then the call at call_offset with its gather
+// list spliced into its arguments, which start header_len bytes in.
+bool BaseClient::SendGathered(size_t call_offset, size_t header_len, size_t call_len)
+{
+  std::vector<struct iovec> iov;
+  iov.reserve(2 * gather.size() + 1);
+  size_t from = nr_sent;
+  for (auto &slice: gather) {
+    size_t at = call_offset + header_len + slice.offset;
+    iov.push_back({buf + from, at - from});
+    iov.push_back({const_cast<uint8_t *>(slice.data), slice.len});
+    from = at;
+  }
+  iov.push_back({buf + from, call_offset + call_len - from});
+
+  SetSocketBlocking(primary.fd);
+  for (size_t i = 0; i < iov.size();) {
+    auto nbytes = writev(primary.fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX));
+    if (IsIOError(nbytes)) {
+      DropChannel(&primary);
+      error = true;
+      return false;
+    }
+    for (; i < iov.size() && (size_t) nbytes >= iov[i].iov_len; i++)
+      nbytes -= iov[i].iov_len;
+    if (nbytes > 0) {
+      iov[i].iov_base = (uint8_t *) iov[i].iov_base + nbytes;
+      iov[i].iov_len -= nbytes;
+    }
+  }
+  SetSocketNonBlocking(primary.fd);
+  nr_bytes_sent += call_offset + call_len - nr_sent;
+  for (auto &slice: gather) nr_bytes_sent += slice.len;
+  nr_sent = call_offset + call_len;
+  return true;
+}
+
+BaseService::~BaseService() 
+{
+    for (decltype(nr_entries) i = 0; i < nr_entries; i++) {
+        delete proc_entries[i];
+    }
+}
+
+int BaseService::LookupExportFunction(MemberFunctionPtr func_ptr) 
+{
+    auto it = std::find_if(
+        proc_entries.begin(), proc_entries.begin() + nr_entries,
+        [func_ptr](BaseProcedure *proc) {
+            return proc->func_ptr == func_ptr;
         });
         
     if (it == proc_entries.begin() + nr_entries) {
@@ -725,6 +3238,47 @@ int BaseService::LookupExportFunction(MemberFunctionPtr func_ptr)
     return it - proc_entries.begin();
 }
 
+void BaseService::SetLeaseRaw(MemberFunctionPtr func_ptr, uint32_t lease_ms)
+{
+    auto idx = LookupExportFunction(func_ptr);
+    if (idx < 0) {
+        fprintf(stderr, "Cannot grant leases on a function that isn't exported\n");
+        return;
+    }
+    proc_entries[idx]->lease_ms = lease_ms;
+}
+
+void BaseService::SetRevokesLeasesRaw(MemberFunctionPtr func_ptr)
+{
+    auto idx = LookupExportFunction(func_ptr);
+    if (idx < 0) {
+        fprintf(stderr, "Cannot revoke leases from a function that isn't exported\n");
+        return;
+    }
+    proc_entries[idx]->revokes_leases = true;
+}
+
+void BaseService::SetBatchRaw(MemberFunctionPtr func_ptr, MemberFunctionPtr batch_ptr)
+{
+    auto idx = LookupExportFunction(func_ptr);
+    if (idx < 0 || proc_entries[idx]->streams) {
+        fprintf(stderr, "Cannot batch a function that isn't exported or streams\n");
+        return;
+    }
+    proc_entries[idx]->batch_func_ptr = batch_ptr;
+    proc_entries[idx]->batches = true;
+}
+
+void BaseService::SetOneWayRaw(MemberFunctionPtr func_ptr)
+{
+    auto idx = LookupExportFunction(func_ptr);
+    if (idx < 0) {
+        fprintf(stderr, "Cannot make a function that isn't exported one-way\n");
+        return;
+    }
+    proc_entries[idx]->one_way = true;
+}
+
 void BaseService::ExportRaw(MemberFunctionPtr func_ptr, BaseProcedure *proc) {
     proc->func_ptr = func_ptr;
     proc->instance = this;
@@ -10,11 +10,128 @@
 #include <cstring>
 #include <arpa/inet.h> // for htonl
 #include <atomic>
+#include <cassert>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace rpc {
 
 class BaseService;
 
+// Encodings of procedure arguments and results. The client picks one, every
+// call says which one it uses and the server answers in kind.
+enum class WireFormat : uint8_t {
+  kNative = 0,  // host byte order, packed as tightly as the types allow
+  kXdr = 1,     // RFC 4506: big-endian, every item padded to four bytes
+  kCompact = 2, // integers as varints, zigzagged if signed
+};
+static constexpr unsigned int kNrWireFormats = 3;
+
+// Version of our extensions to Sun RPC, exchanged in the handshake at
+// connect time. A peer that doesn't handshake is version 0.
+static constexpr uint32_t kProtocolVersion = 1;
+
+// What a server says it supports in the handshake. See BaseClient::Connect().
+enum Feature : uint32_t {
+  kFeatureCompression = 1,      // takes compressed calls, i.e. has it on
+  kFeatureChecksums = 2,
+  kFeatureCompactHeaders = 4,
+  kFeatureStreams = 8,
+  kFeatureBatches = 16,
+  kFeatureCompound = 32,
+  kFeatureOneWay = 64,
+  kFeatureWireFormats = 128,    // takes XDR and compact arguments, not just native
+};
+
+// The server's side of the handshake.
+struct PeerInfo {
+  uint32_t version = 0;           // lower of the two ends'
+  uint32_t features = 0;          // Feature bits
+  uint32_t max_request_size = 0;  // with large arguments
+  uint32_t max_response_size = 0;
+};
+
+// Vector instruction sets we have kernels for, from worst to best.
+enum class SimdLevel { kScalar, kSsse3, kAvx2 };
+
+// Best level the CPU supports.
+SimdLevel DetectSimdLevel();
+
+// Reverses the bytes of each of n 4- or 8-byte values, i.e. converts them
+// between host order and big-endian on a little-endian machine. dst may be
+// src, but the two must not otherwise overlap. Without a level the best one
+// the CPU supports is used; an explicit level must not be any better.
+void ByteSwap32(void *dst, const void *src, size_t n);
+void ByteSwap64(void *dst, const void *src, size_t n);
+void ByteSwap32(void *dst, const void *src, size_t n, SimdLevel level);
+void ByteSwap64(void *dst, const void *src, size_t n, SimdLevel level);
+
+// Block compression in the LZ4 block format, used for call and reply bodies.
+// CompressBlock() returns the compressed size, or 0 if that would exceed cap.
+// DecompressBlock() must be given the exact decompressed size n and rejects
+// any block that doesn't decode to exactly n bytes.
+size_t CompressBlockBound(size_t n);
+size_t CompressBlock(uint8_t *dst, size_t cap, const uint8_t *src, size_t n);
+bool DecompressBlock(uint8_t *dst, size_t n, const uint8_t *src, size_t len);
+
+// CRC32C (Castagnoli) of n bytes, continuing from crc, which is 0 for the
+// first piece. Uses SSE4.2 if the CPU has it, unless hardware is false.
+uint32_t Crc32c(uint32_t crc, const void *data, size_t n);
+uint32_t Crc32c(uint32_t crc, const void *data, size_t n, bool hardware);
+bool HasCrc32cInstruction();
+
+// Length prefix of strings and blobs: LEB128, 7 bits per byte, low bits
+// first, with the top bit set on every byte but the last. Lengths below 128
+// cost one byte, and any uint32_t fits in five. Compact call and reply
+// headers are made of them, too.
+struct VarintLength {
+  static constexpr uint32_t MAX_SIZE = 5;
+
+  static uint32_t Size(uint32_t n) {
+    return n < (1u << 7) ? 1 : n < (1u << 14) ? 2 : n < (1u << 21) ? 3
+        : n < (1u << 28) ? 4 : 5;
+  }
+  // The caller has checked that Size(n) bytes fit.
+  static uint32_t Encode(uint8_t *out_bytes, uint32_t n) {
+    uint32_t i = 0;
+    while (n >= 0x80) {
+      out_bytes[i++] = n | 0x80;
+      n >>= 7;
+    }
+    out_bytes[i++] = n;
+    return i;
+  }
+  // Returns false if the prefix doesn't end within in_len bytes; *ok turns
+  // false if it is longer than any uint32_t needs.
+  static bool Decode(const uint8_t *in_bytes, uint32_t in_len, bool *ok,
+                     uint32_t *n, uint32_t *used) {
+    if (in_len > 0 && in_bytes[0] < 0x80) {
+      *n = in_bytes[0];
+      *used = 1;
+      return true;
+    }
+    uint32_t limit = in_len < MAX_SIZE ? in_len : MAX_SIZE;
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < limit; i++) {
+      v |= (uint32_t) (in_bytes[i] & 0x7f) << (7 * i);
+      if (in_bytes[i] < 0x80) {
+        if (i == MAX_SIZE - 1 && in_bytes[i] > 0x0f) break;
+        *n = v;
+        *used = i + 1;
+        return true;
+      }
+    }
+    if (limit == MAX_SIZE) *ok = false;
+    return false;
+  }
+  // Prefix and payload are checked against the buffer together.
+  static bool Fits(uint32_t len, uint32_t n, uint32_t *header) {
+    *header = Size(n);
+    return len >= *header && len - *header >= n;
+  }
+};
+
 // Member Functions are 16B according to Itantium ABI.
 struct MemberFunctionPtr {
   void *fp;
@@ -43,40 +160,175 @@ struct MemberFunctionPtr {
   }
 };
 
+// The items of a streamed result, on the server. The connection pulls them
+// one at a time, each into a reply of its own, and only when its output
+// buffer has room for another, so a producer never runs ahead of the socket.
+class BaseStream {
+ public:
+  virtual ~BaseStream() {}
+  // Encodes the next item. Returns false if there is none (for a stream
+  // that takes input, none yet), and also clears *ok if the item doesn't fit
+  // in *out_len.
+  virtual bool Next(uint8_t *out_bytes, uint32_t *out_len, bool *ok) = 0;
+
+  // Streams the client sends items to as well (see Session) take them here,
+  // one at a time, and answer with what Next() returns. Like a Decode().
+  virtual bool takes_input() const { return false; }
+  virtual bool Feed(uint8_t *in_bytes, uint32_t *in_len, bool *ok) {
+    *ok = false;
+    return false;
+  }
+  // After the client's last item.
+  virtual void EndInput() {}
+};
+
 class BaseProcedure {
   friend class Connection;
   friend class BaseService;
+  friend class Server;
  protected:
   MemberFunctionPtr func_ptr;
   BaseService *instance;
+  uint32_t lease_ms = 0;        // clients may cache replies this long
+  bool revokes_leases = false;  // calls invalidate leases on the instance
+  bool one_way = false;         // calls may ask for no reply
+  bool streams = false;         // calls are answered by DecodeAndOpen()
+  bool batches = false;         // batch_func_ptr takes whole batches
+  MemberFunctionPtr batch_func_ptr;
+  size_t nr_queued = 0;         // calls parked for coalescing
   virtual ~BaseProcedure() {}
 
   virtual bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
                                 uint8_t *out_bytes, uint32_t *out_len,
-                                bool *ok) = 0;
+                                bool *ok, WireFormat wire) = 0;
+  // Like DecodeAndExecute(), but returns the stream of items the handler
+  // opened, or nullptr.
+  virtual BaseStream *DecodeAndOpen(uint8_t *in_bytes, uint32_t *in_len,
+                                    bool *ok, WireFormat wire) {
+    *ok = false;
+    return nullptr;
+  }
+  // Decodes the arguments of a batch of calls and runs them all. Returns
+  // their results, streamed back as many to a reply as fit, or nullptr.
+  virtual BaseStream *DecodeAndRunBatch(uint8_t *in_bytes, uint32_t *in_len,
+                                        bool *ok, WireFormat wire) {
+    *ok = false;
+    return nullptr;
+  }
+  // Calls parked for coalescing (see Server::set_coalescing()). Like a
+  // Decode(), DecodeQueued() decodes the arguments of one into slot
+  // nr_queued, which the caller then takes, while there are fewer than
+  // kMaxBatchCalls. RunQueued() runs all of them at
+  // once and empties the queue, and their results are kept for
+  // EncodeQueued() until the next run.
+  virtual bool DecodeQueued(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                            WireFormat wire) {
+    *ok = false;
+    return false;
+  }
+  virtual void RunQueued() {}
+  virtual bool EncodeQueued(size_t i, uint8_t *out_bytes, uint32_t *out_len,
+                            WireFormat wire) {
+    return false;
+  }
+};
+
+// An argument payload left in the caller's memory. On the wire, it comes
+// right after the first offset bytes the encoder wrote.
+struct GatherSlice {
+  uint32_t offset;
+  const uint8_t *data;
+  size_t len;
 };
 
 class BaseParams {
   friend class BaseClient;
  protected:
   void *func_ptr = nullptr;
-  virtual bool Encode(uint8_t *out_bytes, uint32_t *out_len) const = 0;
+  // Exact size of the encoded arguments. If gathered isn't null, it is set
+  // to how many of those bytes Encode() leaves in place given a gather list.
+  virtual size_t Size(WireFormat wire, size_t *gathered = nullptr) const = 0;
+  // Without a gather list, writes all Size(wire) bytes. With one, string and
+  // byte arguments of kGatherMinBytes or more are appended to it instead of
+  // copied, and only the bytes around them are written.
+  virtual bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire,
+                      std::vector<GatherSlice> *gather = nullptr) const = 0;
  public:
+  static constexpr size_t kGatherMinBytes = 16 << 10;
+
   virtual ~BaseParams() {}
 };
 
+// Parses one response of a given type and throws it away. The client keeps
+// these for replies that arrive after their Result has been answered by
+// someone else (e.g. a hedged call) and may already be deleted.
+typedef bool (*DiscardFn)(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                          WireFormat wire);
+
 class BaseResult {
   friend class BaseClient;
  protected:
   bool ready = false;
   bool error = false;
-  virtual bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok) = 0;
+  virtual bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                              WireFormat wire) = 0;
+  virtual DiscardFn discard_fn() const = 0;
   virtual ~BaseResult() {}
  public:
   bool is_ready() const { return ready; }
   bool has_error() const { return error; }
 };
 
+class BaseClient;
+
+// A result that arrives as a stream of items, each decoded by
+// HandleResponse() in turn. See StreamResult in rpcxx.h.
+class BaseStreamResult : public BaseResult {
+  friend class BaseClient;
+  BaseClient *client = nullptr;  // while the stream is open
+ protected:
+  // Results that keep every item HandleResponse() decodes, rather than just
+  // the last one, until TakeItem() makes it current. A stream that takes
+  // input needs that: items arrive while the client waits to send more.
+  bool queues_items = false;
+  // Makes the next item received current. Returns false if there is none.
+  virtual bool TakeItem() {
+    bool r = ready;
+    ready = false;
+    return r;
+  }
+  // Adds an item to what is sent to the server, in chunks of up to
+  // kMaxRequestSize. At most kMaxStreamWindow of them go unacknowledged;
+  // beyond that, this waits for the server to catch up.
+  bool Write(const BaseParams &item);
+ public:
+  static constexpr size_t kMaxStreamWindow = 4;
+
+  ~BaseStreamResult() override { Close(); }
+
+  // Waits for the next item. Returns false at the end of the stream, or if
+  // it fails (has_error()).
+  bool Next();
+  // Sends what Write() holds, and tells the server that was the last item.
+  bool CloseWrite();
+  // Ends the stream early. The server stops producing and the items already
+  // on their way are dropped.
+  void Close();
+  bool is_open() const { return client != nullptr; }
+};
+
+// Answer to BaseClient::AckOneWay(): how many one-way calls the server has
+// run on the connection since the last ack.
+class OneWayAck : public BaseResult {
+  uint32_t n = 0;
+ protected:
+  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                      WireFormat wire) override;
+ public:
+  DiscardFn discard_fn() const override;
+  uint32_t nr_calls() const { return n; }
+};
+
 class BaseService {
   friend class Server;
   friend class Connection;
@@ -84,8 +336,14 @@ class BaseService {
   virtual ~BaseService();
 
   static constexpr size_t kMaxRequestSize = 4096;
+  // A connection's input buffer grows for larger requests, up to this.
+  static constexpr size_t kMaxLargeRequestSize = 64 << 20;
   static constexpr size_t kMaxResponseSize = 128;
   static constexpr size_t kMaxPipelineRequests = 8;
+  // Calls in one batch frame.
+  static constexpr size_t kMaxBatchCalls = 1 << 16;
+  // Operations in one compound call.
+  static constexpr size_t kMaxCompoundOps = 16;
 
   void set_instance_id(int id) { ins_id = id; }
   int instance_id() const { return ins_id; }
@@ -96,6 +354,10 @@ class BaseService {
   static constexpr size_t kMaxDesc = 128;
 
   void ExportRaw(MemberFunctionPtr func_ptr, BaseProcedure *proc);
+  void SetLeaseRaw(MemberFunctionPtr func_ptr, uint32_t lease_ms);
+  void SetRevokesLeasesRaw(MemberFunctionPtr func_ptr);
+  void SetBatchRaw(MemberFunctionPtr func_ptr, MemberFunctionPtr batch_ptr);
+  void SetOneWayRaw(MemberFunctionPtr func_ptr);
   
  private:
   std::array<BaseProcedure *, kMaxDesc> proc_entries;
@@ -103,34 +365,411 @@ class BaseService {
   int ins_id;
 };
 
+// SlidingBuffer is a lot easier. It needs memory copy, but should be rare if
+// most of requests are small.
+//
+// It has one major advantage: it presents continuous buffer space.
+struct SlidingBuffer {
+  uint8_t *p = nullptr;
+  uint32_t start = 0;
+  uint32_t end = 0;
+  uint32_t size = 0;
+
+  bool Slide(uint32_t reserve) {
+    if (residual_size() <= reserve) {
+      memmove(p, p + start, end - start);
+      end = end - start;
+      start = 0;
+    }
+    return residual_size() > reserve;
+  }
+
+  // Moves the data to a new allocation of new_size bytes, which must hold it.
+  void Resize(uint32_t new_size) {
+    auto q = new uint8_t[new_size];
+    memcpy(q, p + start, end - start);
+    delete [] p;
+    p = q;
+    end -= start;
+    start = 0;
+    size = new_size;
+  }
+
+  uint32_t residual_size() const { return size - end; }
+  uint8_t *residual() { return p + end; }
+  uint32_t data_size() const { return end - start; }
+  uint8_t *data() { return p + start; }
+
+};
+
+// Latency of the most recent calls to one method, in microseconds.
+class LatencyWindow {
+ public:
+  static constexpr size_t kNrSamples = 64;
+
+  void Add(uint32_t us) { samples[next++ % kNrSamples] = us; }
+  size_t size() const { return next < kNrSamples ? next : kNrSamples; }
+  // p in [0, 1]. Returns 0 on an empty window.
+  uint32_t Percentile(double p) const;
+ private:
+  std::array<uint32_t, kNrSamples> samples;
+  size_t next = 0;
+};
+
+// Hedging for one idempotent method. Once a reply is slower than the
+// configured percentile of recent latencies, the same call is sent to the
+// backup server and whichever reply comes first wins. Every call earns
+// max_extra_load tokens and every hedge spends one, so hedging adds at most
+// that fraction of extra calls (plus a burst of one pipeline).
+struct HedgePolicy {
+  static constexpr size_t kMinSamples = 16;
+
+  int instance_id;
+  int func_id;
+  double percentile;
+  double max_extra_load;
+  uint32_t min_delay_us;
+  double tokens = 0;
+  LatencyWindow latency;
+  uint64_t nr_calls = 0;
+  uint64_t nr_hedged = 0;
+  uint64_t nr_backup_wins = 0;
+
+  // Delay after which an outstanding call is hedged, 0 if we don't know
+  // enough about the method yet.
+  uint32_t HedgeDelay() const {
+    if (latency.size() < kMinSamples) return 0;
+    return std::max(min_delay_us, latency.Percentile(percentile));
+  }
+};
+
+// TCP Vegas-style limit on the calls one Flush() keeps in flight. Each flush
+// compares the mean reply latency with the lowest latency seen lately; the gap
+// estimates how many of our calls sit queued at the server:
+//   queued = limit * (1 - min_rtt / rtt)
+// Below alpha the limit grows by one, above beta it shrinks by one. A failed
+// flush halves it. The baseline is forgotten every kProbeInterval flushes so a
+// server that got permanently slower isn't punished forever.
+struct ConcurrencyLimit {
+  static constexpr size_t kMinLimit = 1;
+  static constexpr size_t kMaxLimit = BaseService::kMaxPipelineRequests;
+  static constexpr uint32_t kProbeInterval = 1000;
+  static constexpr size_t kHistorySize = 64;
+
+  struct Change {
+    uint64_t at_us;
+    uint32_t limit;
+  };
+
+  bool enabled = false;
+  size_t limit = kMaxLimit;
+  uint64_t min_rtt_us = 0;
+  uint64_t rtt_us = 0;          // mean of the last flush
+  uint64_t nr_updates = 0;
+  uint64_t nr_increases = 0;
+  uint64_t nr_decreases = 0;
+
+  // Latencies of the replies to the flush in progress.
+  uint64_t flush_sum_us = 0;
+  uint64_t flush_min_us = 0;
+  uint32_t flush_nr = 0;
+
+  void Sample(uint64_t latency_us) {
+    if (flush_nr == 0 || latency_us < flush_min_us) flush_min_us = latency_us;
+    flush_sum_us += latency_us;
+    flush_nr++;
+  }
+  // Called once per Flush() with the number of calls it sent.
+  void Update(size_t in_flight, bool failed, uint64_t now_us);
+
+  // The last kHistorySize limit changes, oldest first.
+  size_t history_size() const {
+    return nr_changes < kHistorySize ? nr_changes : kHistorySize;
+  }
+  const Change &history(size_t i) const {
+    return changes[(nr_changes - history_size() + i) % kHistorySize];
+  }
+ private:
+  void SetLimit(size_t new_limit, uint64_t now_us);
+
+  std::array<Change, kHistorySize> changes;
+  uint64_t nr_changes = 0;
+};
+
 class BaseClient {
+  friend class BaseStreamResult;
+  static constexpr size_t kMaxHedgePolicies = 16;
+
+  // How a call is answered: by one reply, by the items of a stream, or by
+  // the results of a batch, as many to a reply as fit, or not at all. A
+  // control call (a compound call, or an ack of one-way calls) is answered by
+  // one reply too, but isn't a call to a single procedure.
+  enum class CallKind { kOne, kStream, kBatch, kOneWay, kControl };
+
+  struct PendingCall {
+    BaseResult *result;
+    DiscardFn discard;
+    WireFormat wire;
+    uint32_t offset;      // call bytes in buf, kept for hedging
+    uint32_t len;
+    int policy;           // index into hedge_policies, or -1
+    bool hedged;
+    bool done;
+    bool batch;
+    std::string cache_key; // empty unless the reply may be cached
+  };
+
+  struct CachedReply {
+    std::string reply;
+    uint64_t expires_us;
+    int instance_id;
+  };
+
+  // One connection to a server. Replies on a connection come back in call
+  // order, so each channel keeps the calls it still owes a reply for. When
+  // the other channel has answered a call first, its reply here is parsed
+  // with the call's DiscardFn and dropped. Owed entries may outlive the
+  // Flush() that created them; call is then -1.
+  struct Channel {
+    struct Owed {
+      int call;
+      DiscardFn discard;
+      WireFormat wire;
+      bool batch;  // answered by several replies
+    };
+    static constexpr size_t kMaxOwed = 2 * BaseService::kMaxPipelineRequests;
+    static constexpr int kStream = -2;  // call of the open stream
+
+    int fd = -1;
+    bool compression = false; // the server takes compressed calls
+    bool takes_compact = false;   // and compact headers
+    bool compact_calls = false;   // we have switched to them
+    bool compact_replies = false; // and so has the server
+    PeerInfo peer;                // from the handshake, if any
+    // Feature bits we may use with it: the server's after a handshake, none
+    // if it refused one, all if there was none.
+    uint32_t features = ~0u;
+    SlidingBuffer inbuf;
+    std::array<Owed, kMaxOwed> owed;
+    size_t owed_head = 0;
+    size_t nr_owed = 0;
+
+    Owed &owed_front() { return owed[owed_head]; }
+    void PushOwed(int call, DiscardFn discard, WireFormat wire, bool batch = false) {
+      assert(nr_owed < kMaxOwed);
+      owed[(owed_head + nr_owed++) % kMaxOwed] = Owed{call, discard, wire, batch};
+    }
+    void PopOwed() {
+      owed_head = (owed_head + 1) % kMaxOwed;
+      nr_owed--;
+    }
+  };
+
   uint8_t *buf;
   size_t bufsz;
-  std::array<BaseResult*, BaseService::kMaxPipelineRequests> pending;
+  size_t nr_sent;       // bytes of buf already written by SendGathered()
+  std::vector<GatherSlice> gather;
+  std::array<PendingCall, BaseService::kMaxPipelineRequests> pending;
   size_t nr_pending;
-  int fd;
+  size_t nr_done;
+  Channel primary;
+  Channel backup;
   bool error;
   unsigned int xid;
   bool log_enabled;
+  uint64_t batch_start_us;
+  uint32_t batch_max_delay_us;
+  uint32_t batch_max_bytes;
+  uint64_t flush_sent_us;
+  std::array<HedgePolicy, kMaxHedgePolicies> hedge_policies;
+  size_t nr_hedge_policies;
+  std::unordered_map<std::string, CachedReply> cache;
+  size_t cache_capacity;
+  uint64_t nr_cache_hits;
+  ConcurrencyLimit concurrency;
+  WireFormat wire;
+  uint32_t compression_min_bytes;
+  std::vector<uint8_t> zbuf;
+  uint64_t nr_compressed_calls;
+  uint64_t nr_compressed_replies;
+  bool checksums;
+  bool compact_headers;
+  bool handshake;
+  uint64_t nr_bytes_sent;
+  uint64_t nr_bytes_received;
+  // The open stream, if any. Its call is the last one owed by the primary,
+  // so nothing else is sent until it ends.
+  BaseStreamResult *stream;
+  unsigned int stream_xid;
+  WireFormat stream_wire;
+  size_t chunk_len;          // items held in buf for the stream
+  size_t nr_unacked_chunks;
+  bool stream_input;         // Write() may add to the stream
  public:
   BaseClient();
   ~BaseClient();
   BaseClient(const BaseClient &rhs) = delete;
 
+  // Connects, then handshakes with the server: both ends say which version
+  // and features they have, and the server its limits. Compact headers are
+  // on from then on if both ends take them, and compressed calls,
+  // checksums and non-native wire formats if the server takes those. A
+  // server from before the handshake fails it, after which we connect again
+  // and keep to what every call negotiates itself, and so does one that
+  // doesn't answer within kHandshakeTimeoutMs.
+  static constexpr int kHandshakeTimeoutMs = 1000;
   bool Connect(const char *addr, unsigned int port);
-  bool Send(int instance_id, int func_id, BaseParams *params, BaseResult *result);
+  bool Send(int instance_id, int func_id, const BaseParams &params, BaseResult *result);
   void Flush();
+  // Sends a batch frame: one call to (instance_id, func_id) per set of
+  // arguments params holds. Like any other call, it is answered by Flush().
+  bool SendBatch(int instance_id, int func_id, const BaseParams &params,
+                 BaseResult *result);
+  // Sends a compound call, whose params are a chain of calls the server runs
+  // in order, answered with the results it asks for.
+  bool SendCompound(const BaseParams &params, BaseResult *result);
+  // Sends a call the server runs without replying, to a procedure that
+  // allows it. It goes out with the next Flush() or batch, like any other
+  // call. The server closes the connection on a call it can't run, which
+  // the next call waiting for a reply fails with.
+  bool SendOneWay(int instance_id, int func_id, const BaseParams &params);
+  // Asks how many one-way calls the server has run since the last ack,
+  // which, like a reply, comes with Flush(). Having run them all, the server
+  // has run everything sent before, too.
+  bool AckOneWay(OneWayAck *ack);
+  // Sends a call whose result is a stream, after flushing the calls before
+  // it. The stream has the connection to itself: sending another call, or
+  // opening another stream, closes it first.
+  bool OpenStream(int instance_id, int func_id, const BaseParams &params,
+                  BaseStreamResult *result);
 
   bool has_error() const { return error; }
   void set_log_enabled(bool enabled) { log_enabled = enabled; }
+  // Takes effect with the next Connect() or ConnectHedge().
+  void set_handshake_enabled(bool enabled) { handshake = enabled; }
+  // What the server said in the handshake; version 0 without one.
+  const PeerInfo &server_info() const { return primary.peer; }
+
+  // Encoding of the arguments and results of calls sent from now on. A
+  // server that refused the handshake, or didn't list kFeatureWireFormats in
+  // it, gets native ones.
+  void set_wire_format(WireFormat format) { wire = format; }
+  WireFormat wire_format() const { return wire; }
+
+  // Opt-in Nagle-style batching. Calls are held in the send buffer and go out
+  // together when a Send() finds that the oldest one has waited max_delay_us,
+  // the batch has reached max_bytes or the pipeline is full. Nothing but a
+  // Send() checks this: no timer runs, so max_delay_us bounds nothing while
+  // the caller is idle, and a held call waits for the next Send() or Flush().
+  // Callers no longer need to Flush() after every call, but must Flush() when
+  // they stop sending. (0, 0) turns batching off again.
+  void set_batch_window(uint32_t max_delay_us, uint32_t max_bytes) {
+    batch_max_delay_us = max_delay_us;
+    batch_max_bytes = max_bytes;
+  }
+  bool batching_enabled() const {
+    return batch_max_delay_us != 0 || batch_max_bytes != 0;
+  }
+
+  // Second replica that hedged calls are sent to. It must export the same
+  // services under the same instance ids as the primary.
+  bool ConnectHedge(const char *addr, unsigned int port);
+  // Hedge calls to (instance_id, func_id) that are slower than the given
+  // percentile of recent calls, but never sooner than min_delay_us.
+  bool SetHedgePolicy(int instance_id, int func_id, double percentile,
+                      double max_extra_load, uint32_t min_delay_us = 0);
+  const HedgePolicy *hedge_policy(int instance_id, int func_id) const;
+
+  // Opt-in cache of replies, keyed by (instance, procedure, wire format,
+  // encoded args).
+  // Only replies the server grants a lease for are kept, and only until the
+  // lease runs out or the server revokes it. Revocations are picked up
+  // whenever the client reads from the server: during Flush(), and before
+  // every lookup in the cache, at the cost of a read() per call. A call made
+  // while others are held or unanswered skips the cache, so that it sees
+  // their writes.
+  // 0 entries turns the cache off.
+  void enable_result_cache(size_t max_entries);
+  size_t cache_size() const { return cache.size(); }
+  uint64_t cache_hits() const { return nr_cache_hits; }
+
+  // Opt-in adaptive pipeline depth. Once as many calls as the current limit
+  // are pending, the next Send() flushes them first, so a slow server sees
+  // fewer of our calls queued at a time.
+  void enable_concurrency_limit(bool enabled);
+  const ConcurrencyLimit &concurrency_limit() const { return concurrency; }
+
+  // Opt-in compression of call arguments of min_bytes or more, once the
+  // server has said it takes them. Every call offers to take compressed
+  // replies, which the server sends above its own threshold. Arguments sent
+  // from the caller's memory (see BaseParams::kGatherMinBytes) aren't
+  // compressed. 0 turns it off.
+  void enable_compression(uint32_t min_bytes) { compression_min_bytes = min_bytes; }
+  uint64_t compressed_calls() const { return nr_compressed_calls; }
+  uint64_t compressed_replies() const { return nr_compressed_replies; }
+
+  // Opt-in CRC32C of every call and its reply, checked before anything in
+  // them is decoded. The server answers a corrupt call with GARBAGE_ARGS; a
+  // corrupt reply is an error like any unparsable one. Like the wire format,
+  // only used with a server that has them, unless the handshake is off.
+  void enable_checksums(bool enabled) { checksums = enabled; }
+
+  // Compact call and reply headers: a few bytes of varints for the xid,
+  // instance and procedure instead of Sun RPC's 40 and 24 or more. On by
+  // default, and agreed on in the handshake. Without one, every call offers
+  // them until the server says it takes them, and the next call answered by
+  // a single reply switches the connection to them for good. Calls are only
+  // hedged if the backup has the same headers. Turning them off takes
+  // effect with the next Connect() or ConnectHedge().
+  void enable_compact_headers(bool enabled) { compact_headers = enabled; }
+  bool uses_compact_headers() const { return primary.compact_calls; }
+  // Bytes written to and read from the servers so far.
+  uint64_t bytes_sent() const { return nr_bytes_sent; }
+  uint64_t bytes_received() const { return nr_bytes_received; }
  private:
-  bool ParseBuffer(uint8_t *inbytes, uint32_t *in_len, int nr_replied, bool *ok);
+  size_t PipelineLimit() const {
+    return concurrency.enabled ? concurrency.limit : BaseService::kMaxPipelineRequests;
+  }
+  bool UsesChecksums(const Channel &ch) const {
+    return checksums && (ch.features & kFeatureChecksums);
+  }
+  WireFormat WireFormatFor(const Channel &ch) const {
+    return ch.features & kFeatureWireFormats ? wire : WireFormat::kNative;
+  }
+  bool BatchWindowExpired() const;
+  bool SendCall(int instance_id, int func_id, const BaseParams &params,
+                BaseResult *result, CallKind kind);
+  bool SendGathered(size_t call_offset, size_t header_len, size_t call_len);
+  bool ConnectChannel(Channel *ch, const char *addr, unsigned int port);
+  bool Handshake(Channel *ch, bool *refused);
+  int FindHedgePolicy(int instance_id, int func_id) const;
+  void DropChannel(Channel *ch);
+  bool ReadChannel(Channel *ch, bool *ok);
+  bool ParseChannel(Channel *ch, bool *ok);
+  bool WaitChannel(Channel *ch, bool *ok);
+  bool NextItem(BaseStreamResult *result);
+  bool WriteItem(const BaseParams &item);
+  bool SendChunk(bool last);
+  void CloseStream();
+  void FailStream();
+  int64_t MaybeHedge();
+  bool ParseBuffer(uint8_t *inbytes, uint32_t *in_len, BaseResult *result,
+                   DiscardFn discard, WireFormat wire, bool compact, bool *ok,
+                   uint32_t *lease_ms, uint32_t *flags,
+                   const uint8_t **body, uint32_t *body_len);
+  bool ParseCallback(uint8_t *inbytes, uint32_t *in_len, bool *ok, bool compact);
+  bool ServeFromCache(const std::string &key, WireFormat wire, BaseResult *result);
+  void CacheReply(PendingCall *call, const uint8_t *reply, uint32_t len,
+                  uint32_t lease_ms);
+  void RevokeCache(int instance_id);
 };
 
 class Connection;
 
 class Server {
   static constexpr size_t kMaxServices = 128;
+  // Replies a stream sends before other connections are served.
+  static constexpr size_t kMaxStreamReplies = 64;
   friend class Connection;
 
   int epoll_fd = 0;
@@ -141,6 +780,14 @@ class Server {
   size_t nr_svc = 0;
   std::atomic_bool should_stop;
   bool log_enabled = true;
+  uint32_t compression_min_bytes = 0;
+  bool coalescing = false;
+  // Connections with a call parked this round (null once closed), and the
+  // procedures the calls are for. RunCoalesced() swaps the latter with
+  // running_procs, so that neither gives up its allocation.
+  std::vector<Connection *> coalesced;
+  std::vector<BaseProcedure *> coalesced_procs;
+  std::vector<BaseProcedure *> running_procs;
  public:
   Server();
   ~Server();
@@ -151,9 +798,21 @@ class Server {
   void SignalStop();
 
   void set_log_enabled(bool enabled) { log_enabled = enabled; }
+  // Takes compressed calls from clients that offer compression, and
+  // compresses their replies of min_bytes or more. 0 turns it off.
+  void set_compression(uint32_t min_bytes) { compression_min_bytes = min_bytes; }
+  // Opt-in coalescing of calls across connections. Calls to a procedure with
+  // a batch handler (see Service::ExportBatch()) that arrive in the same
+  // event loop tick, on any number of connections, run as one call to it.
+  // Procedures that grant or revoke leases aren't coalesced.
+  void set_coalescing(bool enabled) { coalescing = enabled; }
  private:
   void OnNewConnection();
+  void RevokeLeases(int instance_id, Connection *current);
   bool OnConnectionEvent(Connection *conn, uint32_t event_mask);
+  bool ServeConnection(Connection *conn);
+  void RunCoalesced();
+  void UpdatePollMask(Connection *conn, uint32_t mask);
   void CheckTimeout();
   bool CloseConnection(Connection *conn);
   bool ReadConnectionBuffer(Connection *conn);
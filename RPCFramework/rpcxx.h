@@ -5,6 +5,18 @@
 #include <iostream>
 #include <typeinfo>
 #include <cstdlib>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <vector>
 #include "rpc.h"
 #include <iostream>
 
@@ -14,12 +26,54 @@ namespace rpc {
 //
 // You may use network byte order, but it's optional. We won't test your code
 // on two different architectures.
+//
+// Besides Encode and Decode, every Protocol has Size(x): exactly the bytes
+// Encode writes for x, constexpr for fixed-size types, so callers can size a
+// buffer once and encode without running out of room.
 
-// TASK1: add more specializations to Protocol template class to support more
-// types.
+// Declares the fields of a struct so Protocol can encode it, e.g.
+//
+//   struct Point {
+//     int x, y;
+//     std::string label;
+//     RPC_FIELDS(x, y, label)
+//   };
+//
+// List every field, in declaration order. Types you can't edit can
+// specialize StructFields instead.
+#define RPC_FIELDS(...)                                                 \
+  auto RpcFields() { return std::tie(__VA_ARGS__); }                    \
+  auto RpcFields() const { return std::tie(__VA_ARGS__); }
+
+// Whether T lists its fields, and a tuple of references to them.
+template <typename T, typename = void>
+struct StructFields {
+  static constexpr bool value = false;
+  static void Tie(const T &x);
+};
+
+template <typename T>
+struct StructFields<T, decltype((void) std::declval<T &>().RpcFields())> {
+  static constexpr bool value = true;
+  static auto Tie(T &x) { return x.RpcFields(); }
+  static auto Tie(const T &x) { return x.RpcFields(); }
+};
+
+// Encodes a struct with listed fields under wire format P; defined with the
+// argument packs below.
+template <typename T, template <typename> class P,
+          typename Fields = decltype(StructFields<T>::Tie(std::declval<T &>()))>
+struct StructProtocol;
+
+// The object representation, for types without a better encoding.
 template <typename T>
- struct Protocol {
+struct RawProtocol {
   static constexpr size_t TYPE_SIZE = sizeof(T);
+  static constexpr size_t FIXED_SIZE = TYPE_SIZE;
+  // The wire format is the object representation, so arrays of T can be
+  // copied in one go.
+  static constexpr bool MEMCPY = std::is_trivially_copyable<T>::value;
+  static constexpr size_t Size(const T &x) { return TYPE_SIZE; }
   static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T &x) {
     if (*out_len < TYPE_SIZE) return false;
     memcpy(out_bytes, &x, TYPE_SIZE);
@@ -33,6 +87,17 @@ template <typename T>
     return true;
   }
 };
+
+// What wire format P falls back to for a type it has no specialization for:
+// structs go field by field in P, anything else to Fallback.
+template <typename T, template <typename> class P, typename Fallback>
+using DefaultProtocol = typename std::conditional<
+    StructFields<T>::value, StructProtocol<T, P>, Fallback>::type;
+
+// TASK1: add more specializations to Protocol template class to support more
+// types.
+template <typename T>
+struct Protocol : DefaultProtocol<T, Protocol, RawProtocol<T>> {};
 /*
 template <> struct Protocol<int> {
   static constexpr size_t TYPE_SIZE = sizeof(int);
@@ -255,447 +320,2081 @@ template <> struct Protocol<unsigned long> {
   }
 };*/
 
-// ok so here im using pascal strings (basically what we did in task 1 and task 3 and @605 on piazza)
-//sending the length of the string first as a uint32_t, and then the string
-template <> struct Protocol<std::string> {
-  static constexpr int SIZE_LEN = sizeof(uint32_t);
+constexpr bool kHostIsBigEndian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
 
-  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::string &x) {
-    uint8_t stringlength = x.length();
+// Converts between host order and big-endian, both ways.
+inline uint32_t BigEndian(uint32_t x) { return kHostIsBigEndian ? x : __builtin_bswap32(x); }
+inline uint64_t BigEndian(uint64_t x) { return kHostIsBigEndian ? x : __builtin_bswap64(x); }
 
-    if(*out_len < (uint8_t)(stringlength + 1))
-      return false;
-    memcpy(out_bytes, &stringlength, 1);
-    memcpy(out_bytes + 1, x.c_str(), stringlength);
-    *out_len = stringlength + 1;
+// LEB128 like VarintLength, for any 64-bit value: up to ten bytes.
+struct Varint {
+  static constexpr uint32_t MAX_SIZE = 10;
 
-    return true;
+  static uint32_t Size(uint64_t v) {
+    return (63 - __builtin_clzll(v | 1)) / 7 + 1;
   }
-  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::string &x) {
-    if(*in_len < 1)
-      return false;
-    else{
-      uint8_t string_length;
-      memcpy(&string_length, in_bytes, 1);
-
-      if(((uint8_t)(*in_len - 1))< string_length)
-        return false;
-      else{
-        x.assign((char*)(in_bytes + 1), string_length);
-        *in_len = string_length + 1;
+  // The caller has checked that Size(v) bytes fit.
+  static uint32_t Encode(uint8_t *out_bytes, uint64_t v) {
+    uint32_t i = 0;
+    while (v >= 0x80) {
+      out_bytes[i++] = v | 0x80;
+      v >>= 7;
+    }
+    out_bytes[i++] = v;
+    return i;
+  }
+  // Returns false if the value doesn't end within in_len bytes; *ok turns
+  // false if it is longer than any uint64_t needs.
+  static bool Decode(const uint8_t *in_bytes, uint32_t in_len, bool *ok,
+                     uint64_t *v, uint32_t *used) {
+    if (in_len > 0 && in_bytes[0] < 0x80) {
+      *v = in_bytes[0];
+      *used = 1;
+      return true;
+    }
+    uint32_t limit = in_len < MAX_SIZE ? in_len : MAX_SIZE;
+    uint64_t x = 0;
+    for (uint32_t i = 0; i < limit; i++) {
+      x |= (uint64_t) (in_bytes[i] & 0x7f) << (7 * i);
+      if (in_bytes[i] < 0x80) {
+        if (i == MAX_SIZE - 1 && in_bytes[i] > 1) break;
+        *v = x;
+        *used = i + 1;
         return true;
       }
-      
     }
+    if (limit == MAX_SIZE) *ok = false;
     return false;
   }
 };
 
-// TASK2: Client-side
+// How strings and byte arrays frame their bytes on the wire, so an encoder
+// can write the framing and leave large payloads in place. Protocol
+// specializations opt in with a BLOB member.
+enum class BlobFraming { kNone, kVarintLength, kXdrOpaque };
 
-class IntParam : public BaseParams {
-  int p;
- public:
-  IntParam(int p) : p(p) {}
+// Pascal strings: the VarintLength of the string, then its bytes.
+template <> struct Protocol<std::string> {
+  static constexpr BlobFraming BLOB = BlobFraming::kVarintLength;
+  static size_t Size(const std::string &x) {
+    return VarintLength::Size(x.length()) + x.length();
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::string &x) {
+    uint32_t n = x.length(), header;
+    if (n != x.length() || !VarintLength::Fits(*out_len, n, &header))
+      return false;
+    VarintLength::Encode(out_bytes, n);
+    memcpy(out_bytes + header, x.data(), n);
+    *out_len = header + n;
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::string &x) {
+    uint32_t n, header;
+    if (!VarintLength::Decode(in_bytes, *in_len, ok, &n, &header))
+      return false;
+    if (*in_len - header < n)
+      return false;
+    x.assign((char *) (in_bytes + header), n);
+    *in_len = header + n;
+    return true;
+  }
+};
 
-  bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    return Protocol<int>::Encode(out_bytes, out_len, p);
+// Same wire format as std::string. Decoding points the view into the request
+// buffer instead of copying, so it is only valid until the procedure returns.
+template <> struct Protocol<std::string_view> {
+  static constexpr BlobFraming BLOB = BlobFraming::kVarintLength;
+  static size_t Size(std::string_view x) {
+    return VarintLength::Size(x.length()) + x.length();
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, std::string_view x) {
+    uint32_t n = x.length(), header;
+    if (n != x.length() || !VarintLength::Fits(*out_len, n, &header))
+      return false;
+    VarintLength::Encode(out_bytes, n);
+    memcpy(out_bytes + header, x.data(), n);
+    *out_len = header + n;
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::string_view &x) {
+    uint32_t n, header;
+    if (!VarintLength::Decode(in_bytes, *in_len, ok, &n, &header))
+      return false;
+    if (*in_len - header < n)
+      return false;
+    x = std::string_view((const char *) (in_bytes + header), n);
+    *in_len = header + n;
+    return true;
   }
 };
 
-class BoolParam : public BaseParams {
-  bool p;
- public:
-  BoolParam(bool p) : p(p) {}
+// The traits below take the Protocol template of a wire format, which is
+// Protocol itself for the native one.
 
-  bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    return Protocol<bool>::Encode(out_bytes, out_len, p);
-  }
+// Number of bytes every value of T takes on the wire, or 0 if that depends on
+// the value. Protocol specializations opt in with a FIXED_SIZE member.
+template <typename T, template <typename> class P = Protocol, typename = void>
+struct FixedWireSize {
+  static constexpr size_t value = 0;
 };
 
+template <typename T, template <typename> class P>
+struct FixedWireSize<T, P, decltype((void) P<T>::FIXED_SIZE)> {
+  static constexpr size_t value = P<T>::FIXED_SIZE;
+};
 
+// Whether P<T> encodes a T as its raw sizeof(T) bytes. Protocol
+// specializations opt in with a true MEMCPY member.
+template <typename T, template <typename> class P = Protocol, typename = void>
+struct IsMemcpyWire {
+  static constexpr bool value = false;
+};
 
-class UIntParam : public BaseParams {
-  unsigned int p;
- public:
-  UIntParam(unsigned int p) : p(p) {}
+template <typename T, template <typename> class P>
+struct IsMemcpyWire<T, P, decltype((void) P<T>::MEMCPY)> {
+  static constexpr bool value = P<T>::MEMCPY && P<T>::FIXED_SIZE == sizeof(T);
+};
 
-  bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    return Protocol<unsigned int>::Encode(out_bytes, out_len, p);
-  }
+// Whether P<T> encodes a 4- or 8-byte T as its raw bytes in reverse order, so
+// arrays of T convert with ByteSwap32/64. Protocol specializations opt in
+// with a true SWAP member.
+template <typename T, template <typename> class P = Protocol, typename = void>
+struct IsSwapWire {
+  static constexpr bool value = false;
 };
-template<typename ... >
-class Param : public BaseParams{};
 
-template<typename T>
-class Param<T> : public BaseParams{
-	T p;
-	public:
-	Param(T p) : p(p){}
+template <typename T, template <typename> class P>
+struct IsSwapWire<T, P, decltype((void) P<T>::SWAP)> {
+  static constexpr bool value = P<T>::SWAP && P<T>::FIXED_SIZE == sizeof(T)
+      && (sizeof(T) == 4 || sizeof(T) == 8);
+};
 
-	bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    return Protocol<T>::Encode(out_bytes, out_len, p);
-}
+// Whether P<T> encodes a T as a Varint of P<T>::ToVarint(x), at most
+// P<T>::MAX_VARINT, which arrays encode and decode with fewer checks.
+// Protocol specializations opt in with a true VARINT member.
+template <typename T, template <typename> class P = Protocol, typename = void>
+struct IsVarintWire {
+  static constexpr bool value = false;
 };
 
-template <> class Param<void>: public BaseParams{
-  public:
-	bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    *out_len = 0;
-    return true;
-  }
+template <typename T, template <typename> class P>
+struct IsVarintWire<T, P, decltype((void) P<T>::VARINT)> {
+  static constexpr bool value = P<T>::VARINT;
+};
+
+// How P<T> frames T as bytes on the wire, kNone if it doesn't.
+template <typename T, template <typename> class P = Protocol, typename = void>
+struct BlobWire {
+  static constexpr BlobFraming value = BlobFraming::kNone;
+};
+
+template <typename T, template <typename> class P>
+struct BlobWire<T, P, decltype((void) P<T>::BLOB)> {
+  static constexpr BlobFraming value = P<T>::BLOB;
 };
 
-template <> class Param<std::string> : public BaseParams {
-  std::string p;
+// Non-owning view of size() contiguous values. A Span encodes exactly like a
+// std::vector with the same elements, so a client can send part of a bigger
+// buffer without copying it into a vector first. Decoding a Span of bytes
+// points it into the request buffer; it is only valid until the procedure
+// returns.
+template <typename T>
+class Span {
+  T *p;
+  size_t n;
  public:
-  Param(std::string p) : p(p) {}
+  Span() : p(nullptr), n(0) {}
+  Span(T *p, size_t n) : p(p), n(n) {}
+  template <typename U>
+  Span(std::vector<U> &v) : p(v.data()), n(v.size()) {}
+  template <typename U>
+  Span(const std::vector<U> &v) : p(v.data()), n(v.size()) {}
+
+  T *data() const { return p; }
+  size_t size() const { return n; }
+  T *begin() const { return p; }
+  T *end() const { return p + n; }
+  T &operator[](size_t i) const { return p[i]; }
+};
 
-  bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    return Protocol<std::string>::Encode(out_bytes, out_len, p);
+// Encoding shared by std::vector, std::array and Span. Raw element arrays are
+// copied with a single memcpy, byte-reversed ones (XDR numbers on this
+// machine) go through the ByteSwap kernels, varints decode eight at a time
+// while they are one byte long, everything else goes element by element.
+template <typename T, template <typename> class P = Protocol>
+struct ElementsProtocol {
+  enum Path { kEach, kMemcpy, kByteSwap, kVarint };
+  static constexpr Path PATH = IsMemcpyWire<T, P>::value ? kMemcpy
+      : IsSwapWire<T, P>::value ? kByteSwap
+      : IsVarintWire<T, P>::value ? kVarint : kEach;
+  static constexpr bool RAW = PATH == kMemcpy;
+
+  static size_t Size(const T *x, size_t n) {
+    constexpr size_t kFixedSize = FixedWireSize<T, P>::value;
+    if (kFixedSize != 0) return n * kFixedSize;
+    size_t size = 0;
+    for (size_t i = 0; i < n; i++) size += P<T>::Size(x[i]);
+    return size;
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T *x, size_t n) {
+    return Encode(std::integral_constant<Path, PATH>(), out_bytes, out_len, x, n);
+  }
+  template <typename Container>
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                     Container &x, size_t n) {
+    return Decode(std::integral_constant<Path, PATH>(), in_bytes, in_len, ok, x, n);
+  }
+  // Element by element no matter what T is. Only the benchmark wants this.
+  static bool EncodeEach(uint8_t *out_bytes, uint32_t *out_len, const T *x, size_t n) {
+    return Encode(std::integral_constant<Path, kEach>(), out_bytes, out_len, x, n);
+  }
+  template <typename Container>
+  static bool DecodeEach(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                         Container &x, size_t n) {
+    return Decode(std::integral_constant<Path, kEach>(), in_bytes, in_len, ok, x, n);
+  }
+
+ private:
+  static bool Encode(std::integral_constant<Path, kMemcpy>, uint8_t *out_bytes,
+                     uint32_t *out_len, const T *x, size_t n) {
+    if (*out_len < n * sizeof(T)) return false;
+    if (n > 0) memcpy(out_bytes, x, n * sizeof(T));
+    *out_len = n * sizeof(T);
+    return true;
   }
-};
-//twoparams
-template<typename A, typename B> class Param<A, B>:public BaseParams {
-  A ArgOne;
-  B ArgTwo;
-  public:
-  Param(A ArgOne, B ArgTwo) : ArgOne(ArgOne),ArgTwo(ArgTwo){}
-	bool Encode(uint8_t *out_bytes, uint32_t *out_len) const override {
-    uint32_t buffsize = *out_len;
-    if (Protocol<A>::Encode(out_bytes, out_len, ArgOne)==false){
-      return false;
+  static bool Encode(std::integral_constant<Path, kByteSwap>, uint8_t *out_bytes,
+                     uint32_t *out_len, const T *x, size_t n) {
+    if (*out_len < n * sizeof(T)) return false;
+    if (sizeof(T) == 4) ByteSwap32(out_bytes, x, n); else ByteSwap64(out_bytes, x, n);
+    *out_len = n * sizeof(T);
+    return true;
+  }
+  static bool Encode(std::integral_constant<Path, kVarint>, uint8_t *out_bytes,
+                     uint32_t *out_len, const T *x, size_t n) {
+    // With room for the longest values, skip the per-value checks.
+    constexpr size_t kMaxValueSize = (8 * sizeof(T) + 6) / 7;
+    if (*out_len / kMaxValueSize < n)
+      return Encode(std::integral_constant<Path, kEach>(), out_bytes, out_len, x, n);
+    uint32_t used = 0;
+    for (size_t i = 0; i < n; i++)
+      used += Varint::Encode(out_bytes + used, P<T>::ToVarint(x[i]));
+    *out_len = used;
+    return true;
+  }
+  static bool Encode(std::integral_constant<Path, kEach>, uint8_t *out_bytes,
+                     uint32_t *out_len, const T *x, size_t n) {
+    uint32_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+      uint32_t len = *out_len - used;
+      if (!P<T>::Encode(out_bytes + used, &len, x[i]))
+        return false;
+      used += len;
     }
-    uint32_t outlenOne = *out_len;
-    buffsize -= outlenOne;
-    out_bytes += outlenOne;
-    *out_len = buffsize;
-    if (Protocol<B>::Encode(out_bytes, out_len, ArgTwo)==false){
-      return false;
+    *out_len = used;
+    return true;
+  }
+  template <typename Container>
+  static bool Decode(std::integral_constant<Path, kMemcpy>, uint8_t *in_bytes,
+                     uint32_t *in_len, bool *ok, Container &x, size_t n) {
+    if (*in_len < n * sizeof(T)) return false;
+    if (n > 0) memcpy(&x[0], in_bytes, n * sizeof(T));
+    *in_len = n * sizeof(T);
+    return true;
+  }
+  template <typename Container>
+  static bool Decode(std::integral_constant<Path, kByteSwap>, uint8_t *in_bytes,
+                     uint32_t *in_len, bool *ok, Container &x, size_t n) {
+    if (*in_len < n * sizeof(T)) return false;
+    if (n > 0 && sizeof(T) == 4) ByteSwap32(&x[0], in_bytes, n);
+    if (n > 0 && sizeof(T) == 8) ByteSwap64(&x[0], in_bytes, n);
+    *in_len = n * sizeof(T);
+    return true;
+  }
+  template <typename Container>
+  static bool Decode(std::integral_constant<Path, kVarint>, uint8_t *in_bytes,
+                     uint32_t *in_len, bool *ok, Container &x, size_t n) {
+    constexpr uint64_t kHighBits = 0x8080808080808080ull;
+    uint32_t used = 0;
+    size_t i = 0;
+    while (i < n) {
+      // A run of one-byte values is taken eight bytes at a time: every byte
+      // before the first one with its continuation bit set is a whole
+      // value. Longer values take the one-by-one path.
+      if (*in_len - used >= sizeof(uint64_t) && in_bytes[used] < 0x80) {
+        uint64_t word;
+        memcpy(&word, in_bytes + used, sizeof(uint64_t));
+        if (kHostIsBigEndian) word = __builtin_bswap64(word);
+        uint64_t more = word & kHighBits;
+        size_t k = more ? __builtin_ctzll(more) / 8 : 8;
+        if (k > n - i) k = n - i;
+        for (size_t j = 0; j < k; j++)
+          x[i + j] = P<T>::FromVarint(in_bytes[used + j]);
+        i += k;
+        used += k;
+        continue;
+      }
+      uint32_t len = *in_len - used;
+      T value;
+      if (!P<T>::Decode(in_bytes + used, &len, ok, value) || !*ok)
+        return false;
+      x[i++] = value;
+      used += len;
+    }
+    *in_len = used;
+    return true;
+  }
+  template <typename Container>
+  static bool Decode(std::integral_constant<Path, kEach>, uint8_t *in_bytes,
+                     uint32_t *in_len, bool *ok, Container &x, size_t n) {
+    uint32_t used = 0;
+    for (size_t i = 0; i < n; i++) {
+      uint32_t len = *in_len - used;
+      T value;
+      if (!P<T>::Decode(in_bytes + used, &len, ok, value) || !*ok)
+        return false;
+      x[i] = std::move(value);
+      used += len;
     }
-    outlenOne += *out_len;
-    *out_len = outlenOne;
+    *in_len = used;
     return true;
   }
 };
 
-// TASK2: Server-side
-template <typename Svc>
-class IntIntProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    int x;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<int>::Decode(in_bytes, in_len, ok, x) || !*ok) {
+// VarintLength of the element count, then the elements. Shared by the wire
+// formats that use VarintLength; P is the Protocol template of the elements.
+template <typename T, template <typename> class P = Protocol>
+struct VectorProtocol {
+  static constexpr BlobFraming BLOB = sizeof(T) == 1 && IsMemcpyWire<T, P>::value
+      ? BlobFraming::kVarintLength : BlobFraming::kNone;
+
+  static size_t Size(const std::vector<T> &x) {
+    return SizeElements(x.data(), x.size());
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::vector<T> &x) {
+    return EncodeElements(out_bytes, out_len, x.data(), x.size());
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::vector<T> &x) {
+    uint32_t n, header;
+    if (!VarintLength::Decode(in_bytes, *in_len, ok, &n, &header))
       return false;
-    }
-	std::cout << "gets to int int procedure";
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = int (Svc::*)(int);
-    auto p = func_ptr.To<FunctionPointerType>();
-    int result = (((Svc *) instance)->*p)(x);
-    if (!Protocol<int>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
+    // Every element takes at least a byte, so a count this large means the
+    // rest of the message hasn't arrived yet. Don't allocate for it.
+    uint32_t len = *in_len - header;
+    if (n > len) return false;
+    x.resize(n);
+    if (!ElementsProtocol<T, P>::Decode(in_bytes + header, &len, ok, x, n))
       return false;
-    }
+    *in_len = header + len;
     return true;
   }
-};
-template <typename Svc>
-class VoidVoidProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    
-    *in_len = 0;//This function takes no parameters, doesnt consume any bytes
-    std::cout << "i got here!" << "\n";
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = void (Svc::*)();
-    auto p = func_ptr.To<FunctionPointerType>();
-    (((Svc *) instance)->*p)();
-    *out_len = 0;
+
+  static size_t SizeElements(const T *x, size_t n) {
+    return VarintLength::Size(n) + ElementsProtocol<T, P>::Size(x, n);
+  }
+  static bool EncodeElements(uint8_t *out_bytes, uint32_t *out_len,
+                             const T *x, size_t n) {
+    uint32_t count = n;
+    uint32_t header = VarintLength::Size(count);
+    if (count != n || *out_len < header)
+      return false;
+    VarintLength::Encode(out_bytes, count);
+    uint32_t len = *out_len - header;
+    if (!ElementsProtocol<T, P>::Encode(out_bytes + header, &len, x, n))
+      return false;
+    *out_len = header + len;
     return true;
   }
 };
-template <typename Svc>
-class BoolVoidProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
 
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-    // This incomplete solution only works for this type of member functions.
-    *in_len = 0;
-    std::cout << "gets to bool void proc";
-    using FunctionPointerType = bool (Svc::*)();
-    auto p = func_ptr.To<FunctionPointerType>();
-    bool result = (((Svc *) instance)->*p)();
-    if (!Protocol<bool>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
+template <typename T> struct Protocol<std::vector<T>> : VectorProtocol<T> {};
+
+// std::vector<bool> doesn't store plain bools, so it always goes one by one.
+template <> struct Protocol<std::vector<bool>> {
+  static size_t Size(const std::vector<bool> &x) {
+    return VarintLength::Size(x.size()) + x.size();
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::vector<bool> &x) {
+    uint32_t n = x.size(), header;
+    if (n != x.size() || !VarintLength::Fits(*out_len, n, &header))
       return false;
-    }
-    *out_len = sizeof(bool);
+    VarintLength::Encode(out_bytes, n);
+    for (size_t i = 0; i < n; i++) out_bytes[header + i] = x[i];
+    *out_len = header + n;
     return true;
   }
-};
-/*
-template <typename Svc>
-class BoolProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    bool x;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<bool>::Decode(in_bytes, in_len, ok, x) || !*ok) {
-      return false;
-    }
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = bool (Svc::*)(bool);
-    auto p = func_ptr.To<FunctionPointerType>();
-    bool result = (((Svc *) instance)->*p)(x);
-    if (!Protocol<bool>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::vector<bool> &x) {
+    uint32_t n, header;
+    if (!VarintLength::Decode(in_bytes, *in_len, ok, &n, &header))
       return false;
-    }
+    if (*in_len - header < n) return false;
+    x.resize(n);
+    for (size_t i = 0; i < n; i++) x[i] = in_bytes[header + i] != 0;
+    *in_len = header + n;
     return true;
   }
-};&*/
-template <typename Svc>
-class StrStrProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-	  std::cout << "now at str str procedure";
-    std::string x;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<std::string>::Decode(in_bytes, in_len, ok, x) || !*ok) {
-      return false;
-    }
-    //*in_len = sizeof(std::string);
-    // Now we cast the function pointer func_ptr to its original type.
-    //
+};
 
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = std::string (Svc::*)(std::string);
-    auto p = func_ptr.To<FunctionPointerType>();
-    std::string result = (((Svc *) instance)->*p)(x);
-    if (!Protocol<std::string>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
+// Same wire format as std::vector<T>.
+template <typename T, template <typename> class P = Protocol>
+struct SpanProtocol {
+  using Element = typename std::remove_const<T>::type;
+  static constexpr BlobFraming BLOB = VectorProtocol<Element, P>::BLOB;
+
+  static size_t Size(const Span<T> &x) {
+    return VectorProtocol<Element, P>::SizeElements(x.data(), x.size());
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const Span<T> &x) {
+    return VectorProtocol<Element, P>::EncodeElements(out_bytes, out_len, x.data(), x.size());
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, Span<T> &x) {
+    static_assert(sizeof(T) == 1 && IsMemcpyWire<Element, P>::value,
+                  "Only spans of bytes can point into the request buffer. "
+                  "Take a std::vector instead.");
+    uint32_t n, header;
+    if (!VarintLength::Decode(in_bytes, *in_len, ok, &n, &header))
       return false;
-    }
-    //*out_len = sizeof(std::string);
+    if (*in_len - header < n) return false;
+    x = Span<T>((T *) (in_bytes + header), n);
+    *in_len = header + n;
     return true;
   }
 };
 
-// TASK2: Server-side
-template <typename Svc>
-class StrIntProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    unsigned int x;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<unsigned int>::Decode(in_bytes, in_len, ok, x) || !*ok) {
-      return false;
-    }
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-	  std::cout <<"gets strint procedure";
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = std::string (Svc::*)(unsigned int);
-    auto p = func_ptr.To<FunctionPointerType>();
-    auto result = (((Svc *) instance)->*p)(x);
-    if (!Protocol<std::string>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
+template <typename T> struct Protocol<Span<T>> : SpanProtocol<T> {};
+
+// No count on the wire, the size is part of the type.
+template <typename T, size_t N, template <typename> class P = Protocol>
+struct ArrayProtocol {
+  static constexpr size_t FIXED_SIZE = N * FixedWireSize<T, P>::value;
+  static constexpr bool MEMCPY = IsMemcpyWire<T, P>::value;
+
+  static constexpr size_t Size(const std::array<T, N> &x) {
+    return FIXED_SIZE != 0 ? FIXED_SIZE : ElementsProtocol<T, P>::Size(x.data(), N);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::array<T, N> &x) {
+    return ElementsProtocol<T, P>::Encode(out_bytes, out_len, x.data(), N);
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::array<T, N> &x) {
+    return ElementsProtocol<T, P>::Decode(in_bytes, in_len, ok, x, N);
+  }
+};
+
+template <typename T, size_t N> struct Protocol<std::array<T, N>> : ArrayProtocol<T, N> {};
+
+// XDR (RFC 4506), the encoding of standard ONC RPC peers. Everything is
+// big-endian and takes a multiple of four bytes: types narrower than that
+// travel as int or unsigned int, 64-bit integers as hyper, byte strings and
+// byte vectors as opaque data padded with zeros. Types without an XDR mapping
+// keep their native encoding.
+template <typename T>
+struct XdrProtocol : DefaultProtocol<T, XdrProtocol, Protocol<T>> {};
+
+// T on the wire as the XDR type Wire: int32_t, uint32_t, int64_t, uint64_t,
+// float or double.
+template <typename T, typename Wire>
+struct XdrNumber {
+  using Bits = typename std::conditional<sizeof(Wire) == 4, uint32_t, uint64_t>::type;
+  static constexpr size_t FIXED_SIZE = sizeof(Wire);
+  static constexpr bool MEMCPY = kHostIsBigEndian && sizeof(T) == sizeof(Wire);
+  static constexpr bool SWAP = !kHostIsBigEndian && sizeof(T) == sizeof(Wire);
+
+  static constexpr size_t Size(const T &x) { return sizeof(Wire); }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T &x) {
+    if (*out_len < sizeof(Wire)) return false;
+    Wire w = static_cast<Wire>(x);
+    Bits b;
+    memcpy(&b, &w, sizeof(Wire));
+    b = BigEndian(b);
+    memcpy(out_bytes, &b, sizeof(Wire));
+    *out_len = sizeof(Wire);
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, T &x) {
+    if (*in_len < sizeof(Wire)) return false;
+    Bits b;
+    memcpy(&b, in_bytes, sizeof(Wire));
+    b = BigEndian(b);
+    Wire w;
+    memcpy(&w, &b, sizeof(Wire));
+    // A widened value that doesn't fit back into T is garbage.
+    if (sizeof(T) < sizeof(Wire) && static_cast<Wire>(static_cast<T>(w)) != w) {
       *ok = false;
       return false;
     }
-    //*out_len = sizeof(std::string);
+    x = static_cast<T>(w);
+    *in_len = sizeof(Wire);
     return true;
   }
 };
 
-template <typename Svc>
-class StrStrIntProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    std::string myString;
-    int x;
-    uint32_t buffsize = *in_len;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<std::string>::Decode(in_bytes, in_len, ok, myString) || !*ok) {
-      return false;
-    }
-    uint32_t inlenOne = *in_len;
-    buffsize -= inlenOne;
-    in_bytes += inlenOne;
-    *in_len = buffsize;
-    if (!Protocol<int>::Decode(in_bytes, in_len, ok, x) || !*ok) {
+template <> struct XdrProtocol<bool> : XdrNumber<bool, uint32_t> {};
+template <> struct XdrProtocol<char>
+    : XdrNumber<char, std::conditional<std::is_signed<char>::value, int32_t, uint32_t>::type> {};
+template <> struct XdrProtocol<signed char> : XdrNumber<signed char, int32_t> {};
+template <> struct XdrProtocol<unsigned char> : XdrNumber<unsigned char, uint32_t> {};
+template <> struct XdrProtocol<short> : XdrNumber<short, int32_t> {};
+template <> struct XdrProtocol<unsigned short> : XdrNumber<unsigned short, uint32_t> {};
+template <> struct XdrProtocol<int> : XdrNumber<int, int32_t> {};
+template <> struct XdrProtocol<unsigned int> : XdrNumber<unsigned int, uint32_t> {};
+template <> struct XdrProtocol<long> : XdrNumber<long, int64_t> {};
+template <> struct XdrProtocol<unsigned long> : XdrNumber<unsigned long, uint64_t> {};
+template <> struct XdrProtocol<long long> : XdrNumber<long long, int64_t> {};
+template <> struct XdrProtocol<unsigned long long> : XdrNumber<unsigned long long, uint64_t> {};
+template <> struct XdrProtocol<float> : XdrNumber<float, float> {};
+template <> struct XdrProtocol<double> : XdrNumber<double, double> {};
+
+// Opaque data: its length as an unsigned int unless the type fixes it, the
+// bytes, then zeros up to a multiple of four.
+struct XdrOpaque {
+  static constexpr uint32_t Padding(uint32_t n) { return -n & 3; }
+  static constexpr size_t Size(size_t n, bool counted = true) {
+    return (counted ? sizeof(uint32_t) : 0) + n + Padding(n);
+  }
+
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const void *p,
+                     size_t n, bool counted = true) {
+    uint32_t count = n, header = counted ? sizeof(uint32_t) : 0;
+    uint64_t total = header + (uint64_t) n + Padding(count);
+    if (count != n || *out_len < total)
       return false;
+    if (counted) {
+      uint32_t be = BigEndian(count);
+      memcpy(out_bytes, &be, sizeof(uint32_t));
     }
-    inlenOne += *in_len;
-    *in_len = inlenOne;
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-	std::cout <<"gets strstrint @@@@ procedure";
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = std::string (Svc::*)(std::string, unsigned int);
-    auto p = func_ptr.To<FunctionPointerType>();
-    auto result = (((Svc *) instance)->*p)(myString, x);
-    if (!Protocol<std::string>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
-      return false;
+    if (n > 0) memcpy(out_bytes + header, p, n);
+    memset(out_bytes + header + n, 0, Padding(count));
+    *out_len = total;
+    return true;
+  }
+  // Points *p at the bytes in the buffer. n is in/out: the length if the
+  // type fixes it, otherwise set from the count on the wire.
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, const uint8_t **p,
+                     uint32_t *n, bool counted = true) {
+    uint32_t header = 0;
+    if (counted) {
+      if (*in_len < sizeof(uint32_t)) return false;
+      memcpy(n, in_bytes, sizeof(uint32_t));
+      *n = BigEndian(*n);
+      header = sizeof(uint32_t);
     }
-    //*out_len = sizeof(std::string);
+    uint64_t total = header + (uint64_t) *n + Padding(*n);
+    if (*in_len < total) return false;
+    *p = in_bytes + header;
+    *in_len = total;
     return true;
   }
 };
 
-template <typename Svc>
-class ULongIntUIntProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    int x;
-    unsigned int y;
-    uint32_t buffsize = *in_len;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<int>::Decode(in_bytes, in_len, ok, x) || !*ok) {
-      return false;
-    }
-    uint32_t inlenOne = *in_len;
-    buffsize -= inlenOne;
-    in_bytes += inlenOne;
-    *in_len = buffsize;
-    if (!Protocol<unsigned int>::Decode(in_bytes, in_len, ok, y) || !*ok) {
-      return false;
-    }
-    inlenOne += *in_len;
-    *in_len = inlenOne;
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-	std::cout <<"gets strstrint @@@@ procedure";
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = unsigned long (Svc::*)(int, unsigned int);
-    auto p = func_ptr.To<FunctionPointerType>();
-    auto result = (((Svc *) instance)->*p)(x, y);
-    if (!Protocol<unsigned long>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
-      return false;
-    }
-    //*out_len = sizeof(std::string);
+// Counts and union discriminants: an unsigned int. Same interface as
+// VarintLength, so the container helpers below take either.
+struct XdrLength {
+  static constexpr uint32_t MAX_SIZE = sizeof(uint32_t);
+
+  static uint32_t Size(uint32_t n) { return sizeof(uint32_t); }
+  static uint32_t Encode(uint8_t *out_bytes, uint32_t n) {
+    uint32_t be = BigEndian(n);
+    memcpy(out_bytes, &be, sizeof(uint32_t));
+    return sizeof(uint32_t);
+  }
+  static bool Decode(const uint8_t *in_bytes, uint32_t in_len, bool *ok,
+                     uint32_t *n, uint32_t *used) {
+    if (in_len < sizeof(uint32_t)) return false;
+    memcpy(n, in_bytes, sizeof(uint32_t));
+    *n = BigEndian(*n);
+    *used = sizeof(uint32_t);
     return true;
   }
 };
 
+template <> struct XdrProtocol<std::string> {
+  static constexpr BlobFraming BLOB = BlobFraming::kXdrOpaque;
+  static size_t Size(const std::string &x) { return XdrOpaque::Size(x.size()); }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::string &x) {
+    return XdrOpaque::Encode(out_bytes, out_len, x.data(), x.size());
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::string &x) {
+    const uint8_t *p;
+    uint32_t n;
+    if (!XdrOpaque::Decode(in_bytes, in_len, &p, &n)) return false;
+    x.assign((const char *) p, n);
+    return true;
+  }
+};
 
-template <typename Svc>
-class VoidStrStrProcedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    std::string x;
-    std::string y;
-    uint32_t buffsize = *in_len;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<std::string>::Decode(in_bytes, in_len, ok, x) || !*ok) {
+template <> struct XdrProtocol<std::string_view> {
+  static constexpr BlobFraming BLOB = BlobFraming::kXdrOpaque;
+  static size_t Size(std::string_view x) { return XdrOpaque::Size(x.size()); }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, std::string_view x) {
+    return XdrOpaque::Encode(out_bytes, out_len, x.data(), x.size());
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::string_view &x) {
+    const uint8_t *p;
+    uint32_t n;
+    if (!XdrOpaque::Decode(in_bytes, in_len, &p, &n)) return false;
+    x = std::string_view((const char *) p, n);
+    return true;
+  }
+};
+
+// Vectors of bytes are opaque data, the others XDR arrays: the count as an
+// unsigned int, then the elements.
+template <typename T>
+struct XdrVector {
+  static constexpr bool OPAQUE = sizeof(T) == 1 && std::is_integral<T>::value
+      && !std::is_same<T, bool>::value;
+
+  static size_t SizeElements(const T *x, size_t n) {
+    if (OPAQUE) return XdrOpaque::Size(n);
+    return sizeof(uint32_t) + ElementsProtocol<T, XdrProtocol>::Size(x, n);
+  }
+  static bool EncodeElements(uint8_t *out_bytes, uint32_t *out_len,
+                             const T *x, size_t n) {
+    if (OPAQUE)
+      return XdrOpaque::Encode(out_bytes, out_len, x, n);
+    uint32_t count = n;
+    if (count != n || *out_len < sizeof(uint32_t))
       return false;
-    }
-    uint32_t inlenOne = *in_len;
-    buffsize -= inlenOne;
-    in_bytes += inlenOne;
-    *in_len = buffsize;
-    if (!Protocol<std::string>::Decode(in_bytes, in_len, ok, y) || !*ok) {
+    uint32_t be = BigEndian(count), len = *out_len - sizeof(uint32_t);
+    memcpy(out_bytes, &be, sizeof(uint32_t));
+    if (!ElementsProtocol<T, XdrProtocol>::Encode(out_bytes + sizeof(uint32_t), &len, x, n))
       return false;
+    *out_len = sizeof(uint32_t) + len;
+    return true;
+  }
+  template <typename Container>
+  static bool DecodeElements(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                             Container &x) {
+    const uint8_t *p;
+    uint32_t n;
+    if (OPAQUE) {
+      if (!XdrOpaque::Decode(in_bytes, in_len, &p, &n)) return false;
+      x.assign((const T *) p, (const T *) p + n);
+      return true;
     }
-    inlenOne += *in_len;
-    *in_len = inlenOne;
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-	std::cout <<"gets voidstrstr @@@@ procedure";
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = void (Svc::*)(std::string, std::string);
-    auto p = func_ptr.To<FunctionPointerType>();
-    (((Svc *) instance)->*p)(x, y);
-    // if (!Protocol<void>::Encode(out_bytes, out_len, result)) {
-    //   // out_len should always be large enough so this branch shouldn't be
-    //   // taken. However just in case, we return an fatal error by setting *ok
-    //   // to false.
-    //   *ok = false;
-    //   return false;
-    // }
-    *out_len = 0;
+    if (*in_len < sizeof(uint32_t)) return false;
+    memcpy(&n, in_bytes, sizeof(uint32_t));
+    n = BigEndian(n);
+    // Same reasoning as the native vector: don't allocate for a count the
+    // bytes we have can't hold.
+    uint32_t len = *in_len - sizeof(uint32_t);
+    if (n > len) return false;
+    x.resize(n);
+    if (!ElementsProtocol<T, XdrProtocol>::Decode(in_bytes + sizeof(uint32_t), &len, ok, x, n))
+      return false;
+    *in_len = sizeof(uint32_t) + len;
     return true;
   }
 };
 
-template <typename Svc, typename T>
-class Procedure : public BaseProcedure {
-  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
-                        uint8_t *out_bytes, uint32_t *out_len,
-                        bool *ok) override final {
-    T x;
-    // This function is similar to Decode. We need to return false if buffer
-    // isn't large enough, or fatal error happens during parsing.
-    if (!Protocol<T>::Decode(in_bytes, in_len, ok, x) || !*ok) {
-      return false;
-    }
-    // Now we cast the function pointer func_ptr to its original type.
-    //
-    // This incomplete solution only works for this type of member functions.
-    using FunctionPointerType = T (Svc::*)(T);
-    auto p = func_ptr.To<FunctionPointerType>();
-    T result = (((Svc *) instance)->*p)(x);
+template <typename T> struct XdrProtocol<std::vector<T>> {
+  static constexpr BlobFraming BLOB = XdrVector<T>::OPAQUE
+      ? BlobFraming::kXdrOpaque : BlobFraming::kNone;
+  static size_t Size(const std::vector<T> &x) {
+    return XdrVector<T>::SizeElements(x.data(), x.size());
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::vector<T> &x) {
+    return XdrVector<T>::EncodeElements(out_bytes, out_len, x.data(), x.size());
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::vector<T> &x) {
+    return XdrVector<T>::DecodeElements(in_bytes, in_len, ok, x);
+  }
+};
 
-    if (!Protocol<T>::Encode(out_bytes, out_len, result)) {
-      // out_len should always be large enough so this branch shouldn't be
-      // taken. However just in case, we return an fatal error by setting *ok
-      // to false.
-      *ok = false;
+template <> struct XdrProtocol<std::vector<bool>> {
+  static size_t Size(const std::vector<bool> &x) {
+    return sizeof(uint32_t) * (1 + x.size());
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::vector<bool> &x) {
+    uint32_t n = x.size();
+    if (n != x.size() || *out_len < sizeof(uint32_t) * (1 + (uint64_t) n))
       return false;
+    uint32_t be = BigEndian(n);
+    memcpy(out_bytes, &be, sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+      be = BigEndian((uint32_t) x[i]);
+      memcpy(out_bytes + sizeof(uint32_t) * (1 + i), &be, sizeof(uint32_t));
     }
+    *out_len = sizeof(uint32_t) * (1 + n);
     return true;
   }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::vector<bool> &x) {
+    return XdrVector<bool>::DecodeElements(in_bytes, in_len, ok, x);
+  }
 };
 
-// TASK2: Client-side
+template <typename T> struct XdrProtocol<Span<T>> {
+  using Element = typename std::remove_const<T>::type;
+  static constexpr BlobFraming BLOB = XdrVector<Element>::OPAQUE
+      ? BlobFraming::kXdrOpaque : BlobFraming::kNone;
+
+  static size_t Size(const Span<T> &x) {
+    return XdrVector<Element>::SizeElements(x.data(), x.size());
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const Span<T> &x) {
+    return XdrVector<Element>::EncodeElements(out_bytes, out_len, x.data(), x.size());
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, Span<T> &x) {
+    static_assert(XdrVector<Element>::OPAQUE,
+                  "Only spans of bytes can point into the request buffer. "
+                  "Take a std::vector instead.");
+    const uint8_t *p;
+    uint32_t n;
+    if (!XdrOpaque::Decode(in_bytes, in_len, &p, &n)) return false;
+    x = Span<T>((T *) p, n);
+    return true;
+  }
+};
+
+// XDR fixed-length arrays, and fixed-length opaque data for bytes.
+template <typename T, size_t N> struct XdrProtocol<std::array<T, N>> {
+  static constexpr bool OPAQUE = XdrVector<T>::OPAQUE;
+  static constexpr size_t FIXED_SIZE = OPAQUE ? N + XdrOpaque::Padding(N)
+      : N * FixedWireSize<T, XdrProtocol>::value;
+  static constexpr bool MEMCPY = IsMemcpyWire<T, XdrProtocol>::value;
+
+  static constexpr size_t Size(const std::array<T, N> &x) {
+    return FIXED_SIZE != 0 || N == 0 ? FIXED_SIZE
+        : ElementsProtocol<T, XdrProtocol>::Size(x.data(), N);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::array<T, N> &x) {
+    if (OPAQUE)
+      return XdrOpaque::Encode(out_bytes, out_len, x.data(), N, false);
+    return ElementsProtocol<T, XdrProtocol>::Encode(out_bytes, out_len, x.data(), N);
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::array<T, N> &x) {
+    if (OPAQUE) {
+      const uint8_t *p;
+      uint32_t n = N;
+      if (!XdrOpaque::Decode(in_bytes, in_len, &p, &n, false)) return false;
+      if (N > 0) memcpy((void *) x.data(), p, N);
+      return true;
+    }
+    return ElementsProtocol<T, XdrProtocol>::Decode(in_bytes, in_len, ok, x, N);
+  }
+};
+
+// Compact encoding for mostly small integers: unsigned ones as a Varint,
+// signed ones zigzagged first (0, -1, 1, -2, ... map to 0, 1, 2, 3, ...) so
+// small negative values stay short too. Everything else, including strings
+// and single bytes, keeps its native encoding.
+template <typename T>
+struct CompactProtocol : DefaultProtocol<T, CompactProtocol, Protocol<T>> {};
+
+template <typename T>
+struct CompactInteger {
+  using Unsigned = typename std::make_unsigned<T>::type;
+  static constexpr bool VARINT = true;
+  static constexpr uint64_t MAX_VARINT = std::numeric_limits<Unsigned>::max();
+
+  static uint64_t ToVarint(T x) {
+    if (std::is_signed<T>::value)
+      return ((uint64_t) x << 1) ^ (uint64_t) ((int64_t) x >> 63);
+    return (uint64_t) x;
+  }
+  static T FromVarint(uint64_t v) {
+    if (std::is_signed<T>::value)
+      return (T) ((v >> 1) ^ -(v & 1));
+    return (T) v;
+  }
+
+  static size_t Size(const T &x) { return Varint::Size(ToVarint(x)); }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T &x) {
+    uint64_t v = ToVarint(x);
+    if (*out_len < Varint::MAX_SIZE && *out_len < Varint::Size(v))
+      return false;
+    *out_len = Varint::Encode(out_bytes, v);
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, T &x) {
+    uint64_t v;
+    uint32_t used;
+    if (!Varint::Decode(in_bytes, *in_len, ok, &v, &used))
+      return false;
+    // Zigzag maps T onto all of Unsigned, so anything larger is garbage.
+    if (v > MAX_VARINT) {
+      *ok = false;
+      return false;
+    }
+    x = FromVarint(v);
+    *in_len = used;
+    return true;
+  }
+};
+
+template <> struct CompactProtocol<short> : CompactInteger<short> {};
+template <> struct CompactProtocol<unsigned short> : CompactInteger<unsigned short> {};
+template <> struct CompactProtocol<int> : CompactInteger<int> {};
+template <> struct CompactProtocol<unsigned int> : CompactInteger<unsigned int> {};
+template <> struct CompactProtocol<long> : CompactInteger<long> {};
+template <> struct CompactProtocol<unsigned long> : CompactInteger<unsigned long> {};
+template <> struct CompactProtocol<long long> : CompactInteger<long long> {};
+template <> struct CompactProtocol<unsigned long long> : CompactInteger<unsigned long long> {};
+
+template <typename T>
+struct CompactProtocol<std::vector<T>> : VectorProtocol<T, CompactProtocol> {};
+template <>
+struct CompactProtocol<std::vector<bool>> : Protocol<std::vector<bool>> {};
+template <typename T>
+struct CompactProtocol<Span<T>> : SpanProtocol<T, CompactProtocol> {};
+template <typename T, size_t N>
+struct CompactProtocol<std::array<T, N>> : ArrayProtocol<T, N, CompactProtocol> {};
+
+// Encodes and decodes values back to back, each one bounds checked against
+// what is left of the buffer. P is the Protocol template of the wire format.
+template <template <typename> class P, typename ...T>
+struct SequentialPack;
+
+template <template <typename> class P>
+struct SequentialPack<P> {
+  static size_t Size() { return 0; }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len) {
+    *out_len = 0;
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok) {
+    *in_len = 0;
+    return true;
+  }
+};
+
+template <template <typename> class P, typename T, typename ...Rest>
+struct SequentialPack<P, T, Rest...> {
+  static size_t Size(const T &x, const Rest &...rest) {
+    return P<T>::Size(x) + SequentialPack<P, Rest...>::Size(rest...);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len,
+                     const T &x, const Rest &...rest) {
+    uint32_t len = *out_len;
+    if (!P<T>::Encode(out_bytes, &len, x))
+      return false;
+    uint32_t rest_len = *out_len - len;
+    if (!SequentialPack<P, Rest...>::Encode(out_bytes + len, &rest_len, rest...))
+      return false;
+    *out_len = len + rest_len;
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                     T &x, Rest &...rest) {
+    uint32_t len = *in_len;
+    if (!P<T>::Decode(in_bytes, &len, ok, x) || !*ok)
+      return false;
+    uint32_t rest_len = *in_len - len;
+    if (!SequentialPack<P, Rest...>::Decode(in_bytes + len, &rest_len, ok, rest...))
+      return false;
+    *in_len = len + rest_len;
+    return true;
+  }
+};
+
+// Like SequentialPack, but every value has a fixed wire size. The buffer is
+// checked once against the constexpr total; after inlining, the per-value
+// checks compare constants and fold away, leaving straight-line loads and
+// stores.
+template <template <typename> class P, typename ...T>
+struct FixedPack;
+
+template <template <typename> class P>
+struct FixedPack<P> {
+  static constexpr size_t SIZE = 0;
+  static void Encode(uint8_t *out_bytes) {}
+  static void Decode(uint8_t *in_bytes, bool *ok) {}
+};
+
+template <template <typename> class P, typename T, typename ...Rest>
+struct FixedPack<P, T, Rest...> {
+  static constexpr size_t WIRE_SIZE = FixedWireSize<T, P>::value;
+  static constexpr size_t SIZE = WIRE_SIZE + FixedPack<P, Rest...>::SIZE;
+
+  static void Encode(uint8_t *out_bytes, const T &x, const Rest &...rest) {
+    uint32_t len = WIRE_SIZE;
+    P<T>::Encode(out_bytes, &len, x);
+    FixedPack<P, Rest...>::Encode(out_bytes + WIRE_SIZE, rest...);
+  }
+  static void Decode(uint8_t *in_bytes, bool *ok, T &x, Rest &...rest) {
+    uint32_t len = WIRE_SIZE;
+    P<T>::Decode(in_bytes, &len, ok, x);
+    FixedPack<P, Rest...>::Decode(in_bytes + WIRE_SIZE, ok, rest...);
+  }
+};
+
+template <template <typename> class P, typename ...T>
+struct AllFixedSize;
+
+template <template <typename> class P>
+struct AllFixedSize<P> {
+  static constexpr bool value = true;
+};
+
+template <template <typename> class P, typename T, typename ...Rest>
+struct AllFixedSize<P, T, Rest...> {
+  static constexpr bool value = FixedWireSize<T, P>::value != 0
+      && AllFixedSize<P, Rest...>::value;
+};
+
+template <template <typename> class P, typename ...T>
+struct AllMemcpyWire {
+  static constexpr bool value = true;
+};
+
+template <template <typename> class P, typename T, typename ...Rest>
+struct AllMemcpyWire<P, T, Rest...> {
+  static constexpr bool value = IsMemcpyWire<T, P>::value
+      && AllMemcpyWire<P, Rest...>::value;
+};
+
+// Wire format of an argument list. Picks FixedPack when every argument has a
+// fixed size and SequentialPack otherwise.
+template <template <typename> class P, typename ...T>
+struct ArgPack {
+  static constexpr bool FIXED = AllFixedSize<P, T...>::value;
+
+  static size_t Size(const T &...x) {
+    return FIXED ? FixedPack<P, T...>::SIZE : SequentialPack<P, T...>::Size(x...);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T &...x) {
+    return Encode(std::integral_constant<bool, FIXED>(), out_bytes, out_len, x...);
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, T &...x) {
+    return Decode(std::integral_constant<bool, FIXED>(), in_bytes, in_len, ok, x...);
+  }
+
+ private:
+  static bool Encode(std::true_type, uint8_t *out_bytes, uint32_t *out_len,
+                     const T &...x) {
+    if (*out_len < FixedPack<P, T...>::SIZE) return false;
+    FixedPack<P, T...>::Encode(out_bytes, x...);
+    *out_len = FixedPack<P, T...>::SIZE;
+    return true;
+  }
+  static bool Encode(std::false_type, uint8_t *out_bytes, uint32_t *out_len,
+                     const T &...x) {
+    return SequentialPack<P, T...>::Encode(out_bytes, out_len, x...);
+  }
+  static bool Decode(std::true_type, uint8_t *in_bytes, uint32_t *in_len,
+                     bool *ok, T &...x) {
+    if (*in_len < FixedPack<P, T...>::SIZE) return false;
+    FixedPack<P, T...>::Decode(in_bytes, ok, x...);
+    *in_len = FixedPack<P, T...>::SIZE;
+    return *ok;
+  }
+  static bool Decode(std::false_type, uint8_t *in_bytes, uint32_t *in_len,
+                     bool *ok, T &...x) {
+    return SequentialPack<P, T...>::Decode(in_bytes, in_len, ok, x...);
+  }
+};
+
+// Stands for the Protocol template of a wire format, so generic lambdas can
+// be handed one.
+template <template <typename> class P> struct WireTag {};
+
+// Calls f(WireTag<P>()) with the Protocol template of the wire format.
+template <typename F>
+inline auto WithWireFormat(WireFormat wire, F f) -> decltype(f(WireTag<Protocol>())) {
+  switch (wire) {
+  case WireFormat::kNative: return f(WireTag<Protocol>());
+  case WireFormat::kXdr: return f(WireTag<XdrProtocol>());
+  case WireFormat::kCompact: return f(WireTag<CompactProtocol>());
+  }
+  return {};
+}
+
+template <size_t ...I> struct IndexSequence {};
+
+template <size_t N, size_t ...I>
+struct MakeIndexSequence : MakeIndexSequence<N - 1, N - 1, I...> {};
+
+template <size_t ...I>
+struct MakeIndexSequence<0, I...> {
+  typedef IndexSequence<I...> type;
+};
+
+template <typename T> struct NonDeduced { typedef T type; };
+
+// Number and total wire size of the leading fixed-size values of T...
+template <template <typename> class P, typename ...T>
+struct FixedPrefix {
+  static constexpr size_t COUNT = 0;
+  static constexpr size_t SIZE = 0;
+};
+
+template <template <typename> class P, typename T, typename ...Rest>
+struct FixedPrefix<P, T, Rest...> {
+  static constexpr bool FIXED = FixedWireSize<T, P>::value != 0;
+  static constexpr size_t COUNT = FIXED ? 1 + FixedPrefix<P, Rest...>::COUNT : 0;
+  static constexpr size_t SIZE = FIXED
+      ? FixedWireSize<T, P>::value + FixedPrefix<P, Rest...>::SIZE : 0;
+};
+
+// Fields back to back in the order RPC_FIELDS lists them. When that is
+// exactly the memory layout (no padding, and every field raw bytes in this
+// wire format), the whole struct is one memcpy. Otherwise the leading
+// fixed-size fields are checked against the buffer once and go through
+// FixedPack, the rest through SequentialPack.
+template <typename T, template <typename> class P, typename ...F>
+struct StructProtocol<T, P, std::tuple<F &...>> {
+  static constexpr size_t FIELDS_SIZE = FixedPack<P, F...>::SIZE;
+  static constexpr size_t FIXED_SIZE =
+      AllFixedSize<P, F...>::value ? FIELDS_SIZE : 0;
+  static constexpr bool MEMCPY = std::is_trivially_copyable<T>::value
+      && AllMemcpyWire<P, F...>::value && FIELDS_SIZE == sizeof(T);
+
+  static size_t Size(const T &x) {
+    if (FIXED_SIZE != 0) return FIXED_SIZE;
+    return Size(Suffix(), StructFields<T>::Tie(x));
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T &x) {
+    if (MEMCPY) {
+      if (*out_len < sizeof(T)) return false;
+      memcpy(out_bytes, &x, sizeof(T));
+      *out_len = sizeof(T);
+      return true;
+    }
+    return Encode(Prefix(), Suffix(), out_bytes, out_len,
+                  StructFields<T>::Tie(x));
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, T &x) {
+    if (MEMCPY) {
+      if (*in_len < sizeof(T)) return false;
+      memcpy((void *) &x, in_bytes, sizeof(T));
+      *in_len = sizeof(T);
+      return true;
+    }
+    return Decode(Prefix(), Suffix(), in_bytes, in_len, ok,
+                  StructFields<T>::Tie(x));
+  }
+
+ private:
+  static constexpr size_t PREFIX_COUNT = FixedPrefix<P, F...>::COUNT;
+  static constexpr size_t PREFIX_SIZE = FixedPrefix<P, F...>::SIZE;
+  typedef typename MakeIndexSequence<PREFIX_COUNT>::type Prefix;
+  typedef typename MakeIndexSequence<sizeof...(F) - PREFIX_COUNT>::type Suffix;
+  template <size_t I>
+  using Field = typename std::tuple_element<I, std::tuple<F...>>::type;
+
+  template <size_t ...J, typename Tied>
+  static size_t Size(IndexSequence<J...>, const Tied &f) {
+    return PREFIX_SIZE + SequentialPack<P, Field<PREFIX_COUNT + J>...>::Size(
+        std::get<PREFIX_COUNT + J>(f)...);
+  }
+  template <size_t ...I, size_t ...J, typename Tied>
+  static bool Encode(IndexSequence<I...>, IndexSequence<J...>,
+                     uint8_t *out_bytes, uint32_t *out_len, const Tied &f) {
+    if (*out_len < PREFIX_SIZE) return false;
+    FixedPack<P, Field<I>...>::Encode(out_bytes, std::get<I>(f)...);
+    uint32_t len = *out_len - PREFIX_SIZE;
+    if (!SequentialPack<P, Field<PREFIX_COUNT + J>...>::Encode(
+            out_bytes + PREFIX_SIZE, &len, std::get<PREFIX_COUNT + J>(f)...))
+      return false;
+    *out_len = PREFIX_SIZE + len;
+    return true;
+  }
+  template <size_t ...I, size_t ...J>
+  static bool Decode(IndexSequence<I...>, IndexSequence<J...>,
+                     uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                     const std::tuple<F &...> &f) {
+    if (*in_len < PREFIX_SIZE) return false;
+    FixedPack<P, Field<I>...>::Decode(in_bytes, ok, std::get<I>(f)...);
+    if (!*ok) return false;
+    uint32_t len = *in_len - PREFIX_SIZE;
+    if (!SequentialPack<P, Field<PREFIX_COUNT + J>...>::Decode(
+            in_bytes + PREFIX_SIZE, &len, ok, std::get<PREFIX_COUNT + J>(f)...))
+      return false;
+    *in_len = PREFIX_SIZE + len;
+    return true;
+  }
+};
+
+// Values back to back, like the fields of a struct.
+template <template <typename> class P, typename ...T>
+struct TupleProtocol {
+  static constexpr size_t FIXED_SIZE =
+      AllFixedSize<P, T...>::value ? FixedPack<P, T...>::SIZE : 0;
+
+  static size_t Size(const std::tuple<T...> &x) {
+    return Size(typename MakeIndexSequence<sizeof...(T)>::type(), x);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::tuple<T...> &x) {
+    return Encode(typename MakeIndexSequence<sizeof...(T)>::type(), out_bytes, out_len, x);
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::tuple<T...> &x) {
+    return Decode(typename MakeIndexSequence<sizeof...(T)>::type(), in_bytes, in_len, ok, x);
+  }
+
+ private:
+  template <size_t ...I>
+  static size_t Size(IndexSequence<I...>, const std::tuple<T...> &x) {
+    return ArgPack<P, T...>::Size(std::get<I>(x)...);
+  }
+  template <size_t ...I>
+  static bool Encode(IndexSequence<I...>, uint8_t *out_bytes, uint32_t *out_len,
+                     const std::tuple<T...> &x) {
+    return ArgPack<P, T...>::Encode(out_bytes, out_len, std::get<I>(x)...);
+  }
+  template <size_t ...I>
+  static bool Decode(IndexSequence<I...>, uint8_t *in_bytes, uint32_t *in_len,
+                     bool *ok, std::tuple<T...> &x) {
+    return ArgPack<P, T...>::Decode(in_bytes, in_len, ok, std::get<I>(x)...);
+  }
+};
+
+template <typename A, typename B, template <typename> class P = Protocol>
+struct PairProtocol {
+  static constexpr size_t FIXED_SIZE = TupleProtocol<P, A, B>::FIXED_SIZE;
+
+  static size_t Size(const std::pair<A, B> &x) {
+    return ArgPack<P, A, B>::Size(x.first, x.second);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::pair<A, B> &x) {
+    return ArgPack<P, A, B>::Encode(out_bytes, out_len, x.first, x.second);
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::pair<A, B> &x) {
+    return ArgPack<P, A, B>::Decode(in_bytes, in_len, ok, x.first, x.second);
+  }
+};
+
+// A bool, then the value if there is one.
+template <typename T, template <typename> class P = Protocol>
+struct OptionalProtocol {
+  static size_t Size(const std::optional<T> &x) {
+    return P<bool>::Size(x.has_value()) + (x ? P<T>::Size(*x) : 0);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const std::optional<T> &x) {
+    if (!x) return ArgPack<P, bool>::Encode(out_bytes, out_len, false);
+    return ArgPack<P, bool, T>::Encode(out_bytes, out_len, true, *x);
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, std::optional<T> &x) {
+    bool present;
+    uint32_t header = *in_len;
+    if (!P<bool>::Decode(in_bytes, &header, ok, present) || !*ok)
+      return false;
+    if (!present) {
+      x.reset();
+      *in_len = header;
+      return true;
+    }
+    if (!x) x.emplace();
+    uint32_t len = *in_len - header;
+    if (!P<T>::Decode(in_bytes + header, &len, ok, *x))
+      return false;
+    *in_len = header + len;
+    return true;
+  }
+};
+
+// The index of the alternative as a Length, then its value. An index past
+// the last alternative is garbage.
+template <template <typename> class P, typename Length, typename ...T>
+struct VariantProtocol {
+  typedef std::variant<T...> Variant;
+
+  static size_t Size(const Variant &x) {
+    if (x.valueless_by_exception()) return 0;
+    return Length::Size(x.index()) + Alternatives(Indices()).size[x.index()](x);
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const Variant &x) {
+    if (x.valueless_by_exception()) return false;
+    uint32_t i = x.index(), header = Length::Size(i);
+    if (*out_len < header) return false;
+    Length::Encode(out_bytes, i);
+    uint32_t len = *out_len - header;
+    if (!Alternatives(Indices()).encode[i](out_bytes + header, &len, x))
+      return false;
+    *out_len = header + len;
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, Variant &x) {
+    uint32_t i, header;
+    if (!Length::Decode(in_bytes, *in_len, ok, &i, &header))
+      return false;
+    if (i >= sizeof...(T)) {
+      *ok = false;
+      return false;
+    }
+    uint32_t len = *in_len - header;
+    if (!Alternatives(Indices()).decode[i](in_bytes + header, &len, ok, x))
+      return false;
+    *in_len = header + len;
+    return true;
+  }
+
+ private:
+  typedef typename MakeIndexSequence<sizeof...(T)>::type Indices;
+  template <size_t I>
+  using Alternative = typename std::variant_alternative<I, Variant>::type;
+
+  template <size_t I>
+  static size_t SizeAlternative(const Variant &x) {
+    return P<Alternative<I>>::Size(std::get<I>(x));
+  }
+  template <size_t I>
+  static bool EncodeAlternative(uint8_t *out_bytes, uint32_t *out_len, const Variant &x) {
+    return P<Alternative<I>>::Encode(out_bytes, out_len, std::get<I>(x));
+  }
+  template <size_t I>
+  static bool DecodeAlternative(uint8_t *in_bytes, uint32_t *in_len, bool *ok, Variant &x) {
+    if (x.index() != I) x.template emplace<I>();
+    return P<Alternative<I>>::Decode(in_bytes, in_len, ok, std::get<I>(x));
+  }
+
+  // One function per alternative, indexed by the runtime index.
+  struct Table {
+    size_t (*size[sizeof...(T)])(const Variant &);
+    bool (*encode[sizeof...(T)])(uint8_t *, uint32_t *, const Variant &);
+    bool (*decode[sizeof...(T)])(uint8_t *, uint32_t *, bool *, Variant &);
+  };
+  template <size_t ...I>
+  static const Table &Alternatives(IndexSequence<I...>) {
+    static const Table table = { { &SizeAlternative<I>... },
+                                 { &EncodeAlternative<I>... },
+                                 { &DecodeAlternative<I>... } };
+    return table;
+  }
+};
+
+// std::map and std::unordered_map: the Length of the entry count, then each
+// key followed by its value. When keys and values have fixed sizes, the
+// buffer is checked once for the whole map on both ends. Decoding reserves
+// the buckets of an unordered_map up front and appends to a map at its end,
+// which is where sorted input goes.
+template <typename Map, template <typename> class P = Protocol,
+          typename Length = VarintLength>
+struct MapProtocol {
+  typedef typename Map::key_type K;
+  typedef typename Map::mapped_type V;
+  static constexpr bool FIXED = AllFixedSize<P, K, V>::value;
+  static constexpr size_t ENTRY_SIZE = FixedPack<P, K, V>::SIZE;
+
+  static size_t Size(const Map &x) {
+    size_t size = Length::Size(x.size());
+    if (FIXED) return size + x.size() * ENTRY_SIZE;
+    for (auto &kv: x) size += SequentialPack<P, K, V>::Size(kv.first, kv.second);
+    return size;
+  }
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const Map &x) {
+    uint32_t n = x.size(), header = Length::Size(n);
+    if (n != x.size() || *out_len < header)
+      return false;
+    Length::Encode(out_bytes, n);
+    uint32_t len = *out_len - header;
+    if (!EncodeEntries(std::integral_constant<bool, FIXED>(), out_bytes + header,
+                       &len, x))
+      return false;
+    *out_len = header + len;
+    return true;
+  }
+  static bool Decode(uint8_t *in_bytes, uint32_t *in_len, bool *ok, Map &x) {
+    uint32_t n, header;
+    if (!Length::Decode(in_bytes, *in_len, ok, &n, &header))
+      return false;
+    // As with vectors, every entry takes at least a byte: don't allocate for
+    // a count the bytes we have can't hold.
+    uint32_t len = *in_len - header;
+    if (n > len) return false;
+    x.clear();
+    Reserve(x, n, 0);
+    if (!DecodeEntries(std::integral_constant<bool, FIXED>(), in_bytes + header,
+                       &len, ok, x, n))
+      return false;
+    *in_len = header + len;
+    return true;
+  }
+
+ private:
+  static bool EncodeEntries(std::true_type, uint8_t *out_bytes, uint32_t *out_len,
+                            const Map &x) {
+    if (*out_len / ENTRY_SIZE < x.size()) return false;
+    for (auto &kv: x) {
+      FixedPack<P, K, V>::Encode(out_bytes, kv.first, kv.second);
+      out_bytes += ENTRY_SIZE;
+    }
+    *out_len = x.size() * ENTRY_SIZE;
+    return true;
+  }
+  static bool EncodeEntries(std::false_type, uint8_t *out_bytes, uint32_t *out_len,
+                            const Map &x) {
+    uint32_t used = 0;
+    for (auto &kv: x) {
+      uint32_t len = *out_len - used;
+      if (!SequentialPack<P, K, V>::Encode(out_bytes + used, &len, kv.first, kv.second))
+        return false;
+      used += len;
+    }
+    *out_len = used;
+    return true;
+  }
+  static bool DecodeEntries(std::true_type, uint8_t *in_bytes, uint32_t *in_len,
+                            bool *ok, Map &x, uint32_t n) {
+    if (*in_len / ENTRY_SIZE < n) return false;
+    K k;
+    V v;
+    for (uint32_t i = 0; i < n; i++) {
+      FixedPack<P, K, V>::Decode(in_bytes + i * ENTRY_SIZE, ok, k, v);
+      if (!*ok) return false;
+      x.emplace_hint(x.end(), std::move(k), std::move(v));
+    }
+    *in_len = n * ENTRY_SIZE;
+    return true;
+  }
+  static bool DecodeEntries(std::false_type, uint8_t *in_bytes, uint32_t *in_len,
+                            bool *ok, Map &x, uint32_t n) {
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < n; i++) {
+      K k;
+      V v;
+      uint32_t len = *in_len - used;
+      if (!SequentialPack<P, K, V>::Decode(in_bytes + used, &len, ok, k, v))
+        return false;
+      x.emplace_hint(x.end(), std::move(k), std::move(v));
+      used += len;
+    }
+    *in_len = used;
+    return true;
+  }
+  template <typename M>
+  static auto Reserve(M &x, uint32_t n, int) -> decltype(x.reserve(n)) {
+    return x.reserve(n);
+  }
+  template <typename M>
+  static void Reserve(M &x, uint32_t n, long) {}
+};
+
+template <typename ...T>
+struct Protocol<std::tuple<T...>> : TupleProtocol<Protocol, T...> {};
+template <typename A, typename B>
+struct Protocol<std::pair<A, B>> : PairProtocol<A, B> {};
+template <typename T>
+struct Protocol<std::optional<T>> : OptionalProtocol<T> {};
+template <typename ...T>
+struct Protocol<std::variant<T...>> : VariantProtocol<Protocol, VarintLength, T...> {};
+template <typename K, typename V, typename C, typename A>
+struct Protocol<std::map<K, V, C, A>> : MapProtocol<std::map<K, V, C, A>> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct Protocol<std::unordered_map<K, V, H, E, A>>
+    : MapProtocol<std::unordered_map<K, V, H, E, A>> {};
+
+// XDR structs, optional-data, discriminated unions, and counted arrays of
+// key/value structs.
+template <typename ...T>
+struct XdrProtocol<std::tuple<T...>> : TupleProtocol<XdrProtocol, T...> {};
+template <typename A, typename B>
+struct XdrProtocol<std::pair<A, B>> : PairProtocol<A, B, XdrProtocol> {};
+template <typename T>
+struct XdrProtocol<std::optional<T>> : OptionalProtocol<T, XdrProtocol> {};
+template <typename ...T>
+struct XdrProtocol<std::variant<T...>> : VariantProtocol<XdrProtocol, XdrLength, T...> {};
+template <typename K, typename V, typename C, typename A>
+struct XdrProtocol<std::map<K, V, C, A>>
+    : MapProtocol<std::map<K, V, C, A>, XdrProtocol, XdrLength> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct XdrProtocol<std::unordered_map<K, V, H, E, A>>
+    : MapProtocol<std::unordered_map<K, V, H, E, A>, XdrProtocol, XdrLength> {};
+
+template <typename ...T>
+struct CompactProtocol<std::tuple<T...>> : TupleProtocol<CompactProtocol, T...> {};
+template <typename A, typename B>
+struct CompactProtocol<std::pair<A, B>> : PairProtocol<A, B, CompactProtocol> {};
+template <typename T>
+struct CompactProtocol<std::optional<T>> : OptionalProtocol<T, CompactProtocol> {};
+template <typename ...T>
+struct CompactProtocol<std::variant<T...>>
+    : VariantProtocol<CompactProtocol, VarintLength, T...> {};
+template <typename K, typename V, typename C, typename A>
+struct CompactProtocol<std::map<K, V, C, A>>
+    : MapProtocol<std::map<K, V, C, A>, CompactProtocol> {};
+template <typename K, typename V, typename H, typename E, typename A>
+struct CompactProtocol<std::unordered_map<K, V, H, E, A>>
+    : MapProtocol<std::unordered_map<K, V, H, E, A>, CompactProtocol> {};
+
+// Encodes one argument for BaseParams::Encode() with a gather list: a blob of
+// kGatherMinBytes or more gets only its framing written, and its bytes are
+// appended to the list.
+template <typename T, template <typename> class P>
+struct GatherProtocol {
+  static constexpr BlobFraming FRAMING = BlobWire<T, P>::value;
+  using Blob = std::integral_constant<bool, FRAMING != BlobFraming::kNone>;
+
+  // Bytes of x left in place.
+  static size_t Gathered(const T &x) { return Gathered(Blob(), x); }
+  // offset is where out_bytes sits in the encoding of the call.
+  static bool Encode(uint8_t *out_bytes, uint32_t *out_len, const T &x,
+                     uint32_t offset, std::vector<GatherSlice> *gather) {
+    if (Gathered(x) == 0) return P<T>::Encode(out_bytes, out_len, x);
+    return EncodeFraming(Blob(), out_bytes, out_len, x, offset, gather);
+  }
+
+ private:
+  static size_t Gathered(std::true_type, const T &x) {
+    return x.size() >= BaseParams::kGatherMinBytes ? x.size() : 0;
+  }
+  static size_t Gathered(std::false_type, const T &x) { return 0; }
+
+  static bool EncodeFraming(std::true_type, uint8_t *out_bytes, uint32_t *out_len,
+                            const T &x, uint32_t offset,
+                            std::vector<GatherSlice> *gather) {
+    uint32_t count = x.size();
+    if (count != x.size()) return false;
+    uint32_t header = FRAMING == BlobFraming::kXdrOpaque
+        ? XdrLength::Size(count) : VarintLength::Size(count);
+    uint32_t trailer = FRAMING == BlobFraming::kXdrOpaque
+        ? XdrOpaque::Padding(count) : 0;
+    if (*out_len < header + trailer) return false;
+    if (FRAMING == BlobFraming::kXdrOpaque)
+      XdrLength::Encode(out_bytes, count);
+    else
+      VarintLength::Encode(out_bytes, count);
+    memset(out_bytes + header, 0, trailer);
+    gather->push_back(GatherSlice{offset + header, (const uint8_t *) x.data(), x.size()});
+    *out_len = header + trailer;
+    return true;
+  }
+  static bool EncodeFraming(std::false_type, uint8_t *, uint32_t *, const T &,
+                            uint32_t, std::vector<GatherSlice> *) {
+    return false;
+  }
+};
+
+// The arguments of one call in a batch: the argument itself for methods
+// taking one, so a batch handler sees a plain array of them, and a
+// std::tuple otherwise. Either encodes exactly like the call's arguments.
+template <typename ...T>
+struct BatchArgOf {
+  using type = std::tuple<T...>;
+  template <typename F>
+  static decltype(auto) Apply(F &&f, type &x) { return std::apply(f, std::move(x)); }
+};
+
+template <typename T>
+struct BatchArgOf<T> {
+  using type = T;
+  template <typename F>
+  static decltype(auto) Apply(F &&f, type &x) { return f(std::move(x)); }
+};
+
+// TASK2: Client-side
+
+// Params only live for the duration of BaseClient::Send(), which encodes them
+// straight into the send buffer. They keep references to the caller's
+// arguments instead of copies.
+template <typename ...T>
+class Param : public BaseParams {
+  std::tuple<const T &...> args;
+
+  using Indices = typename MakeIndexSequence<sizeof...(T)>::type;
+
+  template <template <typename> class P, size_t ...I>
+  size_t SizeArgs(WireTag<P>, IndexSequence<I...>, size_t *gathered) const {
+    if (gathered)
+      *gathered = (0 + ... + GatherProtocol<T, P>::Gathered(std::get<I>(args)));
+    return ArgPack<P, T...>::Size(std::get<I>(args)...);
+  }
+  template <template <typename> class P, size_t ...I>
+  bool GatherArgs(WireTag<P>, IndexSequence<I...>, uint8_t *out_bytes,
+                  uint32_t *out_len, std::vector<GatherSlice> *gather) const {
+    uint32_t used = 0;
+    auto encode = [&](auto &x) {
+      uint32_t len = *out_len - used;
+      if (!GatherProtocol<typename std::decay<decltype(x)>::type, P>::Encode(
+              out_bytes + used, &len, x, used, gather))
+        return false;
+      used += len;
+      return true;
+    };
+    (void) encode; // unused without arguments
+    if (!(true && ... && encode(std::get<I>(args))))
+      return false;
+    *out_len = used;
+    return true;
+  }
+  template <template <typename> class P, size_t ...I>
+  bool EncodeArgs(WireTag<P>, IndexSequence<I...>, uint8_t *out_bytes,
+                  uint32_t *out_len) const {
+    return ArgPack<P, T...>::Encode(out_bytes, out_len, std::get<I>(args)...);
+  }
+ public:
+  Param(const T &...args) : args(args...) {}
+
+  size_t Size(WireFormat wire, size_t *gathered = nullptr) const override {
+    return WithWireFormat(wire, [&](auto tag) {
+      return SizeArgs(tag, Indices(), gathered);
+    });
+  }
+  bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire,
+              std::vector<GatherSlice> *gather = nullptr) const override {
+    return WithWireFormat(wire, [&](auto tag) {
+      if (gather)
+        return GatherArgs(tag, Indices(), out_bytes, out_len, gather);
+      return EncodeArgs(tag, Indices(), out_bytes, out_len);
+    });
+  }
+};
+
+// Arguments of a batch call: how many calls there are, as an XDR unsigned
+// int, then the arguments of each. Like Param, refers to the caller's.
+template <typename ...T>
+class BatchParam : public BaseParams {
+  using Arg = typename BatchArgOf<T...>::type;
+  Span<const Arg> args;
+
+  template <template <typename> class P>
+  size_t SizeArgs(WireTag<P>) const {
+    size_t size = XdrProtocol<unsigned int>::FIXED_SIZE;
+    if (ArgPack<P, Arg>::FIXED && args.size() > 0)
+      return size + args.size() * ArgPack<P, Arg>::Size(args[0]);
+    for (auto &x: args)
+      size += ArgPack<P, Arg>::Size(x);
+    return size;
+  }
+  template <template <typename> class P>
+  bool EncodeArgs(WireTag<P>, uint8_t *out_bytes, uint32_t *out_len) const {
+    uint32_t used = *out_len;
+    if (!XdrProtocol<unsigned int>::Encode(out_bytes, &used, args.size()))
+      return false;
+    for (auto &x: args) {
+      uint32_t len = *out_len - used;
+      if (!ArgPack<P, Arg>::Encode(out_bytes + used, &len, x))
+        return false;
+      used += len;
+    }
+    *out_len = used;
+    return true;
+  }
+ public:
+  BatchParam(Span<const Arg> args) : args(args) {}
+
+  size_t Size(WireFormat wire, size_t *gathered = nullptr) const override {
+    if (gathered)
+      *gathered = 0;
+    return WithWireFormat(wire, [&](auto tag) { return SizeArgs(tag); });
+  }
+  bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire,
+              std::vector<GatherSlice> *gather = nullptr) const override {
+    return WithWireFormat(wire, [&](auto tag) {
+      return EncodeArgs(tag, out_bytes, out_len);
+    });
+  }
+};
+
+// The result of an operation of a Compound, to pass to a later one.
+template <typename T>
+class Ref {
+  friend class Compound;
+  friend class Client;
+  unsigned int op;
+  explicit Ref(unsigned int op) : op(op) {}
+};
+
+// A chain of calls sent as one, like an NFSv4 COMPOUND, in which arguments
+// may be the results of earlier calls (see Ref). The server runs them in
+// order and sends back one result, so k dependent calls take one round trip
+// instead of k. Unlike Param, it keeps copies of the arguments.
+class Compound {
+  friend class CompoundParam;
+
+  struct BaseArg {
+    virtual ~BaseArg() {}
+    virtual size_t Size(WireFormat wire) const = 0;
+    virtual bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire) const = 0;
+  };
+  template <typename T>
+  struct Arg : BaseArg {
+    T x;
+    Arg(const T &x) : x(x) {}
+    size_t Size(WireFormat wire) const override { return Param<T>(x).Size(wire); }
+    bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire) const override {
+      return Param<T>(x).Encode(out_bytes, out_len, wire);
+    }
+  };
+  // An argument: the result of operation ref, or arg if that is null.
+  struct Piece {
+    unsigned int ref;
+    std::unique_ptr<BaseArg> arg;
+  };
+  struct Op {
+    int instance_id;
+    int func_id;
+    std::vector<Piece> args;
+  };
+  std::vector<Op> ops;
+
+  template <typename T>
+  static Piece MakePiece(const Ref<T> &ref) { return Piece{ref.op, nullptr}; }
+  template <typename T>
+  static Piece MakePiece(const typename NonDeduced<T>::type &x) {
+    return Piece{0, std::unique_ptr<BaseArg>(new Arg<T>(x))};
+  }
+
+  static constexpr size_t kUint = XdrProtocol<unsigned int>::FIXED_SIZE;
+  static bool EncodeUint(uint8_t *out_bytes, uint32_t *out_len, uint32_t *used,
+                         unsigned int x) {
+    uint32_t len = *out_len - *used;
+    if (!XdrProtocol<unsigned int>::Encode(out_bytes + *used, &len, x)) return false;
+    *used += len;
+    return true;
+  }
+
+  // See Connection::RunCompound() for the layout.
+  size_t Size(WireFormat wire) const {
+    size_t size = kUint;
+    for (auto &op: ops) {
+      size += 4 * kUint;
+      for (auto &piece: op.args)
+        size += kUint + (piece.arg ? piece.arg->Size(wire) : 0);
+    }
+    return size;
+  }
+  bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire,
+              unsigned int returned) const {
+    static constexpr unsigned int kRef = 0x80000000;
+    uint32_t used = 0;
+    if (!EncodeUint(out_bytes, out_len, &used, ops.size()))
+      return false;
+    for (size_t i = 0; i < ops.size(); i++) {
+      auto &op = ops[i];
+      if (!EncodeUint(out_bytes, out_len, &used, op.instance_id)
+          || !EncodeUint(out_bytes, out_len, &used, op.func_id)
+          || !EncodeUint(out_bytes, out_len, &used, i == returned ? 1 : 0)
+          || !EncodeUint(out_bytes, out_len, &used, op.args.size()))
+        return false;
+      for (auto &piece: op.args) {
+        if (!piece.arg) {
+          if (!EncodeUint(out_bytes, out_len, &used, kRef | piece.ref))
+            return false;
+          continue;
+        }
+        // The length goes first, once it is known.
+        uint32_t len = *out_len - used;
+        if (len < kUint) return false;
+        len -= kUint;
+        if (!piece.arg->Encode(out_bytes + used + kUint, &len, wire))
+          return false;
+        if (!EncodeUint(out_bytes, out_len, &used, len))
+          return false;
+        used += len;
+      }
+    }
+    *out_len = used;
+    return true;
+  }
+ public:
+  // Adds a call to func, each argument of which is either a value or a Ref
+  // of the same type, and returns a Ref of its result.
+  template <typename Svc, typename RT, typename ...FA, typename ...A>
+  Ref<RT> Add(Svc *svc, RT (Svc::*func)(FA...), const A &...args) {
+    static_assert(sizeof...(FA) == sizeof...(A), "Wrong number of arguments");
+    Op op{svc->instance_id(),
+          svc->LookupExportFunction(MemberFunctionPtr::From(func)), {}};
+    (op.args.push_back(MakePiece<typename std::decay<FA>::type>(args)), ...);
+    ops.push_back(std::move(op));
+    return Ref<RT>(ops.size() - 1);
+  }
+  size_t size() const { return ops.size(); }
+};
+
+// A Compound as the arguments of a call, answered with the result of its
+// operation returned.
+class CompoundParam : public BaseParams {
+  const Compound &compound;
+  unsigned int returned;
+ public:
+  CompoundParam(const Compound &compound, unsigned int returned)
+      : compound(compound), returned(returned) {}
+
+  size_t Size(WireFormat wire, size_t *gathered = nullptr) const override {
+    if (gathered)
+      *gathered = 0;
+    return compound.Size(wire);
+  }
+  bool Encode(uint8_t *out_bytes, uint32_t *out_len, WireFormat wire,
+              std::vector<GatherSlice> *gather = nullptr) const override {
+    return compound.Encode(out_bytes, out_len, wire, returned);
+  }
+};
+
+// TASK2: Server-side
+
+// What a streaming handler returns: a generator that sets *item to the next
+// item, or returns false after the last one. The server calls it only when
+// the connection has room for another reply, long after the handler has
+// returned, so it must own what it reads. Arguments that view the request
+// (std::string_view, Span) are gone by then.
+template <typename T>
+class Stream {
+ public:
+  template <typename F>
+  Stream(F next) : next(std::move(next)) {}
+  bool operator()(T *item) { return next(item); }
+
+  // What the connection keeps of it.
+  template <template <typename> class P>
+  class Items : public BaseStream {
+    Stream s;
+   public:
+    Items(Stream s) : s(std::move(s)) {}
+    bool Next(uint8_t *out_bytes, uint32_t *out_len, bool *ok) override {
+      T item;
+      if (!s(&item)) return false;
+      size_t size = P<T>::Size(item);
+      if (*out_len < size) {
+        *ok = false;
+        return false;
+      }
+      *out_len = size;
+      return P<T>::Encode(out_bytes, out_len, item);
+    }
+  };
+ private:
+  std::function<bool (T *item)> next;
+};
+
+// Where a Session's handlers put the items they send back.
+template <typename T>
+class StreamWriter {
+  template <typename In, typename Out> friend class Session;
+  std::deque<T> items;
+ public:
+  void Write(T item) { items.push_back(std::move(item)); }
+};
+
+// What the handler of a client or bidirectional stream returns. The server
+// calls on_item for each item the client sends, in order, and on_end after
+// the last one. Both may send items back with out->Write(), which go out
+// before the server takes the client's next chunk. A client stream that
+// just wants to return a result sends it from on_end. Like with Stream,
+// the functions run after the handler has returned.
+template <typename In, typename Out>
+class Session {
+ public:
+  using Writer = StreamWriter<Out>;
+
+  template <typename F, typename G = std::nullptr_t>
+  Session(F on_item, G on_end = nullptr)
+      : on_item(std::move(on_item)), on_end(std::move(on_end)) {}
+
+  template <template <typename> class P>
+  class Items : public BaseStream {
+    Session s;
+    Writer out;
+   public:
+    Items(Session s) : s(std::move(s)) {}
+    bool Next(uint8_t *out_bytes, uint32_t *out_len, bool *ok) override {
+      if (out.items.empty()) return false;
+      auto &item = out.items.front();
+      size_t size = P<Out>::Size(item);
+      if (*out_len < size) {
+        *ok = false;
+        return false;
+      }
+      *out_len = size;
+      if (!P<Out>::Encode(out_bytes, out_len, item)) return false;
+      out.items.pop_front();
+      return true;
+    }
+    bool takes_input() const override { return true; }
+    bool Feed(uint8_t *in_bytes, uint32_t *in_len, bool *ok) override {
+      In item;
+      if (!ArgPack<P, In>::Decode(in_bytes, in_len, ok, item) || !*ok)
+        return false;
+      s.on_item(std::move(item), &out);
+      return true;
+    }
+    void EndInput() override {
+      if (s.on_end) s.on_end(&out);
+    }
+  };
+ private:
+  std::function<void (In item, Writer *out)> on_item;
+  std::function<void (Writer *out)> on_end;
+};
+
+// Results of a batch call, kept by the connection until they are sent. Each
+// reply carries as many as fit: their number, as an XDR unsigned int, then
+// the results.
+template <template <typename> class P, typename R>
+class BatchReply : public BaseStream {
+  std::unique_ptr<R[]> results;
+  size_t n;
+  size_t next = 0;
+ public:
+  BatchReply(std::unique_ptr<R[]> results, size_t n)
+      : results(std::move(results)), n(n) {}
+  bool Next(uint8_t *out_bytes, uint32_t *out_len, bool *ok) override {
+    if (next == n) return false;
+    uint32_t used = XdrProtocol<unsigned int>::FIXED_SIZE;
+    unsigned int count = 0;
+    for (; next + count < n; count++) {
+      auto &r = results[next + count];
+      uint32_t len = P<R>::Size(r);
+      if (len > *out_len - used || !P<R>::Encode(out_bytes + used, &len, r))
+        break;
+      used += len;
+    }
+    if (count == 0) {
+      *ok = false; // a single result doesn't fit
+      return false;
+    }
+    uint32_t len = used;
+    XdrProtocol<unsigned int>::Encode(out_bytes, &len, count);
+    next += count;
+    *out_len = used;
+    return true;
+  }
+};
+
+// Calls returning nothing are answered by the end of the batch alone.
+template <template <typename> class P>
+class BatchReply<P, void> : public BaseStream {
+ public:
+  BatchReply(std::unique_ptr<std::nullptr_t[]> results, size_t n) {}
+  bool Next(uint8_t *out_bytes, uint32_t *out_len, bool *ok) override { return false; }
+};
+
+// Decodes the arguments of R (Svc::*)(Args...) from the request, calls it on
+// the service instance and encodes what it returns. Decoded arguments are
+// moved into by-value parameters. Handlers that take std::string_view or
+// Span<const uint8_t> read straight from the connection's input buffer and
+// don't copy at all.
+template <typename Svc, typename Signature>
+class Procedure;
+
+template <typename Svc, typename R, typename ...Args>
+class Procedure<Svc, R(Args...)> : public BaseProcedure {
+ public:
+  // What a batch handler of the method takes: the arguments of every call
+  // in the batch and, unless R is void, room for as many results.
+  using BatchArg = typename BatchArgOf<typename std::decay<Args>::type...>::type;
+  using BatchFunctionPointerType = typename std::conditional<
+      std::is_void<R>::value, void (Svc::*)(Span<const BatchArg>),
+      void (Svc::*)(Span<const BatchArg>, Span<R>)>::type;
+ private:
+  using FunctionPointerType = R (Svc::*)(Args...);
+  using ArgTuple = std::tuple<typename std::decay<Args>::type...>;
+  using Indices = typename MakeIndexSequence<sizeof...(Args)>::type;
+
+  template <template <typename> class P, size_t ...I>
+  static bool DecodeArgs(WireTag<P>, IndexSequence<I...>, uint8_t *in_bytes,
+                         uint32_t *in_len, bool *ok, ArgTuple &args) {
+    return ArgPack<P, typename std::decay<Args>::type...>::Decode(
+        in_bytes, in_len, ok, std::get<I>(args)...);
+  }
+
+  template <template <typename> class P, size_t ...I>
+  bool Execute(WireTag<P>, std::false_type, IndexSequence<I...>, ArgTuple &args,
+               uint8_t *out_bytes, uint32_t *out_len) {
+    auto p = func_ptr.To<FunctionPointerType>();
+    R r = (((Svc *) instance)->*p)(std::move(std::get<I>(args))...);
+    size_t size = P<R>::Size(r);
+    if (*out_len < size) return false;
+    *out_len = size;
+    return P<R>::Encode(out_bytes, out_len, r);
+  }
+  template <template <typename> class P, size_t ...I>
+  bool Execute(WireTag<P>, std::true_type, IndexSequence<I...>, ArgTuple &args,
+               uint8_t *out_bytes, uint32_t *out_len) {
+    auto p = func_ptr.To<FunctionPointerType>();
+    (((Svc *) instance)->*p)(std::move(std::get<I>(args))...);
+    *out_len = 0;
+    return true;
+  }
+
+  // Where results go: nowhere if R is void.
+  using Slot = typename std::conditional<std::is_void<R>::value, std::nullptr_t, R>::type;
+
+  // A batch's arguments are decoded into batch_args, which is kept for the
+  // next batch, so that string arguments keep their allocations. Coalesced
+  // calls queue theirs in queued_args, and their results go in
+  // queued_results. Both only grow, at most to kMaxBatchCalls.
+  std::unique_ptr<BatchArg[]> batch_args;
+  size_t batch_capacity = 0;
+  std::unique_ptr<BatchArg[]> queued_args;
+  std::unique_ptr<Slot[]> queued_results;
+  size_t queued_capacity = 0;
+
+  // Runs the n calls with arguments args, with the batch handler if there is
+  // one.
+  void RunCalls(std::false_type, BatchArg *args, size_t n, Slot *results) {
+    auto svc = (Svc *) instance;
+    if (batches) {
+      auto batch = batch_func_ptr.To<BatchFunctionPointerType>();
+      (svc->*batch)(Span<const BatchArg>(args, n), Span<R>(results, n));
+      return;
+    }
+    auto p = func_ptr.To<FunctionPointerType>();
+    for (size_t i = 0; i < n; i++) {
+      results[i] = BatchArgOf<typename std::decay<Args>::type...>::Apply(
+          [&](auto &&...x) { return (svc->*p)(std::move(x)...); }, args[i]);
+    }
+  }
+  void RunCalls(std::true_type, BatchArg *args, size_t n, Slot *results) {
+    auto svc = (Svc *) instance;
+    if (batches) {
+      auto batch = batch_func_ptr.To<BatchFunctionPointerType>();
+      (svc->*batch)(Span<const BatchArg>(args, n));
+      return;
+    }
+    auto p = func_ptr.To<FunctionPointerType>();
+    for (size_t i = 0; i < n; i++) {
+      BatchArgOf<typename std::decay<Args>::type...>::Apply(
+          [&](auto &&...x) { (svc->*p)(std::move(x)...); }, args[i]);
+    }
+  }
+
+  template <template <typename> class P>
+  static bool DecodeArg(WireTag<P>, uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                        BatchArg &x) {
+    return ArgPack<P, BatchArg>::Decode(in_bytes, in_len, ok, x);
+  }
+
+  template <template <typename> class P>
+  BaseStream *RunBatch(WireTag<P> wire, uint8_t *in_bytes, uint32_t *in_len, bool *ok) {
+    unsigned int n;
+    uint32_t used = *in_len;
+    if (!XdrProtocol<unsigned int>::Decode(in_bytes, &used, ok, n) || !*ok)
+      return nullptr;
+    if (n > BaseService::kMaxBatchCalls) {
+      *ok = false;
+      return nullptr;
+    }
+    if (n > batch_capacity) {
+      batch_args.reset(new BatchArg[n]);
+      batch_capacity = n;
+    }
+    for (size_t i = 0; i < n; i++) {
+      uint32_t len = *in_len - used;
+      if (!DecodeArg(wire, in_bytes + used, &len, ok, batch_args[i]) || !*ok)
+        return nullptr;
+      used += len;
+    }
+    *in_len = used;
+    std::unique_ptr<Slot[]> results(new Slot[n]);
+    RunCalls(std::is_void<R>(), batch_args.get(), n, results.get());
+    return new BatchReply<P, R>(std::move(results), n);
+  }
+
+  template <template <typename> class P>
+  bool EncodeResult(WireTag<P>, std::false_type, const Slot &r,
+                    uint8_t *out_bytes, uint32_t *out_len) {
+    size_t size = P<R>::Size(r);
+    if (*out_len < size) return false;
+    *out_len = size;
+    return P<R>::Encode(out_bytes, out_len, r);
+  }
+  template <template <typename> class P>
+  bool EncodeResult(WireTag<P>, std::true_type, const Slot &r,
+                    uint8_t *out_bytes, uint32_t *out_len) {
+    *out_len = 0;
+    return true;
+  }
+
+  template <template <typename> class P>
+  bool Run(WireTag<P> wire, uint8_t *in_bytes, uint32_t *in_len,
+           uint8_t *out_bytes, uint32_t *out_len, bool *ok) {
+    ArgTuple args;
+    // This function is similar to Decode. We need to return false if buffer
+    // isn't large enough, or fatal error happens during parsing.
+    if (!DecodeArgs(wire, Indices(), in_bytes, in_len, ok, args) || !*ok) {
+      return false;
+    }
+    if (!Execute(wire, std::is_void<R>(), Indices(), args, out_bytes, out_len)) {
+      // out_len should always be large enough so this branch shouldn't be
+      // taken. However just in case, we return an fatal error by setting *ok
+      // to false.
+      *ok = false;
+      return false;
+    }
+    return true;
+  }
+
+ protected:
+  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
+                        uint8_t *out_bytes, uint32_t *out_len,
+                        bool *ok, WireFormat wire) override {
+    return WithWireFormat(wire, [&](auto tag) {
+      return Run(tag, in_bytes, in_len, out_bytes, out_len, ok);
+    });
+  }
+  BaseStream *DecodeAndRunBatch(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                                WireFormat wire) override {
+    return WithWireFormat(wire, [&](auto tag) {
+      return RunBatch(tag, in_bytes, in_len, ok);
+    });
+  }
+  bool DecodeQueued(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                    WireFormat wire) override {
+    if (nr_queued == queued_capacity) {
+      auto capacity = std::min<size_t>(std::max<size_t>(2 * queued_capacity, 16),
+                                       BaseService::kMaxBatchCalls);
+      std::unique_ptr<BatchArg[]> args(new BatchArg[capacity]);
+      std::move(queued_args.get(), queued_args.get() + nr_queued, args.get());
+      queued_args = std::move(args);
+      queued_results.reset(new Slot[capacity]);
+      queued_capacity = capacity;
+    }
+    return WithWireFormat(wire, [&](auto tag) {
+      return DecodeArg(tag, in_bytes, in_len, ok, queued_args[nr_queued]) && *ok;
+    });
+  }
+  void RunQueued() override {
+    RunCalls(std::is_void<R>(), queued_args.get(), nr_queued, queued_results.get());
+    nr_queued = 0;
+  }
+  bool EncodeQueued(size_t i, uint8_t *out_bytes, uint32_t *out_len,
+                    WireFormat wire) override {
+    return WithWireFormat(wire, [&](auto tag) {
+      return EncodeResult(tag, std::is_void<R>(), queued_results[i], out_bytes, out_len);
+    });
+  }
+};
+
+// Handlers returning a Stream or a Session are called the same way, but
+// what they return is kept by the connection, which encodes one item per
+// reply and, for a Session, feeds it the items the client sends.
+template <typename Svc, typename R, typename ...Args>
+class StreamProcedure : public BaseProcedure {
+  using FunctionPointerType = R (Svc::*)(Args...);
+  using ArgTuple = std::tuple<typename std::decay<Args>::type...>;
+  using Indices = typename MakeIndexSequence<sizeof...(Args)>::type;
+
+  template <template <typename> class P, size_t ...I>
+  BaseStream *Open(WireTag<P> wire, IndexSequence<I...>, uint8_t *in_bytes,
+                   uint32_t *in_len, bool *ok) {
+    ArgTuple args;
+    if (!ArgPack<P, typename std::decay<Args>::type...>::Decode(
+            in_bytes, in_len, ok, std::get<I>(args)...) || !*ok) {
+      return nullptr;
+    }
+    auto p = this->func_ptr.template To<FunctionPointerType>();
+    return new typename R::template Items<P>(
+        (((Svc *) this->instance)->*p)(std::move(std::get<I>(args))...));
+  }
+
+ public:
+  StreamProcedure() { this->streams = true; }
+
+ protected:
+  // Never called: the connection opens streams with DecodeAndOpen().
+  bool DecodeAndExecute(uint8_t *in_bytes, uint32_t *in_len,
+                        uint8_t *out_bytes, uint32_t *out_len,
+                        bool *ok, WireFormat wire) override {
+    *ok = false;
+    return false;
+  }
+  BaseStream *DecodeAndOpen(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                            WireFormat wire) override {
+    return WithWireFormat(wire, [&](auto tag) {
+      return Open(tag, Indices(), in_bytes, in_len, ok);
+    });
+  }
+};
+
+template <typename Svc, typename T, typename ...Args>
+class Procedure<Svc, Stream<T>(Args...)>
+    : public StreamProcedure<Svc, Stream<T>, Args...> {};
+
+template <typename Svc, typename In, typename Out, typename ...Args>
+class Procedure<Svc, Session<In, Out>(Args...)>
+    : public StreamProcedure<Svc, Session<In, Out>, Args...> {};
+
+// TASK2: Client-side
 /*
 class IntResult : public BaseResult {
   int r;
@@ -730,103 +2429,225 @@ std::string r;
 template<typename T>
 class Result : public BaseResult{
   T r;
-public:
-bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok) override final {
-    return Protocol<T>::Decode(in_bytes, in_len, ok, r);
+
+  template <template <typename> class P>
+  static bool Decode(WireTag<P>, uint8_t *in_bytes, uint32_t *in_len, bool *ok, T &x) {
+    return P<T>::Decode(in_bytes, in_len, ok, x);
   }
+public:
+bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                    WireFormat wire) override final {
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, r);
+    });
+  }
+  static bool Discard(uint8_t *in_bytes, uint32_t *in_len, bool *ok, WireFormat wire) {
+    T unused;
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, unused);
+    });
+  }
+  DiscardFn discard_fn() const override final { return &Discard; }
   T &data() { return r; }
 };
 
 template<> class Result<void>:public BaseResult{
   public:
-  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok) override final {
+  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                      WireFormat wire) override final {
+    return Discard(in_bytes, in_len, ok, wire);
+  }
+  static bool Discard(uint8_t *in_bytes, uint32_t *in_len, bool *ok, WireFormat wire) {
     *in_len = 0;
     *ok = true;
     return true;
   }
+  DiscardFn discard_fn() const override final { return &Discard; }
 };
 
-// TASK2: Client-side
-class Client : public BaseClient {
+// Results of a batch call, in the order of the calls. They come back in
+// pieces, but data() only holds all of them once Flush() has answered it.
+template <typename T>
+class BatchResult : public BaseResult {
+  std::vector<T> r;
+
+  template <template <typename> class P>
+  static bool Decode(WireTag<P>, uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                     std::vector<T> *out) {
+    unsigned int count;
+    uint32_t used = *in_len;
+    if (!XdrProtocol<unsigned int>::Decode(in_bytes, &used, ok, count) || !*ok)
+      return false;
+    size_t old_size = out->size();
+    out->resize(old_size + count);
+    for (size_t i = old_size; i < out->size(); i++) {
+      uint32_t len = *in_len - used;
+      T x;
+      if (!P<T>::Decode(in_bytes + used, &len, ok, x) || !*ok) {
+        out->resize(old_size); // parsed again once all of it is here
+        return false;
+      }
+      (*out)[i] = std::move(x);
+      used += len;
+    }
+    *in_len = used;
+    return true;
+  }
  public:
-  template <typename Svc>
-  Result<int> *Call(Svc *svc, int (Svc::*func)(int), int x) {
-    // Lookup instance and function IDs.
-    int instance_id = svc->instance_id();
-    int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                      WireFormat wire) override final {
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, &r);
+    });
+  }
+  static bool Discard(uint8_t *in_bytes, uint32_t *in_len, bool *ok, WireFormat wire) {
+    std::vector<T> unused;
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, &unused);
+    });
+  }
+  DiscardFn discard_fn() const override final { return &Discard; }
+  std::vector<T> &data() { return r; }
+};
+
+// A batch of calls returning nothing is only answered once, when it ends.
+template <> class BatchResult<void> : public BaseResult {
+ public:
+  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                      WireFormat wire) override final {
+    return Discard(in_bytes, in_len, ok, wire);
+  }
+  static bool Discard(uint8_t *in_bytes, uint32_t *in_len, bool *ok, WireFormat wire) {
+    *ok = false; // never has results
+    return false;
+  }
+  DiscardFn discard_fn() const override final { return &Discard; }
+};
 
-    // This incomplete solution only works for this type of member functions.
-    // So the result must be an integer.
-    auto result = new Result<int>();
+// Result of a call to a streaming handler. Items are read off the connection
+// as they are asked for, with Next() or by iterating, and data() holds the
+// current one. A stream left unfinished is closed when another call is sent
+// or the result goes away.
+template <typename T>
+class StreamResult : public BaseStreamResult {
+  T item;
 
-    // We also send the paramters of the functions. For this incomplete
-    // solution, it must be one integer.
-    if (!Send(instance_id, func_id, new IntParam(x), result)) {
-      // Fail to send, then delete the result and return nullptr.
-      delete result;
-      return nullptr;
+  template <template <typename> class P>
+  static bool Decode(WireTag<P>, uint8_t *in_bytes, uint32_t *in_len, bool *ok, T &x) {
+    return P<T>::Decode(in_bytes, in_len, ok, x);
+  }
+ protected:
+  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                      WireFormat wire) override final {
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, item);
+    });
+  }
+ public:
+  class iterator {
+    StreamResult *s;
+   public:
+    explicit iterator(StreamResult *s) : s(s && s->Next() ? s : nullptr) {}
+    T &operator*() const { return s->item; }
+    T *operator->() const { return &s->item; }
+    iterator &operator++() {
+      if (!s->Next()) s = nullptr;
+      return *this;
     }
-    return result;
+    bool operator==(const iterator &rhs) const { return s == rhs.s; }
+    bool operator!=(const iterator &rhs) const { return s != rhs.s; }
+  };
+
+  static bool Discard(uint8_t *in_bytes, uint32_t *in_len, bool *ok, WireFormat wire) {
+    T unused;
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, unused);
+    });
   }
-  /* add this */
+  DiscardFn discard_fn() const override final { return &Discard; }
+  T &data() { return item; }
 
-  template <typename Svc>
-  Result<void> *Call(Svc *svc, void (Svc::*func)()) {
-    // Lookup instance and function IDs.
-    int instance_id = svc->instance_id();
-    int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+  iterator begin() { return iterator(this); }
+  iterator end() { return iterator(nullptr); }
+};
 
-    // This incomplete solution only works for this type of member functions.
-    // So the result must be an integer.
-    auto result = new Result<void>();
-    std::cout << "this is callvoid"<< "\n";
+// Client side of a Session: Write() sends items to it and CloseWrite() ends
+// them, while Next() reads what it sends back. Next() first sends the items
+// Write() holds for the next chunk. Items the server sends while Write()
+// waits for its window are kept until Next() gets to them.
+template <typename In, typename Out>
+class SessionResult : public BaseStreamResult {
+  std::deque<Out> received;
+  Out item;
 
-    // We also send the paramters of the functions. For this incomplete
-    // solution, it must be one integer.
-    if (!Send(instance_id, func_id, new Param<void>(), result)) {
-      // Fail to send, then delete the result and return nullptr.
-      delete result;
-      return nullptr;
-    }
-    return result;
+  template <template <typename> class P>
+  static bool Decode(WireTag<P>, uint8_t *in_bytes, uint32_t *in_len, bool *ok, Out &x) {
+    return P<Out>::Decode(in_bytes, in_len, ok, x);
   }
-  /* add this */
-  template <typename Svc>
-  Result<bool> *Call(Svc *svc, bool (Svc::*func)()) {
-    // Lookup instance and function IDs.
-    int instance_id = svc->instance_id();
-    int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+ protected:
+  bool HandleResponse(uint8_t *in_bytes, uint32_t *in_len, bool *ok,
+                      WireFormat wire) override final {
+    Out x;
+    if (!WithWireFormat(wire, [&](auto tag) {
+          return Decode(tag, in_bytes, in_len, ok, x);
+        }))
+      return false;
+    received.push_back(std::move(x));
+    return true;
+  }
+  bool TakeItem() override {
+    if (received.empty()) return false;
+    item = std::move(received.front());
+    received.pop_front();
+    return true;
+  }
+ public:
+  SessionResult() { queues_items = true; }
 
-    // This incomplete solution only works for this type of member functions.
-    // So the result must be an integer.
-    auto result = new Result<bool>();
-    std::cout << "this is callbool"<< "\n";
+  static bool Discard(uint8_t *in_bytes, uint32_t *in_len, bool *ok, WireFormat wire) {
+    Out unused;
+    return WithWireFormat(wire, [&](auto tag) {
+      return Decode(tag, in_bytes, in_len, ok, unused);
+    });
+  }
+  DiscardFn discard_fn() const override final { return &Discard; }
+  Out &data() { return item; }
 
-    // We also send the paramters of the functions. For this incomplete
-    // solution, it must be one integer.
-    if (!Send(instance_id, func_id, new Param<void>(), result)) {
-      // Fail to send, then delete the result and return nullptr.
-      delete result;
-      return nullptr;
-    }
-    return result;
+  bool Write(const In &x) { return BaseStreamResult::Write(Param<In>(x)); }
+};
+
+// TASK2: Client-side
+class Client : public BaseClient {
+ public:
+  // Hedge an idempotent method against the server given to ConnectHedge().
+  // See HedgePolicy.
+  template <typename Svc, typename MemberFunction>
+  bool EnableHedging(Svc *svc, MemberFunction func, double percentile,
+                     double max_extra_load, uint32_t min_delay_us = 0) {
+    int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+    return SetHedgePolicy(svc->instance_id(), func_id, percentile,
+                          max_extra_load, min_delay_us);
   }
 
- template <typename Svc>
-  Result<std::string> *Call(Svc *svc, std::string (Svc::*func)(std::string), std::string x) {
-    std::cout << "this is call string to string"<< "\n";
-    // Lookup instance and function IDs.
+  // Allocation-free form of Call(). Arguments are encoded straight into the
+  // send buffer and the reply is decoded into the caller's result, which can
+  // be reused once Flush() has answered it.
+  template <typename Svc, typename RT, typename ...FA>
+  bool Call(Result<RT> &result, Svc *svc, RT (Svc::*func)(FA...),
+            const typename NonDeduced<FA>::type &...args) {
     int instance_id = svc->instance_id();
     int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+    return Send(instance_id, func_id,
+                Param<typename std::decay<FA>::type...>(args...), &result);
+  }
 
-    // This incomplete solution only works for this type of member functions.
-    // So the result must be an integer.
-    auto result = new Result<std::string>();
-
-
-    // We also send the paramters of the functions. For this incomplete
-    // solution, it must be one integer.
-    if (!Send(instance_id, func_id, new Param<std::string>(x), result)) {
+  // Same as above, but allocates the result. The caller deletes it once
+  // Flush() has answered it. Returns nullptr if the call can't be sent.
+  template <typename Svc, typename RT, typename ...FA>
+  Result<RT> *Call(Svc *svc, RT (Svc::*func)(FA...),
+                   const typename NonDeduced<FA>::type &...args) {
+    auto result = new Result<RT>();
+    if (!Call(*result, svc, func, args...)) {
       // Fail to send, then delete the result and return nullptr.
       delete result;
       return nullptr;
@@ -834,55 +2655,65 @@ class Client : public BaseClient {
     return result;
   }
 
-template <typename Svc>
-  Result<std::string> *Call(Svc *svc, std::string (Svc::*func)(unsigned int),unsigned int x) {
-    // Lookup instance and function IDs.
+  // Sends a call to a method the server allows one-way calls to (see
+  // Service::AllowOneWay()), which it runs without replying. Use
+  // AckOneWay() to learn they have run. See BaseClient::SendOneWay().
+  template <typename Svc, typename ...FA>
+  bool CallOneWay(Svc *svc, void (Svc::*func)(FA...),
+                  const typename NonDeduced<FA>::type &...args) {
     int instance_id = svc->instance_id();
     int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
-
-    // This incomplete solution only works for this type of member functions.
-    // So the result must be an integer.
-    auto result = new Result<std::string>();
-    std::cout << "this is call int to string"<< "\n";
-
-    // We also send the paramters of the functions. For this incomplete
-    // solution, it must be one integer.
-    if (!Send(instance_id, func_id, new IntParam(x), result)) {
-      // Fail to send, then delete the result and return nullptr.
-      delete result;
-      return nullptr;
-    }
-    return result;
-  }
-template <typename Svc, typename A, typename B, typename C>
-  Result<A> *Call(Svc *svc, A (Svc::*func)(B,C),B ArgOne,C ArgTwo) {
-    // Lookup instance and function IDs.
+    return SendOneWay(instance_id, func_id,
+                      Param<typename std::decay<FA>::type...>(args...));
+  }
+
+  // Sends one call to func per element of args, all in a single frame that
+  // must fit in the send buffer, which the server runs through the method's
+  // batch handler if it has one and one at a time otherwise. args are the
+  // arguments of each call, a std::tuple of them for methods taking more
+  // than one. Once Flush() has answered it, result.data() holds the results.
+  template <typename Svc, typename RT, typename ...FA>
+  bool Call(BatchResult<RT> &result, Svc *svc, RT (Svc::*func)(FA...),
+            Span<const typename BatchArgOf<typename std::decay<FA>::type...>::type> args) {
     int instance_id = svc->instance_id();
     int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+    ClearBatch(result);
+    return SendBatch(instance_id, func_id,
+                     BatchParam<typename std::decay<FA>::type...>(args), &result);
+  }
 
-    // This incomplete solution only works for this type of member functions.
-    // So the result must be an integer.
-    auto result = new Result<A>();
-    std::cout << "variadic 2 variable input"<< "\n";
-
-    // We also send the paramters of the functions. For this incomplete
-    // solution, it must be one integer.
-    if (!Send(instance_id, func_id, new Param<B,C>(ArgOne, ArgTwo), result)) {
-      // Fail to send, then delete the result and return nullptr.
-      delete result;
-      return nullptr;
-    }
-    return result;
+  // Sends the calls of compound as one, answered with the result of result_of.
+  template <typename RT>
+  bool Call(Result<RT> &result, const Compound &compound, Ref<RT> result_of) {
+    if (compound.size() > BaseService::kMaxCompoundOps)
+      return false;
+    return SendCompound(CompoundParam(compound, result_of.op), &result);
   }
 
-  template<typename Svc, typename RT, typename ... FA> 
-  Result<RT> * Call(Svc *svc, RT (Svc::*f)(FA...), ...) {
-    std::cout << "WARNING: Calling " 
-          << typeid(decltype(f)).name()
-          << " is not supported\n";
-    return nullptr;
+  // Opens a stream from a handler returning Stream<T>. See OpenStream().
+  template <typename Svc, typename T, typename ...FA>
+  bool Call(StreamResult<T> &result, Svc *svc, Stream<T> (Svc::*func)(FA...),
+            const typename NonDeduced<FA>::type &...args) {
+    int instance_id = svc->instance_id();
+    int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+    return OpenStream(instance_id, func_id,
+                      Param<typename std::decay<FA>::type...>(args...), &result);
+  }
+  // Same, with a handler returning Session<In, Out>.
+  template <typename Svc, typename In, typename Out, typename ...FA>
+  bool Call(SessionResult<In, Out> &result, Svc *svc,
+            Session<In, Out> (Svc::*func)(FA...),
+            const typename NonDeduced<FA>::type &...args) {
+    int instance_id = svc->instance_id();
+    int func_id = svc->LookupExportFunction(MemberFunctionPtr::From(func));
+    return OpenStream(instance_id, func_id,
+                      Param<typename std::decay<FA>::type...>(args...), &result);
   }
-  /* end here */
+
+ private:
+  template <typename T>
+  static void ClearBatch(BatchResult<T> &result) { result.data().clear(); }
+  static void ClearBatch(BatchResult<void> &result) {}
  // end of class Client
 };
 
@@ -890,54 +2721,37 @@ template <typename Svc, typename A, typename B, typename C>
 template <typename Svc>
 class Service : public BaseService {
  protected:
-  void Export(int (Svc::*func)(int)) {
-    ExportRaw(MemberFunctionPtr::From(func), new IntIntProcedure<Svc>());
+  template <typename R, typename ...Args>
+  void Export(R (Svc::*func)(Args...)) {
+    ExportRaw(MemberFunctionPtr::From(func), new Procedure<Svc, R(Args...)>());
   }
-  void Export(void (Svc::*func)()) {
-	std::cout<<"void to void";
-    ExportRaw(MemberFunctionPtr::From(func), new VoidVoidProcedure<Svc>());
+
+  // Lets batches of calls to f run as a single call to batch, which gets the
+  // arguments of all of them at once (see BatchArgOf) and fills in a result
+  // for each, e.g. with vector instructions. f must be exported first.
+  template <typename R, typename ...Args>
+  void ExportBatch(R (Svc::*f)(Args...),
+                   typename Procedure<Svc, R(Args...)>::BatchFunctionPointerType batch) {
+    SetBatchRaw(MemberFunctionPtr::From(f), MemberFunctionPtr::From(batch));
   }
-  void Export(bool (Svc::*func)()) {
-	std::cout <<"void to bool";
-    ExportRaw(MemberFunctionPtr::From(func), new BoolVoidProcedure<Svc>());
+
+  // Lets clients call f without waiting for, or getting, a reply. f must be
+  // exported first.
+  template <typename ...Args>
+  void AllowOneWay(void (Svc::*f)(Args...)) {
+    SetOneWayRaw(MemberFunctionPtr::From(f));
   }
-void Export(std::string (Svc::*func)(std::string)) {
-	std::cout <<"string string";
-    ExportRaw(MemberFunctionPtr::From(func), new StrStrProcedure<Svc>());
+
+  // Lets clients keep replies of f for lease_ms. f must be exported first.
+  template <typename MemberFunction>
+  void GrantLeases(MemberFunction f, uint32_t lease_ms) {
+    SetLeaseRaw(MemberFunctionPtr::From(f), lease_ms);
   }
-void Export(std::string (Svc::*func)(unsigned int)) {
-	std::cout << "string int" ;
-    ExportRaw(MemberFunctionPtr::From(func), new StrIntProcedure<Svc>());
+  // Calling f revokes every lease handed out on this instance.
+  template <typename MemberFunction>
+  void RevokesLeases(MemberFunction f) {
+    SetRevokesLeasesRaw(MemberFunctionPtr::From(f));
   }
-void Export(std::string (Svc::*func)(std::string,int)) {
-  std::cout << "string int" ;
-  ExportRaw(MemberFunctionPtr::From(func), new StrStrIntProcedure<Svc>());
-}
-void Export(unsigned long (Svc::*func)(int,unsigned int)) {
-  std::cout << "ulong, int uint" ;
-  ExportRaw(MemberFunctionPtr::From(func), new ULongIntUIntProcedure<Svc>());
-}
-void Export(void (Svc::*func)(std::string, std::string)) {
-  std::cout << "ulong, int uint" ;
-  ExportRaw(MemberFunctionPtr::From(func), new VoidStrStrProcedure<Svc>());
-}
-
-
-  /* add this */
-  template<typename MemberFunction>
-  void Export(MemberFunction f) {
-    ExportRaw(MemberFunctionPtr::From(f), new Procedure<Svc, MemberFunction>());
-    std::cout << "WARNING: Exporting " 
-              << typeid(MemberFunction).name()
-              << " is not supported\n";
-  }
-  // void Export(MemberFunction a, Memberfunction b){
-  //   ExportRaw(MemberFunctionPtr::From(a,b), new Procedure<Svc, MemberFunction>());
-  //   std::cout << "WARNING: Exporting " 
-  //             << typeid(MemberFunction).name()
-  //             << " is not supported\n";
-  // }
-  /* end here */
  // end of class Service
 };
 
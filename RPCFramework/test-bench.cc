@@ -0,0 +1,531 @@
+#include "rpcxx.h"
+#include "test-rpc-common.h"
+#include "gtest/gtest.h"
+#include <chrono>
+#include <cstdio>
+
+// Micro benchmarks of the wire encoding. They print the cost per operation
+// and only check that round trips are lossless, so a slow machine doesn't
+// make them fail.
+
+namespace {
+
+constexpr size_t kIterations = 1000000;
+constexpr auto kNative = rpc::WireFormat::kNative;
+
+// Keeps the compiler from dropping work whose result is never read.
+template <typename T>
+inline void Escape(T *p) {
+  asm volatile("" : : "g"(p) : "memory");
+}
+
+template <typename F>
+double NanosPerOp(size_t n, F f) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; i++) f(i);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::nano>(end - start).count() / n;
+}
+
+struct BenchService : public rpc::Service<BenchService> {
+  BenchService() {
+    Export(&BenchService::Sum);
+    Export(&BenchService::Concat);
+    Export(&BenchService::Add);
+  }
+  long Sum(int a, int b, int c, int d, int e, int f, long g, unsigned int h) {
+    return a + b + c + d + e + f + g + h;
+  }
+  int Add(int a, int b) { return a + b; }
+  std::string Concat(std::string a, int times, std::string b) {
+    std::string r;
+    for (int i = 0; i < times; i++) r += a;
+    return r + b;
+  }
+};
+
+// Exposes DecodeAndExecute() so it can be timed without a server.
+template <typename Signature>
+struct BenchProcedure : public rpc::Procedure<BenchService, Signature> {
+  template <typename MemberFunction>
+  BenchProcedure(BenchService *svc, MemberFunction f) {
+    this->instance = svc;
+    this->func_ptr = rpc::MemberFunctionPtr::From(f);
+  }
+  using rpc::Procedure<BenchService, Signature>::DecodeAndExecute;
+};
+
+using FixedArgs =
+    rpc::ArgPack<rpc::Protocol, int, int, int, int, int, int, long, unsigned int>;
+using FixedArgsChecked =
+    rpc::SequentialPack<rpc::Protocol, int, int, int, int, int, int, long, unsigned int>;
+
+TEST(ProtocolBench, TestFixedSizeArgs)
+{
+  static_assert(FixedArgs::FIXED, "all arguments have a fixed size");
+  static_assert(rpc::FixedPack<rpc::Protocol, int, int, int, int, int, int, long,
+                               unsigned int>::SIZE
+                == 6 * sizeof(int) + sizeof(long) + sizeof(unsigned int),
+                "fixed size is the sum of the arguments");
+
+  uint8_t buf[64];
+  uint32_t len = sizeof(buf);
+  ASSERT_TRUE(FixedArgs::Encode(buf, &len, 1, -2, 3, -4, 5, -6, 1L << 40, 0xdeadbeef));
+  ASSERT_EQ(len, 36u);
+
+  int a, b, c, d, e, f;
+  long g;
+  unsigned int h;
+  bool ok = true;
+  len = 35;
+  EXPECT_FALSE(FixedArgs::Decode(buf, &len, &ok, a, b, c, d, e, f, g, h));
+  len = sizeof(buf);
+  ASSERT_TRUE(FixedArgs::Decode(buf, &len, &ok, a, b, c, d, e, f, g, h));
+  EXPECT_EQ(len, 36u);
+  EXPECT_EQ(f, -6);
+  EXPECT_EQ(g, 1L << 40);
+  EXPECT_EQ(h, 0xdeadbeef);
+
+  auto fixed_encode = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t len = sizeof(buf);
+    FixedArgs::Encode(buf, &len, i, 2, 3, 4, 5, 6, 7, 8);
+    Escape(buf);
+  });
+  auto checked_encode = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t len = sizeof(buf);
+    FixedArgsChecked::Encode(buf, &len, i, 2, 3, 4, 5, 6, 7, 8);
+    Escape(buf);
+  });
+  auto fixed_decode = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t len = sizeof(buf);
+    FixedArgs::Decode(buf, &len, &ok, a, b, c, d, e, f, g, h);
+    Escape(&h);
+  });
+  auto checked_decode = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t len = sizeof(buf);
+    FixedArgsChecked::Decode(buf, &len, &ok, a, b, c, d, e, f, g, h);
+    Escape(&h);
+  });
+  printf("8 fixed-size args, one bounds check:  encode %.2f ns, decode %.2f ns\n",
+         fixed_encode, fixed_decode);
+  printf("8 fixed-size args, check per arg:     encode %.2f ns, decode %.2f ns\n",
+         checked_encode, checked_decode);
+}
+
+TEST(ProtocolBench, TestMixedArgs)
+{
+  using MixedArgs = rpc::ArgPack<rpc::Protocol, std::string, int, std::string>;
+  static_assert(!MixedArgs::FIXED, "strings have no fixed size");
+
+  uint8_t buf[128];
+  std::string x("config/key"), y("value-of-some-length");
+  std::string x2, y2;
+  int n;
+  bool ok = true;
+  uint32_t len = sizeof(buf);
+  ASSERT_TRUE(MixedArgs::Encode(buf, &len, x, 42, y));
+  uint32_t encoded = len;
+  ASSERT_TRUE(MixedArgs::Decode(buf, &len, &ok, x2, n, y2));
+  EXPECT_EQ(len, encoded);
+  EXPECT_EQ(x2, x);
+  EXPECT_EQ(n, 42);
+  EXPECT_EQ(y2, y);
+
+  auto encode = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t len = sizeof(buf);
+    MixedArgs::Encode(buf, &len, x, i, y);
+    Escape(buf);
+  });
+  auto decode = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t len = encoded;
+    MixedArgs::Decode(buf, &len, &ok, x2, n, y2);
+    Escape(&y2);
+  });
+  printf("(string, int, string) args:           encode %.2f ns, decode %.2f ns\n",
+         encode, decode);
+}
+
+TEST(ProtocolBench, TestDecodeAndExecute)
+{
+  BenchService svc;
+  BenchProcedure<long (int, int, int, int, int, int, long, unsigned int)>
+      sum(&svc, &BenchService::Sum);
+  BenchProcedure<std::string (std::string, int, std::string)>
+      concat(&svc, &BenchService::Concat);
+
+  uint8_t in[64], out[128];
+  uint32_t in_len = sizeof(in), out_len = sizeof(out);
+  bool ok = true;
+  ASSERT_TRUE(FixedArgs::Encode(in, &in_len, 1, 2, 3, 4, 5, 6, 7, 8));
+  uint32_t sum_len = in_len;
+  ASSERT_TRUE(sum.DecodeAndExecute(in, &in_len, out, &out_len, &ok, kNative));
+  long r;
+  memcpy(&r, out, sizeof(long));
+  EXPECT_EQ(r, 36);
+
+  auto fixed = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t in_len = sum_len, out_len = sizeof(out);
+    sum.DecodeAndExecute(in, &in_len, out, &out_len, &ok, kNative);
+    Escape(out);
+  });
+
+  in_len = sizeof(in);
+  out_len = sizeof(out);
+  ASSERT_TRUE((rpc::ArgPack<rpc::Protocol, std::string, int, std::string>::Encode(
+      in, &in_len, std::string("ab"), 3, std::string("!"))));
+  uint32_t concat_len = in_len;
+  ASSERT_TRUE(concat.DecodeAndExecute(in, &in_len, out, &out_len, &ok, kNative));
+  EXPECT_EQ(out_len, 8u);
+  EXPECT_EQ(std::string((char *) out + 1, 7), "ababab!");
+
+  auto mixed = NanosPerOp(kIterations, [&](size_t i) {
+    uint32_t in_len = concat_len, out_len = sizeof(out);
+    concat.DecodeAndExecute(in, &in_len, out, &out_len, &ok, kNative);
+    Escape(out);
+  });
+  printf("DecodeAndExecute, 8 fixed-size args:  %.2f ns\n", fixed);
+  printf("DecodeAndExecute, (string, int, string): %.2f ns\n", mixed);
+}
+
+TEST(ProtocolBench, TestVectorPaths)
+{
+  using VectorProtocol = rpc::Protocol<std::vector<int>>;
+  using Elements = rpc::ElementsProtocol<int>;
+  static_assert(Elements::RAW, "ints are copied with memcpy");
+  constexpr size_t kElementBudget = 20000000;
+
+  for (size_t n: {10, 1000, 100000, 1000000}) {
+    std::vector<int> x(n), y(n);
+    for (size_t i = 0; i < n; i++) x[i] = i * 2654435761u;
+    uint32_t size = n * sizeof(int);
+    std::vector<uint8_t> buf(sizeof(uint32_t) + size);
+    size_t iterations = kElementBudget / n;
+    bool ok = true;
+
+    uint32_t len = buf.size();
+    ASSERT_TRUE(VectorProtocol::Encode(buf.data(), &len, x));
+    ASSERT_TRUE(VectorProtocol::Decode(buf.data(), &len, &ok, y));
+    ASSERT_EQ(x, y);
+
+    auto memcpy_encode = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Elements::Encode(buf.data(), &len, x.data(), n);
+      Escape(buf.data());
+    });
+    auto each_encode = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Elements::EncodeEach(buf.data(), &len, x.data(), n);
+      Escape(buf.data());
+    });
+    auto memcpy_decode = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Elements::Decode(buf.data(), &len, &ok, y, n);
+      Escape(y.data());
+    });
+    auto each_decode = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Elements::DecodeEach(buf.data(), &len, &ok, y, n);
+      Escape(y.data());
+    });
+    ASSERT_EQ(x, y);
+    printf("vector<int> of %7lu: memcpy encode %10.1f ns decode %10.1f ns, "
+           "element-wise encode %10.1f ns decode %10.1f ns\n",
+           n, memcpy_encode, memcpy_decode, each_encode, each_decode);
+  }
+}
+
+
+template <typename T>
+void XdrArrayBench(const char *name)
+{
+  using Native = rpc::ElementsProtocol<T>;
+  using Xdr = rpc::ElementsProtocol<T, rpc::XdrProtocol>;
+  static_assert(Xdr::PATH == Xdr::kByteSwap, "XDR numbers are byte swapped in bulk");
+  constexpr size_t kElementBudget = 20000000;
+  const char *levels[] = { "scalar", "ssse3", "avx2" };
+
+  for (size_t n: {16, 1000, 100000}) {
+    std::vector<T> x(n), y(n);
+    for (size_t i = 0; i < n; i++) x[i] = (T) (i * 2654435761u);
+    uint32_t size = n * sizeof(T);
+    std::vector<uint8_t> buf(size);
+    size_t iterations = kElementBudget / n;
+    bool ok = true;
+
+    uint32_t len = size;
+    ASSERT_TRUE(Xdr::Encode(buf.data(), &len, x.data(), n));
+    ASSERT_TRUE(Xdr::Decode(buf.data(), &len, &ok, y, n));
+    ASSERT_EQ(x, y);
+    len = size;
+    ASSERT_TRUE(Xdr::EncodeEach(buf.data(), &len, x.data(), n));
+    ASSERT_TRUE(Xdr::DecodeEach(buf.data(), &len, &ok, y, n));
+    ASSERT_EQ(x, y);
+
+    auto native = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Native::Encode(buf.data(), &len, x.data(), n);
+      Escape(buf.data());
+    });
+    printf("%s[%6lu] encode: native memcpy %9.1f ns", name, n, native);
+    for (int level = 0; level <= (int) rpc::DetectSimdLevel(); level++) {
+      auto xdr = NanosPerOp(iterations, [&](size_t i) {
+        if (sizeof(T) == 4)
+          rpc::ByteSwap32(buf.data(), x.data(), n, (rpc::SimdLevel) level);
+        else
+          rpc::ByteSwap64(buf.data(), x.data(), n, (rpc::SimdLevel) level);
+        Escape(buf.data());
+      });
+      printf(", xdr %s %9.1f ns", levels[level], xdr);
+    }
+    auto each = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Xdr::EncodeEach(buf.data(), &len, x.data(), n);
+      Escape(buf.data());
+    });
+    auto decode = NanosPerOp(iterations, [&](size_t i) {
+      uint32_t len = size;
+      Xdr::Decode(buf.data(), &len, &ok, y, n);
+      Escape(y.data());
+    });
+    printf(", xdr element-wise %9.1f ns; xdr decode %9.1f ns\n", each, decode);
+  }
+}
+
+TEST(ProtocolBench, TestXdrArrays)
+{
+  XdrArrayBench<int>("xdr vector<int>   ");
+  XdrArrayBench<double>("xdr vector<double>");
+}
+
+
+template <typename T>
+void CompactArrayBench(const char *name)
+{
+  using Vector = rpc::CompactProtocol<std::vector<T>>;
+  using Compact = rpc::ElementsProtocol<T, rpc::CompactProtocol>;
+  using Native = rpc::ElementsProtocol<T>;
+  static_assert(Compact::PATH == Compact::kVarint, "decoded eight at a time");
+  constexpr size_t kN = 1000;
+  constexpr size_t kIterations = 20000;
+  struct Distribution {
+    const char *name;
+    uint64_t max;
+  };
+
+  for (auto d: { Distribution{"|x| < 64", 64}, Distribution{"|x| < 8192", 8192},
+                 Distribution{"any", ~0ull} }) {
+    std::vector<T> x(kN), y;
+    uint64_t h = 88172645463325252ull;
+    for (size_t i = 0; i < kN; i++) {
+      h ^= h << 13, h ^= h >> 7, h ^= h << 17;
+      x[i] = (T) (d.max == ~0ull ? h : h % d.max);
+      if (std::is_signed<T>::value && i % 2) x[i] = -x[i];
+    }
+    std::vector<uint8_t> buf(kN * rpc::Varint::MAX_SIZE + rpc::VarintLength::MAX_SIZE);
+    bool ok = true;
+    uint32_t len = buf.size();
+    ASSERT_TRUE(Vector::Encode(buf.data(), &len, x));
+    uint32_t encoded = len;
+    ASSERT_TRUE(Vector::Decode(buf.data(), &len, &ok, y));
+    ASSERT_EQ(x, y);
+    uint32_t header = rpc::VarintLength::Size(kN);
+
+    std::vector<uint8_t> out(buf.size());
+    auto native = NanosPerOp(kIterations, [&](size_t i) {
+      uint32_t len = out.size();
+      Native::Encode(out.data(), &len, x.data(), kN);
+      Escape(out.data());
+    });
+    auto encode = NanosPerOp(kIterations, [&](size_t i) {
+      uint32_t len = out.size();
+      Compact::Encode(out.data(), &len, x.data(), kN);
+      Escape(out.data());
+    });
+    std::fill(y.begin(), y.end(), 0);
+    auto decode = NanosPerOp(kIterations, [&](size_t i) {
+      uint32_t len = encoded - header;
+      Compact::Decode(buf.data() + header, &len, &ok, y, kN);
+      Escape(y.data());
+    });
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(x, y);
+    std::fill(y.begin(), y.end(), 0);
+    auto each = NanosPerOp(kIterations, [&](size_t i) {
+      uint32_t len = encoded - header;
+      Compact::DecodeEach(buf.data() + header, &len, &ok, y, kN);
+      Escape(y.data());
+    });
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(x, y);
+    printf("%s %-10s: %5.2f bytes/value (native %lu), encode %5.2f ns/value "
+           "(native %5.2f), decode %5.2f ns/value (one by one %5.2f)\n",
+           name, d.name, (double) (encoded - header) / kN, sizeof(T),
+           encode / kN, native / kN, decode / kN, each / kN);
+  }
+}
+
+TEST(ProtocolBench, TestCompactIntegers)
+{
+  CompactArrayBench<int>("compact vector<int> ");
+  CompactArrayBench<unsigned long>("compact vector<ulong>");
+}
+
+// Compression ratio and CPU time per MB of input, on payloads like our
+// string-heavy traffic and on noise, which doesn't compress.
+TEST(ProtocolBench, TestCompression)
+{
+  constexpr size_t kN = 1 << 20;
+  constexpr size_t kRounds = 20;
+  struct Payload {
+    const char *name;
+    std::vector<uint8_t> data;
+  } payloads[] = { { "Repeat() output", {} }, { "key/value text", {} },
+                   { "noise", {} } };
+  uint64_t x = 88172645463325252ull;
+  for (size_t i = 0; i < kN; i++) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    payloads[0].data.push_back("abc"[i % 3]);
+    payloads[2].data.push_back(x);
+  }
+  for (size_t i = 0; payloads[1].data.size() < kN; i++) {
+    auto kv = "user" + std::to_string(i * 7919 % 100000) + "=" +
+              std::string(i % 13, 'x') + std::to_string(i) + ";";
+    payloads[1].data.insert(payloads[1].data.end(), kv.begin(), kv.end());
+  }
+
+  for (auto &p: payloads) {
+    p.data.resize(kN);
+    std::vector<uint8_t> z(rpc::CompressBlockBound(kN)), y(kN);
+    size_t n = 0;
+    auto compress = NanosPerOp(kRounds, [&](size_t i) {
+      n = rpc::CompressBlock(z.data(), z.size(), p.data.data(), kN);
+      Escape(z.data());
+    });
+    bool ok = true;
+    auto decompress = NanosPerOp(kRounds, [&](size_t i) {
+      ok &= rpc::DecompressBlock(y.data(), kN, z.data(), n);
+      Escape(y.data());
+    });
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(p.data, y);
+    printf("compress %-16s: ratio %6.2f, compress %7.1f us/MB, decompress %7.1f us/MB\n",
+           p.name, (double) kN / n, compress / 1000, decompress / 1000);
+  }
+}
+
+// CRC32C throughput, in software and with SSE4.2.
+TEST(ProtocolBench, TestChecksums)
+{
+  std::vector<uint8_t> data(4096);
+  for (size_t i = 0; i < data.size(); i++) data[i] = i * 37 + 11;
+  for (size_t n: { 64, 4096 }) {
+    for (bool hardware: { false, true }) {
+      uint32_t crc = 0;
+      auto ns = NanosPerOp(kIterations / 10, [&](size_t i) {
+        crc = rpc::Crc32c(crc, data.data(), n, hardware);
+      });
+      Escape(&crc);
+      printf("crc32c %-8s %4lu bytes: %8.1f ns, %5.2f GB/s\n",
+             hardware ? "sse4.2" : "software", n, ns, n / ns);
+    }
+  }
+}
+
+// Calls to a BenchService over loopback. Each benchmark compares two
+// settings in alternating rounds, so that both see the same machine noise,
+// and keeps the best round of each.
+class LoopbackBench : public testing::Test, public ServiceTestUtil {
+ protected:
+  static constexpr size_t kCalls = 20000;
+  static constexpr int kRounds = 10;
+  BenchService stub;
+
+  void SetUp() override {
+    SetUpServer();
+    srv->set_log_enabled(false);
+    srv->AddService(new BenchService(), 1);
+    stub.set_instance_id(1);
+  }
+  void TearDown() override {
+    if (client) TearDownClient();
+    TearDownServer();
+  }
+
+  // Runs round(setting), which times a round in ns per call, for settings 0
+  // and 1 by turns, and keeps the best of each in best.
+  template <typename F>
+  void Alternate(double best[2], F round) {
+    best[0] = best[1] = 1e30;
+    for (int i = 0; i < kRounds; i++) {
+      for (int setting = 0; setting < 2; setting++)
+        best[setting] = std::min(best[setting], round(setting));
+    }
+  }
+};
+
+// What checksums add to a whole call: encode, send, verify, decode, execute
+// and the same way back.
+TEST_F(LoopbackBench, TestChecksums)
+{
+  SetUpClient();
+  client->set_log_enabled(false);
+  std::array<rpc::Result<std::string>, rpc::BaseService::kMaxPipelineRequests> results;
+  std::string a(20, 'a'), b(20, 'b');
+  double best[2];
+  Alternate(best, [&](int checksums) {
+    client->enable_checksums(checksums);
+    auto ns = NanosPerOp(kCalls / results.size(), [&](size_t i) {
+      for (auto &r: results) client->Call(r, &stub, &BenchService::Concat, a, 2, b);
+      client->Flush();
+    }) / results.size();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(results[0].data(), a + a + b);
+    return ns;
+  });
+  printf("pipelined call over loopback: %.0f ns, with checksums %.0f ns (%+.1f%%)\n",
+         best[0], best[1], 100 * (best[1] / best[0] - 1));
+}
+
+TEST_F(LoopbackBench, TestCompactHeaders)
+{
+  // One connection of each kind, switched before timing starts.
+  std::array<rpc::Client, 2> clients;
+  for (int compact = 0; compact < 2; compact++) {
+    auto &client = clients[compact];
+    client.enable_compact_headers(compact);
+    ASSERT_TRUE(client.Connect("127.0.0.1", 3888));
+    client.set_log_enabled(false);
+    for (int i = 0; i < 2; i++) {
+      rpc::Result<int> r;
+      client.Call(r, &stub, &BenchService::Add, 1, 2);
+      client.Flush();
+    }
+    ASSERT_EQ(client.uses_compact_headers(), (bool) compact);
+  }
+
+  std::array<rpc::Result<int>, rpc::BaseService::kMaxPipelineRequests> results;
+  double best[2];
+  double bytes[2];
+  Alternate(best, [&](int compact) {
+    auto &client = clients[compact];
+    auto sent = client.bytes_sent(), received = client.bytes_received();
+    auto ns = NanosPerOp(kCalls / results.size(), [&](size_t i) {
+      for (auto &r: results) client.Call(r, &stub, &BenchService::Add, (int) i, 1);
+      client.Flush();
+    }) / results.size();
+    bytes[compact] = (double) (client.bytes_sent() - sent + client.bytes_received() - received)
+        / (kCalls / results.size() * results.size());
+    EXPECT_EQ(client.has_error(), false);
+    EXPECT_EQ(results[0].data(), (int) (kCalls / results.size()));
+    return ns;
+  });
+  printf("Add(int, int) over loopback, Sun RPC headers: %5.1f bytes/call, %.0f calls/s\n",
+         bytes[0], 1e9 / best[0]);
+  printf("Add(int, int) over loopback, compact headers: %5.1f bytes/call, %.0f calls/s\n",
+         bytes[1], 1e9 / best[1]);
+  EXPECT_LT(bytes[1], bytes[0] / 3);
+}
+
+}
@@ -3,14 +3,36 @@
 #include "gtest/gtest.h"
 #include <sstream>
 #include <map>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
 
 namespace {
 
+struct Point {
+  int x, y;
+  std::string label;
+  RPC_FIELDS(x, y, label)
+};
+
 class ComplexService : public rpc::Service<ComplexService> {
   bool initialized = false;
   std::map<std::string, std::string> m;
 
  public:
+  // Not exported. Lets a test turn this instance into a slow replica.
+  std::atomic<int> get_delay_us{0};
+  std::atomic<int> nr_gets{0};
+  std::atomic<int> nr_counted{0};
+
   ComplexService() {
     Export(&ComplexService::InitializeSomeRandomThing);
     Export(&ComplexService::CheckInitialized);
@@ -19,6 +41,17 @@ class ComplexService : public rpc::Service<ComplexService> {
     Export(&ComplexService::TestSign);
     Export(&ComplexService::Put);
     Export(&ComplexService::Get);
+    Export(&ComplexService::Translate);
+    Export(&ComplexService::Find);
+    Export(&ComplexService::Dump);
+    Export(&ComplexService::Digest);
+    Export(&ComplexService::Scan);
+    Export(&ComplexService::Count);
+    Export(&ComplexService::BulkPut);
+    Export(&ComplexService::Multiples);
+    GrantLeases(&ComplexService::Get, 200);
+    RevokesLeases(&ComplexService::Put);
+    AllowOneWay(&ComplexService::Put);
   }
 
   void InitializeSomeRandomThing() {
@@ -53,7 +86,70 @@ class ComplexService : public rpc::Service<ComplexService> {
     m[key] = value;
   }
 
+  std::optional<std::string> Find(std::string key) {
+    auto it = m.find(key);
+    if (it == m.end()) return std::nullopt;
+    return it->second;
+  }
+
+  std::map<std::string, std::string> Dump() {
+    return m;
+  }
+
+  // FNV-1a over both arguments, so large uploads can be checked.
+  unsigned long Digest(std::string s, std::vector<uint8_t> b) {
+    unsigned long h = 14695981039346656037UL;
+    for (auto c: s) h = (h ^ (uint8_t) c) * 1099511628211UL;
+    for (auto c: b) h = (h ^ c) * 1099511628211UL;
+    return h;
+  }
+
+  // Every pair from key first on, one at a time.
+  rpc::Stream<std::pair<std::string, std::string>> Scan(std::string first) {
+    auto it = m.lower_bound(first);
+    return [this, it](std::pair<std::string, std::string> *kv) mutable {
+      if (it == m.end()) return false;
+      *kv = *it++;
+      return true;
+    };
+  }
+
+  // Never ends.
+  rpc::Stream<int> Count(int from) {
+    return [this, from](int *x) mutable {
+      nr_counted++;
+      *x = from++;
+      return true;
+    };
+  }
+
+  // Puts every pair it is sent, then answers how many.
+  rpc::Session<std::pair<std::string, std::string>, int> BulkPut() {
+    auto n = std::make_shared<int>(0);
+    return {
+      [this, n](std::pair<std::string, std::string> kv, rpc::StreamWriter<int> *) {
+        m[kv.first] = kv.second;
+        ++*n;
+      },
+      [n](rpc::StreamWriter<int> *out) { out->Write(*n); }
+    };
+  }
+
+  // Answers every x it is sent with x, 2x, ..., times * x.
+  rpc::Session<int, int> Multiples(int times) {
+    return [times](int x, rpc::StreamWriter<int> *out) {
+      for (int i = 1; i <= times; i++) out->Write(i * x);
+    };
+  }
+
+  Point Translate(Point p, int dx, int dy) {
+    return Point{p.x + dx, p.y + dy, p.label + "'"};
+  }
+
   std::string Get(std::string key) {
+    nr_gets++;
+    if (get_delay_us > 0)
+      std::this_thread::sleep_for(std::chrono::microseconds(get_delay_us));
     auto it = m.find(key);
     if (it == m.end()) return "";
     return it->second;
@@ -139,4 +235,1228 @@ TEST_F(ComplexServiceTest, TestKVStore)
   delete r4;
 }
 
+TEST_F(ComplexServiceTest, TestWireFormats)
+{
+  for (auto wire: { rpc::WireFormat::kXdr, rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    auto r1 = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 3);
+    auto r2 = client->Call(client_service, &ComplexService::TestSign, -1, (unsigned int) -1);
+    auto r3 = client->Call(client_service, &ComplexService::Put, std::string("K"), std::string("V"));
+    auto r4 = client->Call(client_service, &ComplexService::CheckInitialized);
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r1->data(), "ababab");
+    EXPECT_EQ(r2->data(), 0xffffffff7fffffff);
+    EXPECT_EQ(r3->has_error(), false);
+    EXPECT_EQ(r4->data(), false);
+
+    // Native calls on the same connection still work.
+    client->set_wire_format(rpc::WireFormat::kNative);
+    auto r5 = client->Call(client_service, &ComplexService::Get, std::string("K"));
+    client->Flush();
+    EXPECT_EQ(r5->data(), "V");
+
+    delete r1;
+    delete r2;
+    delete r3;
+    delete r4;
+    delete r5;
+  }
+}
+
+TEST_F(ComplexServiceTest, TestStructs)
+{
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    auto r = client->Call(client_service, &ComplexService::Translate,
+                          Point{1, -2, "p"}, 10, 20);
+    client->Flush();
+    EXPECT_EQ(r->has_error(), false);
+    EXPECT_EQ(r->data().x, 11);
+    EXPECT_EQ(r->data().y, 18);
+    EXPECT_EQ(r->data().label, "p'");
+    delete r;
+  }
+}
+
+TEST_F(ComplexServiceTest, TestDump)
+{
+  std::map<std::string, std::string> expected;
+  std::vector<rpc::Result<void> *> puts;
+  for (int i = 0; i < 8; i++) {
+    auto key = "key" + std::to_string(i);
+    expected[key] = std::string(i, 'v');
+    puts.push_back(client->Call(client_service, &ComplexService::Put, key, expected[key]));
+  }
+  client->Flush();
+  for (auto r: puts) delete r;
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    auto r1 = client->Call(client_service, &ComplexService::Dump);
+    auto r2 = client->Call(client_service, &ComplexService::Find, std::string("key7"));
+    auto r3 = client->Call(client_service, &ComplexService::Find, std::string("nope"));
+    client->Flush();
+    EXPECT_EQ(r1->data(), expected);
+    EXPECT_EQ(r2->data(), std::optional<std::string>("vvvvvvv"));
+    EXPECT_EQ(r3->data(), std::nullopt);
+    delete r1;
+    delete r2;
+    delete r3;
+  }
+}
+
+TEST_F(ComplexServiceTest, TestCompound)
+{
+  for (auto wire: {rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                   rpc::WireFormat::kCompact}) {
+    client->set_wire_format(wire);
+    // Put, read back and repeat what was put, in one round trip.
+    rpc::Compound c;
+    c.Add(client_service, &ComplexService::Put, std::string("K"), std::string("ab"));
+    auto got = c.Add(client_service, &ComplexService::Get, std::string("K"));
+    auto repeated = c.Add(client_service, &ComplexService::Repeat, got, 3);
+    rpc::Result<std::string> r;
+    ASSERT_TRUE(client->Call(r, c, repeated));
+
+    // Results chain into struct arguments, mixed with values, too.
+    rpc::Compound moves;
+    auto p = moves.Add(client_service, &ComplexService::Translate, Point{1, 2, "p"}, 10, 20);
+    p = moves.Add(client_service, &ComplexService::Translate, p, -1, -2);
+    rpc::Result<Point> moved;
+    ASSERT_TRUE(client->Call(moved, moves, p));
+    client->Flush();
+
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r.data(), "ababab");
+    EXPECT_EQ(moved.data().x, 10);
+    EXPECT_EQ(moved.data().y, 20);
+    EXPECT_EQ(moved.data().label, "p''");
+    EXPECT_EQ(server_service->Get("K"), "ab");
+
+    // An earlier result may be the one sent back instead.
+    rpc::Result<std::string> first;
+    ASSERT_TRUE(client->Call(first, c, got));
+    client->Flush();
+    EXPECT_EQ(first.data(), "ab");
+  }
+}
+
+TEST_F(ComplexServiceTest, TestCompoundRejectsStreams)
+{
+  rpc::Compound c;
+  c.Add(client_service, &ComplexService::Count, 1);
+  auto initialized = c.Add(client_service, &ComplexService::CheckInitialized);
+  rpc::Result<bool> r;
+  ASSERT_TRUE(client->Call(r, c, initialized));
+  client->Flush();
+  EXPECT_EQ(r.has_error(), true);
+}
+
+TEST_F(ComplexServiceTest, TestOneWay)
+{
+  // More than a pipeline's worth, and more than fits in the send buffer.
+  for (int i = 0; i < 500; i++)
+    ASSERT_TRUE(client->CallOneWay(client_service, &ComplexService::Put,
+                                   std::string("K"), std::to_string(i)));
+  rpc::Result<std::string> r;
+  rpc::OneWayAck ack;
+  ASSERT_TRUE(client->Call(r, client_service, &ComplexService::Get, std::string("K")));
+  ASSERT_TRUE(client->AckOneWay(&ack));
+  client->Flush();
+  EXPECT_EQ(client->has_error(), false);
+  EXPECT_EQ(r.data(), "499");
+  EXPECT_EQ(ack.nr_calls(), 500u);
+
+  // Acks count from the last one.
+  client->CallOneWay(client_service, &ComplexService::Put, std::string("K"), std::string("x"));
+  ASSERT_TRUE(client->AckOneWay(&ack));
+  client->Flush();
+  EXPECT_EQ(ack.nr_calls(), 1u);
+  EXPECT_EQ(server_service->Get("K"), "x");
+}
+
+TEST_F(ComplexServiceTest, TestOneWayNotAllowed)
+{
+  // Nothing replies to the one-way call, but its failure still shows.
+  client->CallOneWay(client_service, &ComplexService::InitializeSomeRandomThing);
+  rpc::OneWayAck ack;
+  ASSERT_TRUE(client->AckOneWay(&ack));
+  client->Flush();
+  EXPECT_EQ(ack.has_error(), true);
+  EXPECT_EQ(server_service->CheckInitialized(), false);
+}
+
+TEST_F(ComplexServiceTest, TestCompactHeaders)
+{
+  // Without a handshake, the first call is offered them, and the next one
+  // switches.
+  rpc::Client plain;
+  plain.set_log_enabled(false);
+  plain.set_handshake_enabled(false);
+  ASSERT_EQ(plain.Connect("127.0.0.1", 3888), true);
+  auto client = &plain;
+  for (int i = 0; i < 2; i++) {
+    rpc::Result<void> put;
+    client->Call(put, client_service, &ComplexService::Put, std::string("K"), std::string("Wall"));
+    client->Flush();
+    EXPECT_EQ(put.has_error(), false);
+    EXPECT_EQ(client->uses_compact_headers(), i == 1);
+  }
+
+  for (bool checksums: { false, true }) {
+    client->enable_checksums(checksums);
+    auto r1 = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+    auto r2 = client->Call(client_service, &ComplexService::Get, std::string("K"));
+    auto r3 = client->Call(client_service, &ComplexService::Get, std::string("Nothing"));
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r1->data(), "abab");
+    EXPECT_EQ(r2->data(), "Wall");
+    EXPECT_EQ(r3->data(), "");
+    delete r1;
+    delete r2;
+    delete r3;
+
+    // Streams both ways, and one cut short.
+    rpc::SessionResult<std::pair<std::string, std::string>, int> bulk;
+    ASSERT_TRUE(client->Call(bulk, client_service, &ComplexService::BulkPut));
+    for (int i = 0; i < 500; i++)
+      ASSERT_TRUE(bulk.Write({"bulk" + std::to_string(i), std::to_string(i)}));
+    ASSERT_TRUE(bulk.CloseWrite());
+    ASSERT_TRUE(bulk.Next());
+    EXPECT_EQ(bulk.data(), 500);
+    rpc::StreamResult<int> count;
+    ASSERT_TRUE(client->Call(count, client_service, &ComplexService::Count, 5));
+    ASSERT_TRUE(count.Next());
+    EXPECT_EQ(count.data(), 5);
+    auto r4 = client->Call(client_service, &ComplexService::Find, std::string("bulk499"));
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r4->data(), std::optional<std::string>("499"));
+    delete r4;
+  }
+
+  // Failures are still answered.
+  client->CallOneWay(client_service, &ComplexService::InitializeSomeRandomThing);
+  rpc::OneWayAck ack;
+  ASSERT_TRUE(client->AckOneWay(&ack));
+  client->Flush();
+  EXPECT_EQ(ack.has_error(), true);
+}
+
+TEST_F(ComplexServiceTest, TestHandshake)
+{
+  // Connect() has agreed on compact headers before the first call.
+  EXPECT_EQ(client->uses_compact_headers(), true);
+  auto &info = client->server_info();
+  EXPECT_EQ(info.version, rpc::kProtocolVersion);
+  EXPECT_EQ(info.features & rpc::kFeatureCompactHeaders, rpc::kFeatureCompactHeaders);
+  EXPECT_EQ(info.features & rpc::kFeatureWireFormats, rpc::kFeatureWireFormats);
+  EXPECT_EQ(info.features & rpc::kFeatureCompression, 0u);
+  EXPECT_EQ(info.max_request_size, rpc::BaseService::kMaxLargeRequestSize);
+  EXPECT_EQ(info.max_response_size, rpc::BaseService::kMaxResponseSize);
+  auto r = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+  client->Flush();
+  EXPECT_EQ(r->data(), "abab");
+  delete r;
+
+  // So has compression, for a call as early.
+  srv->set_compression(32);
+  rpc::Client compressed;
+  compressed.set_log_enabled(false);
+  compressed.enable_compression(32);
+  ASSERT_EQ(compressed.Connect("127.0.0.1", 3888), true);
+  EXPECT_EQ(compressed.server_info().features & rpc::kFeatureCompression,
+            rpc::kFeatureCompression);
+  std::string value(1000, 'v');
+  auto digest = compressed.Call(client_service, &ComplexService::Digest, value,
+                                std::vector<uint8_t>());
+  compressed.Flush();
+  EXPECT_EQ(digest->data(), server_service->Digest(value, {}));
+  EXPECT_EQ(compressed.compressed_calls(), 1u);
+  delete digest;
+
+  // A client without compact headers keeps Sun RPC's.
+  rpc::Client sun;
+  sun.set_log_enabled(false);
+  sun.enable_compact_headers(false);
+  ASSERT_EQ(sun.Connect("127.0.0.1", 3888), true);
+  EXPECT_EQ(sun.server_info().version, rpc::kProtocolVersion);
+  for (int i = 0; i < 2; i++) {
+    r = sun.Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+    sun.Flush();
+    EXPECT_EQ(r->data(), "abab");
+    delete r;
+  }
+  EXPECT_EQ(sun.uses_compact_headers(), false);
+  EXPECT_EQ(sun.has_error(), false);
+}
+
+TEST_F(ComplexServiceTest, TestLargeArguments)
+{
+  std::string s(3 << 20, 0);
+  std::vector<uint8_t> b(1 << 20);
+  for (size_t i = 0; i < s.size(); i++) s[i] = i * 7 + (i >> 11);
+  for (size_t i = 0; i < b.size(); i++) b[i] = i * 13 + (i >> 9);
+  auto expected = server_service->Digest(s, b);
+
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    // Small calls on both sides of the large ones share the pipeline.
+    auto r1 = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+    auto r2 = client->Call(client_service, &ComplexService::Digest, s, b);
+    auto r3 = client->Call(client_service, &ComplexService::Digest,
+                           std::string(s.size() - 1, 'x'), std::vector<uint8_t>());
+    auto r4 = client->Call(client_service, &ComplexService::Repeat, std::string("cd"), 2);
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r1->data(), "abab");
+    EXPECT_EQ(r2->data(), expected);
+    EXPECT_EQ(r3->data(), server_service->Digest(std::string(s.size() - 1, 'x'), {}));
+    EXPECT_EQ(r4->data(), "cdcd");
+    delete r1;
+    delete r2;
+    delete r3;
+    delete r4;
+  }
+}
+
+TEST_F(ComplexServiceTest, TestStream)
+{
+  std::map<std::string, std::string> expected;
+  rpc::Result<void> put;
+  for (int i = 0; i < 300; i++) {
+    auto key = "key" + std::to_string(i);
+    auto value = std::string(i % 50, 'v');
+    if (key >= "key2") expected[key] = value;
+    client->Call(put, client_service, &ComplexService::Put, key, value);
+    client->Flush();
+  }
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    // Calls before the stream are answered first.
+    auto r1 = client->Call(client_service, &ComplexService::Find, std::string("key7"));
+    rpc::StreamResult<std::pair<std::string, std::string>> scan;
+    ASSERT_TRUE(client->Call(scan, client_service, &ComplexService::Scan, std::string("key2")));
+    EXPECT_EQ(r1->data(), std::optional<std::string>(std::string(7, 'v')));
+    delete r1;
+
+    std::map<std::string, std::string> got;
+    for (auto &kv: scan) got.insert(kv);
+    EXPECT_EQ(scan.has_error(), false);
+    EXPECT_EQ(scan.is_open(), false);
+    EXPECT_EQ(got, expected);
+
+    // And the connection is free again.
+    auto r2 = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+    client->Flush();
+    EXPECT_EQ(r2->data(), "abab");
+    delete r2;
+  }
+  rpc::StreamResult<std::pair<std::string, std::string>> empty;
+  ASSERT_TRUE(client->Call(empty, client_service, &ComplexService::Scan, std::string("z")));
+  EXPECT_EQ(empty.Next(), false);
+  EXPECT_EQ(empty.has_error(), false);
+}
+
+TEST_F(ComplexServiceTest, TestStreamFlowControl)
+{
+  client->set_log_enabled(false);
+  rpc::StreamResult<int> count;
+  ASSERT_TRUE(client->Call(count, client_service, &ComplexService::Count, 5));
+  for (int i = 5; i < 15; i++) {
+    ASSERT_TRUE(count.Next());
+    EXPECT_EQ(count.data(), i);
+  }
+  // The server fills the socket buffers, then waits for us.
+  int produced = 0;
+  for (int i = 0; i < 100; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    if (server_service->nr_counted == produced) break;
+    produced = server_service->nr_counted;
+  }
+  EXPECT_EQ(server_service->nr_counted, produced);
+  EXPECT_LT(produced, 1 << 20);
+  EXPECT_TRUE(count.Next());
+  EXPECT_EQ(count.data(), 15);
+
+  // Another call ends the stream.
+  auto r = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+  EXPECT_EQ(count.is_open(), false);
+  client->Flush();
+  EXPECT_EQ(client->has_error(), false);
+  EXPECT_EQ(r->data(), "abab");
+  EXPECT_EQ(count.Next(), false);
+  delete r;
+}
+
+TEST_F(ComplexServiceTest, TestClientStream)
+{
+  client->set_log_enabled(false);
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    // Far more than the window of chunks.
+    rpc::SessionResult<std::pair<std::string, std::string>, int> bulk;
+    ASSERT_TRUE(client->Call(bulk, client_service, &ComplexService::BulkPut));
+    for (int i = 0; i < 2000; i++) {
+      ASSERT_TRUE(bulk.Write({"bulk" + std::to_string(i), std::to_string(i * i)}));
+    }
+    ASSERT_TRUE(bulk.CloseWrite());
+    EXPECT_FALSE(bulk.Write({"late", "x"}));
+    ASSERT_TRUE(bulk.Next());
+    EXPECT_EQ(bulk.data(), 2000);
+    EXPECT_FALSE(bulk.Next());
+    EXPECT_EQ(bulk.has_error(), false);
+
+    auto r = client->Call(client_service, &ComplexService::Find, std::string("bulk1999"));
+    client->Flush();
+    EXPECT_EQ(r->data(), std::optional<std::string>(std::to_string(1999 * 1999)));
+    delete r;
+  }
+}
+
+TEST_F(ComplexServiceTest, TestBidirectionalStream)
+{
+  client->set_log_enabled(false);
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    // One item at a time: Next() sends what Write() holds.
+    rpc::SessionResult<int, int> session;
+    ASSERT_TRUE(client->Call(session, client_service, &ComplexService::Multiples, 3));
+    for (int x = 1; x <= 20; x++) {
+      ASSERT_TRUE(session.Write(x));
+      for (int i = 1; i <= 3; i++) {
+        ASSERT_TRUE(session.Next());
+        EXPECT_EQ(session.data(), i * x);
+      }
+    }
+    // Then many, with the replies piling up while we write.
+    for (int x = 1; x <= 5000; x++) {
+      ASSERT_TRUE(session.Write(x));
+    }
+    ASSERT_TRUE(session.CloseWrite());
+    int n = 0;
+    while (session.Next()) {
+      EXPECT_EQ(session.data(), (n % 3 + 1) * (n / 3 + 1));
+      n++;
+    }
+    EXPECT_EQ(n, 15000);
+    EXPECT_EQ(session.has_error(), false);
+  }
+
+  // Closing early leaves the connection usable.
+  client->enable_checksums(true);
+  rpc::SessionResult<int, int> session;
+  ASSERT_TRUE(client->Call(session, client_service, &ComplexService::Multiples, 1000));
+  ASSERT_TRUE(session.Write(7));
+  ASSERT_TRUE(session.Next());
+  EXPECT_EQ(session.data(), 7);
+  session.Close();
+  auto r = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+  client->Flush();
+  EXPECT_EQ(client->has_error(), false);
+  EXPECT_EQ(r->data(), "abab");
+  delete r;
+}
+
+class OverloadedComplexServiceTest : public ComplexServiceTest {
+ protected:
+  static constexpr int kNrClients = 4;
+  static constexpr int kDepth = 8;
+  static constexpr int kWarmUpRounds = 50;
+  static constexpr int kSettleRounds = 10;
+  static constexpr int kRounds = 30;
+  static constexpr int kSlowGetUs = 300;
+
+  static uint64_t Now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  // kNrClients closed-loop clients keep kDepth Gets going each. Once every
+  // client is warmed up, Get turns slow. Returns call latencies under the slow
+  // server, from Call() until the reply is ready, in microseconds. The first
+  // kSettleRounds give the limit time to adapt and aren't measured.
+  std::vector<uint64_t> RunLoad(bool limit, std::vector<rpc::Client *> *clients) {
+    std::vector<std::vector<uint64_t>> latencies(kNrClients);
+    std::atomic<int> nr_warm{0};
+    std::atomic<bool> overloaded{false};
+    std::vector<std::thread> threads;
+
+    for (int c = 0; c < kNrClients; c++) {
+      auto cl = new rpc::Client();
+      cl->set_log_enabled(false);
+      EXPECT_EQ(cl->Connect("127.0.0.1", 3888), true);
+      cl->enable_concurrency_limit(limit);
+      clients->push_back(cl);
+
+      threads.emplace_back([&, cl, c]() {
+        rpc::Result<std::string> results[kDepth];
+        uint64_t issued[kDepth];
+        bool seen[kDepth];
+        std::string key("K");
+
+        for (int round = 0; round < kWarmUpRounds + kSettleRounds + kRounds; round++) {
+          if (round == kWarmUpRounds) {
+            nr_warm++;
+            while (!overloaded) std::this_thread::yield();
+          }
+          bool measure = round >= kWarmUpRounds + kSettleRounds;
+          for (int i = 0; i < kDepth; i++) {
+            issued[i] = Now();
+            seen[i] = false;
+            cl->Call(results[i], client_service, &ComplexService::Get, key);
+            // With a limit, Call() may have flushed earlier calls.
+            for (int j = 0; j < i; j++) {
+              if (!seen[j] && results[j].is_ready()) {
+                seen[j] = true;
+                if (measure) latencies[c].push_back(Now() - issued[j]);
+              }
+            }
+          }
+          cl->Flush();
+          for (int j = 0; j < kDepth; j++) {
+            EXPECT_EQ(results[j].data(), "Wall");
+            if (!seen[j] && measure) latencies[c].push_back(Now() - issued[j]);
+          }
+        }
+      });
+    }
+
+    while (nr_warm < kNrClients) std::this_thread::yield();
+    server_service->get_delay_us = kSlowGetUs;
+    overloaded = true;
+    for (auto &t: threads) t.join();
+    server_service->get_delay_us = 0;
+
+    std::vector<uint64_t> all;
+    for (auto &l: latencies) all.insert(all.end(), l.begin(), l.end());
+    std::sort(all.begin(), all.end());
+    return all;
+  }
+
+  static uint64_t Percentile(const std::vector<uint64_t> &sorted, double p) {
+    return sorted[std::min<size_t>(sorted.size() - 1, p * sorted.size())];
+  }
+};
+
+TEST(ConcurrencyLimitTest, TestBacksOffAndRecovers)
+{
+  rpc::ConcurrencyLimit limit;
+  uint64_t now = 0;
+  auto flush = [&](uint64_t latency_us) {
+    for (size_t i = 0; i < limit.limit; i++) limit.Sample(latency_us);
+    limit.Update(limit.limit, false, now += 1000);
+  };
+
+  // An idle server: nothing queued, and the limit is already at its top.
+  for (int i = 0; i < 3; i++) flush(100);
+  EXPECT_EQ(limit.limit, size_t(rpc::ConcurrencyLimit::kMaxLimit));
+  EXPECT_EQ(limit.min_rtt_us, 100u);
+
+  // Calls take four times as long: the limit backs off, one step a flush,
+  // until what it queues is within bounds.
+  for (int i = 0; i < 5; i++) flush(400);
+  EXPECT_EQ(limit.limit, 6u);
+  EXPECT_EQ(limit.nr_decreases, 2u);
+  ASSERT_EQ(limit.history_size(), 2u);
+  EXPECT_EQ(limit.history(0).limit, 7u);
+  EXPECT_EQ(limit.history(0).at_us, 4000u);
+  EXPECT_EQ(limit.history(1).limit, 6u);
+  EXPECT_EQ(limit.history(1).at_us, 5000u);
+
+  // A failure halves it, and an idle server lets it grow back.
+  limit.Update(limit.limit, true, now += 1000);
+  EXPECT_EQ(limit.limit, 3u);
+  for (int i = 0; i < 10; i++) flush(100);
+  EXPECT_EQ(limit.limit, size_t(rpc::ConcurrencyLimit::kMaxLimit));
+  EXPECT_EQ(limit.nr_increases, 5u);
+  EXPECT_EQ(limit.history(limit.history_size() - 1).limit, 8u);
+}
+
+TEST_F(OverloadedComplexServiceTest, TestLimitBacksOff)
+{
+  srv->set_log_enabled(false);
+  client->set_log_enabled(false);
+  auto r = client->Call(client_service, &ComplexService::Put,
+                        std::string("K"), std::string("Wall"));
+  client->Flush();
+  delete r;
+
+  std::vector<rpc::Client *> fixed, adaptive;
+  auto off = RunLoad(false, &fixed);
+  auto on = RunLoad(true, &adaptive);
+  ASSERT_EQ(off.size(), on.size());
+
+  printf("Fixed depth:    p50 %lu us, p90 %lu us, p99 %lu us\n",
+         Percentile(off, 0.5), Percentile(off, 0.9), Percentile(off, 0.99));
+  printf("Adaptive limit: p50 %lu us, p90 %lu us, p99 %lu us\n",
+         Percentile(on, 0.5), Percentile(on, 0.9), Percentile(on, 0.99));
+
+  for (auto cl: adaptive) {
+    auto &limit = cl->concurrency_limit();
+    printf("Limit %lu after %lu flushes (min rtt %lu us, rtt %lu us):",
+           limit.limit, limit.nr_updates, limit.min_rtt_us, limit.rtt_us);
+    for (size_t i = 0; i < limit.history_size(); i++)
+      printf(" %u", limit.history(i).limit);
+    printf("\n");
+    // Latencies depend on the machine, so only the limit is checked: its
+    // first change took it down from the top, and it ended below it.
+    EXPECT_LT(limit.limit, size_t(rpc::ConcurrencyLimit::kMaxLimit));
+    EXPECT_GT(limit.nr_decreases, 0u);
+    ASSERT_GT(limit.history_size(), 0u);
+    EXPECT_LT(limit.history(0).limit, uint32_t(rpc::ConcurrencyLimit::kMaxLimit));
+    for (size_t i = 1; i < limit.history_size(); i++)
+      EXPECT_LE(limit.history(i - 1).at_us, limit.history(i).at_us);
+    EXPECT_EQ(cl->has_error(), false);
+  }
+
+  for (auto cl: fixed) delete cl;
+  for (auto cl: adaptive) delete cl;
+}
+
+TEST_F(ComplexServiceTest, TestCompressionNotNegotiated)
+{
+  // The server has compression off, so nothing gets compressed.
+  client->enable_compression(32);
+  std::string value(1000, 'v');
+  for (int i = 0; i < 2; i++) {
+    auto r1 = client->Call(client_service, &ComplexService::Digest, value,
+                           std::vector<uint8_t>());
+    auto r2 = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 40);
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r1->data(), server_service->Digest(value, {}));
+    EXPECT_EQ(r2->data(), server_service->Repeat("ab", 40));
+    delete r1;
+    delete r2;
+  }
+  EXPECT_EQ(client->compressed_calls(), 0u);
+  EXPECT_EQ(client->compressed_replies(), 0u);
+}
+
+class CompressedComplexServiceTest : public ComplexServiceTest {
+ public:
+  void SetUp() override {
+    ComplexServiceTest::SetUp();
+    srv->set_compression(32);
+    client->enable_compression(32);
+  }
+};
+
+TEST_F(CompressedComplexServiceTest, TestCompression)
+{
+  std::string value;
+  for (int i = 0; i < 100; i++) value += "key" + std::to_string(i % 7) + "=value;";
+  std::vector<uint8_t> bytes(2000, 7);
+
+  // Nothing is compressed until the server has agreed to it.
+  auto r = client->Call(client_service, &ComplexService::Digest, value, bytes);
+  client->Flush();
+  EXPECT_EQ(r->data(), server_service->Digest(value, bytes));
+  EXPECT_EQ(client->compressed_calls(), 0u);
+  delete r;
+
+  uint64_t calls = 0;
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    auto r1 = client->Call(client_service, &ComplexService::Digest, value, bytes);
+    auto r2 = client->Call(client_service, &ComplexService::Repeat, std::string("ab"), 40);
+    auto r3 = client->Call(client_service, &ComplexService::Put, std::string("K"), value);
+    auto r4 = client->Call(client_service, &ComplexService::TestSign, -1, 1u);
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r1->data(), server_service->Digest(value, bytes));
+    EXPECT_EQ(r2->data(), server_service->Repeat("ab", 40));
+    EXPECT_EQ(r3->has_error(), false);
+    EXPECT_EQ(r4->data(), 0xffffffff00000000);
+    delete r1;
+    delete r2;
+    delete r3;
+    delete r4;
+    // Digest and Put, but none of the small calls.
+    calls += 2;
+    EXPECT_EQ(client->compressed_calls(), calls);
+  }
+  EXPECT_EQ(client->compressed_replies(), 3u);
+}
+
+TEST_F(CompressedComplexServiceTest, TestCompressedStream)
+{
+  client->enable_checksums(true);
+  std::map<std::string, std::string> expected;
+  rpc::Result<void> put;
+  for (int i = 0; i < 20; i++) {
+    auto key = "k" + std::to_string(i);
+    expected[key] = std::string(60, 'a' + i % 3);
+    client->Call(put, client_service, &ComplexService::Put, key, expected[key]);
+    client->Flush();
+  }
+  rpc::StreamResult<std::pair<std::string, std::string>> scan;
+  ASSERT_TRUE(client->Call(scan, client_service, &ComplexService::Scan, std::string()));
+  std::map<std::string, std::string> got;
+  while (scan.Next()) got.insert(scan.data());
+  EXPECT_EQ(client->has_error(), false);
+  EXPECT_EQ(got, expected);
+  EXPECT_EQ(client->compressed_replies(), 20u);
+}
+
+TEST_F(ComplexServiceTest, TestChecksums)
+{
+  client->enable_checksums(true);
+  std::string big(1 << 20, 'b');
+  for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                    rpc::WireFormat::kCompact }) {
+    client->set_wire_format(wire);
+    auto r1 = client->Call(client_service, &ComplexService::Put, std::string("K"), std::string("V"));
+    auto r2 = client->Call(client_service, &ComplexService::Find, std::string("K"));
+    auto r3 = client->Call(client_service, &ComplexService::Translate, Point{1, 2, "p"}, 1, 1);
+    auto r4 = client->Call(client_service, &ComplexService::Digest, big, std::vector<uint8_t>());
+    auto r5 = client->Call(client_service, &ComplexService::CheckInitialized);
+    client->Flush();
+    EXPECT_EQ(client->has_error(), false);
+    EXPECT_EQ(r1->has_error(), false);
+    EXPECT_EQ(r2->data(), std::optional<std::string>("V"));
+    EXPECT_EQ(r3->data().label, "p'");
+    EXPECT_EQ(r4->data(), server_service->Digest(big, {}));
+    EXPECT_EQ(r5->data(), false);
+    delete r1;
+    delete r2;
+    delete r3;
+    delete r4;
+    delete r5;
+  }
+}
+
+// Forwards one connection to the test server and flips a bit at a given
+// offset of either stream, like a buggy proxy would.
+class CorruptingProxy {
+  int listen_fd;
+  std::atomic<bool> stop{false};
+  std::thread t;
+ public:
+  static constexpr int kPort = 3889;
+  std::atomic<long> corrupt_up{-1};   // client to server
+  std::atomic<long> corrupt_down{-1}; // server to client
+  // Plays a server from before the handshake, which fails it: it answers
+  // PROG_MISMATCH and closes the connection. Or it just closes it, or never
+  // answers. The connection after it is passed on, and the flags of its
+  // first call, in a Sun RPC header, kept in first_vers.
+  enum Refusal { kAccept, kMismatch, kClose, kSilent };
+  std::atomic<int> refuse_handshake{kAccept};
+  std::atomic<unsigned int> first_vers{~0u};
+  // Resets the connection to the server once stopped, instead of closing it.
+  std::atomic<bool> reset_up{false};
+
+  CorruptingProxy() {
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+    sockaddr_in addr = Address(kPort);
+    bind(listen_fd, (sockaddr *) &addr, sizeof(addr));
+    listen(listen_fd, 1);
+    t = std::thread([this]() { Run(); });
+  }
+  ~CorruptingProxy() {
+    stop = true;
+    t.join();
+    close(listen_fd);
+  }
+
+ private:
+  static sockaddr_in Address(int port) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    return addr;
+  }
+
+  // Reads n bytes from fd unless stopped or the peer closes first.
+  bool ReadAll(int fd, uint8_t *p, size_t n) {
+    for (size_t done = 0; done < n;) {
+      pollfd pfd = { fd, POLLIN, 0 };
+      if (stop) return false;
+      if (poll(&pfd, 1, 10) <= 0) continue;
+      auto r = read(fd, p + done, n - done);
+      if (r <= 0) return false;
+      done += r;
+    }
+    return true;
+  }
+
+  // Refuses the connection on fd if it starts with a handshake. Otherwise
+  // leaves what it read of its first call in head.
+  bool Refuses(int fd, uint8_t *head, size_t n, size_t *head_len) {
+    *head_len = 0;
+    if (refuse_handshake == kAccept || !ReadAll(fd, head, n)) return false;
+    *head_len = n;
+    unsigned int vers, proc;
+    memcpy(&vers, head + 4 * sizeof(unsigned int), sizeof(unsigned int));
+    memcpy(&proc, head + 5 * sizeof(unsigned int), sizeof(unsigned int));
+    if (ntohl(proc) != 0xfffffffa) {
+      first_vers = ntohl(vers);
+      return false;
+    }
+    if (refuse_handshake == kMismatch) {
+      unsigned int reply[8] = { 0, htonl(1), 0, 0, 0, htonl(2), htonl(2), htonl(2) };
+      memcpy(&reply[0], head, sizeof(unsigned int));
+      if (write(fd, reply, sizeof(reply)) != sizeof(reply)) return true;
+    } else if (refuse_handshake == kSilent) {
+      // Until the client gives up.
+      uint8_t rest[8];
+      ReadAll(fd, rest, sizeof(rest));
+      while (!stop && ReadAll(fd, rest, 1)) {}
+    }
+    return true;
+  }
+
+  void Run() {
+    uint8_t head[6 * sizeof(unsigned int)];
+    size_t head_len;
+    int fds[2];
+    do {
+      pollfd pfd = { listen_fd, POLLIN, 0 };
+      while (!stop && poll(&pfd, 1, 10) <= 0) {}
+      if (stop) return;
+      fds[0] = accept(listen_fd, nullptr, nullptr);
+    } while (Refuses(fds[0], head, sizeof(head), &head_len) && close(fds[0]) == 0);
+    if (stop) {
+      close(fds[0]);
+      return;
+    }
+    fds[1] = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = Address(3888);
+    connect(fds[1], (sockaddr *) &addr, sizeof(addr));
+    if (head_len > 0 && write(fds[1], head, head_len) != (ssize_t) head_len) stop = true;
+
+    long pos[2] = { (long) head_len, 0 };
+    std::atomic<long> *corrupt[2] = { &corrupt_up, &corrupt_down };
+    uint8_t buf[4096];
+    while (!stop) {
+      pollfd pfds[2] = { { fds[0], POLLIN, 0 }, { fds[1], POLLIN, 0 } };
+      if (poll(pfds, 2, 10) <= 0) continue;
+      for (int i = 0; i < 2; i++) {
+        if (pfds[i].revents == 0) continue;
+        auto n = read(fds[i], buf, sizeof(buf));
+        if (n <= 0) {
+          stop = true;
+          break;
+        }
+        long at = *corrupt[i];
+        if (at >= pos[i] && at < pos[i] + n) buf[at - pos[i]] ^= 1;
+        pos[i] += n;
+        for (ssize_t done = 0; done < n;) {
+          auto written = write(fds[1 - i], buf + done, n - done);
+          if (written <= 0) break;
+          done += written;
+        }
+      }
+    }
+    if (reset_up) {
+      linger abort = { 1, 0 };
+      setsockopt(fds[1], SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+};
+
+TEST_F(ComplexServiceTest, TestChecksumsCatchCorruption)
+{
+  std::string value(60, 'v');
+  auto put = [&](rpc::Client *cl, std::string key) {
+    auto r = cl->Call(client_service, &ComplexService::Put, key, value);
+    cl->Flush();
+    delete r;
+  };
+  auto find = [&](rpc::Client *cl, std::string key) {
+    auto r = cl->Call(client_service, &ComplexService::Find, key);
+    cl->Flush();
+    auto data = r->data();
+    delete r;
+    return data;
+  };
+
+  for (bool checksums: { false, true }) {
+    auto up = checksums ? "up+crc" : "up";
+    auto down = checksums ? "down+crc" : "down";
+    // A flipped bit inside the value of a Put.
+    {
+      CorruptingProxy proxy;
+      rpc::Client cl;
+      cl.set_handshake_enabled(false);
+      cl.enable_compact_headers(false);
+      cl.Connect("127.0.0.1", CorruptingProxy::kPort);
+      cl.enable_checksums(checksums);
+      proxy.corrupt_up = 70;
+      put(&cl, up);
+      EXPECT_EQ(cl.has_error(), checksums);
+    }
+    auto stored = find(client, up);
+    if (checksums) {
+      EXPECT_EQ(stored, std::nullopt) << "a corrupt call must not run";
+    } else {
+      EXPECT_NE(stored, value) << "without checksums, nothing notices";
+    }
+
+    // And inside the value of a reply.
+    put(client, down);
+    {
+      CorruptingProxy proxy;
+      rpc::Client cl;
+      cl.set_handshake_enabled(false);
+      cl.enable_compact_headers(false);
+      cl.Connect("127.0.0.1", CorruptingProxy::kPort);
+      cl.enable_checksums(checksums);
+      proxy.corrupt_down = 60;
+      auto got = find(&cl, down);
+      EXPECT_EQ(cl.has_error(), checksums);
+      if (!checksums) {
+        EXPECT_NE(got, value);
+      }
+    }
+  }
+  EXPECT_EQ(client->has_error(), false);
+}
+
+TEST_F(ComplexServiceTest, TestHandshakeRefused)
+{
+  // An older server, however it fails the handshake, still gets our calls,
+  // and compact headers are negotiated the old way. Checksums and the wire
+  // format can't be, so the calls go without them.
+  for (auto refusal: { CorruptingProxy::kMismatch, CorruptingProxy::kClose,
+                       CorruptingProxy::kSilent }) {
+    CorruptingProxy proxy;
+    proxy.refuse_handshake = refusal;
+    rpc::Client cl;
+    cl.set_log_enabled(false);
+    cl.enable_checksums(true);
+    cl.set_wire_format(rpc::WireFormat::kXdr);
+    ASSERT_EQ(cl.Connect("127.0.0.1", CorruptingProxy::kPort), true);
+    EXPECT_EQ(cl.server_info().version, 0u);
+    for (int i = 0; i < 2; i++) {
+      auto r = cl.Call(client_service, &ComplexService::Repeat, std::string("ab"), 2);
+      cl.Flush();
+      EXPECT_EQ(r->data(), "abab");
+      delete r;
+    }
+    EXPECT_EQ(cl.uses_compact_headers(), true);
+    EXPECT_EQ(cl.has_error(), false);
+    // Neither checksummed nor in XDR.
+    EXPECT_EQ(proxy.first_vers & 8, 0u);
+    EXPECT_EQ(proxy.first_vers & 0xff00, 0u);
+  }
+}
+
+class LeasedComplexServiceTest : public ComplexServiceTest {
+ public:
+  void SetUp() override {
+    ComplexServiceTest::SetUp();
+    srv->set_log_enabled(false);
+    client->set_log_enabled(false);
+    client->enable_result_cache(16);
+  }
+
+  void Put(rpc::Client *cl, std::string key, std::string value) {
+    auto r = cl->Call(client_service, &ComplexService::Put, key, value);
+    cl->Flush();
+    ASSERT_EQ(cl->has_error(), false);
+    delete r;
+  }
+
+  // Does not flush, so a cached reply is ready right away.
+  std::string Get(std::string key) {
+    auto r = client->Call(client_service, &ComplexService::Get, key);
+    if (!r->is_ready()) client->Flush();
+    EXPECT_EQ(r->has_error(), false);
+    auto data = r->data();
+    delete r;
+    return data;
+  }
+};
+
+TEST_F(LeasedComplexServiceTest, TestCacheHit)
+{
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(server_service->nr_gets, 1);
+
+  for (int i = 0; i < 100; i++) EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(server_service->nr_gets, 1);
+  EXPECT_EQ(client->cache_hits(), 100u);
+
+  // Different arguments are different entries.
+  EXPECT_EQ(Get("Nothing"), "");
+  EXPECT_EQ(server_service->nr_gets, 2);
+  EXPECT_EQ(client->cache_size(), 2u);
+}
+
+TEST_F(LeasedComplexServiceTest, TestOwnWriteRevokes)
+{
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  Put(client, "K", "Door");
+  EXPECT_EQ(client->cache_size(), 0u);
+  EXPECT_EQ(Get("K"), "Door");
+  EXPECT_EQ(server_service->nr_gets, 2);
+}
+
+TEST_F(LeasedComplexServiceTest, TestHeldWriteIsSeen)
+{
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  // The Put is still held, but the Get goes after it, not to the cache.
+  auto r = client->Call(client_service, &ComplexService::Put,
+                        std::string("K"), std::string("Door"));
+  EXPECT_EQ(Get("K"), "Door");
+  EXPECT_EQ(r->has_error(), false);
+  delete r;
+  EXPECT_EQ(server_service->nr_gets, 2);
+  EXPECT_EQ(client->cache_hits(), 0u);
+}
+
+TEST_F(LeasedComplexServiceTest, TestOtherWriteRevokes)
+{
+  rpc::Client other;
+  other.set_log_enabled(false);
+  ASSERT_EQ(other.Connect("127.0.0.1", 3888), true);
+
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  Put(&other, "K", "Door");
+
+  // The revocation reaches us before the next lookup in the cache.
+  EXPECT_EQ(Get("Nothing"), "");
+  EXPECT_EQ(client->cache_size(), 1u);
+  EXPECT_EQ(Get("K"), "Door");
+  EXPECT_EQ(client->has_error(), false);
+}
+
+TEST_F(LeasedComplexServiceTest, TestRevokesWithoutCalls)
+{
+  rpc::Client other;
+  other.set_log_enabled(false);
+  ASSERT_EQ(other.Connect("127.0.0.1", 3888), true);
+
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  Put(&other, "K", "Door");
+  // Nothing but cache hits, yet the revocation isn't missed.
+  EXPECT_EQ(Get("K"), "Door");
+  EXPECT_EQ(server_service->nr_gets, 2);
+  EXPECT_EQ(client->has_error(), false);
+}
+
+TEST_F(LeasedComplexServiceTest, TestRevokesWhilePeerResets)
+{
+  Put(client, "K", "Wall");
+  auto proxy = std::make_unique<CorruptingProxy>();
+  rpc::Client peer;
+  peer.set_log_enabled(false);
+  peer.enable_result_cache(16);
+  ASSERT_EQ(peer.Connect("127.0.0.1", CorruptingProxy::kPort), true);
+  auto r = peer.Call(client_service, &ComplexService::Get, std::string("K"));
+  peer.Flush();
+  EXPECT_EQ(r->data(), "Wall");
+  delete r;
+
+  // While a slow call holds the server, the peer resets and a write revokes
+  // its lease. Both come up in the same batch of events, the write first.
+  rpc::Client slow;
+  slow.set_log_enabled(false);
+  ASSERT_EQ(slow.Connect("127.0.0.1", 3888), true);
+  server_service->get_delay_us = 50000;
+  std::thread stall([&]() {
+    auto r = slow.Call(client_service, &ComplexService::Get, std::string("Slow"));
+    slow.Flush();
+    delete r;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  proxy->reset_up = true;
+  proxy.reset();
+  Put(client, "K", "Door");
+  stall.join();
+  server_service->get_delay_us = 0;
+
+  EXPECT_EQ(Get("K"), "Door");
+  EXPECT_EQ(client->has_error(), false);
+}
+
+TEST_F(LeasedComplexServiceTest, TestRevokesWithCompactHeaders)
+{
+  client->enable_compact_headers(true);
+  Put(client, "K", "Wall");
+  Put(client, "K", "Wall");
+  ASSERT_EQ(client->uses_compact_headers(), true);
+
+  rpc::Client other;
+  other.set_log_enabled(false);
+  ASSERT_EQ(other.Connect("127.0.0.1", 3888), true);
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(server_service->nr_gets, 1);
+  Put(&other, "K", "Door");
+  EXPECT_EQ(Get("Nothing"), "");
+  EXPECT_EQ(Get("K"), "Door");
+  EXPECT_EQ(client->has_error(), false);
+}
+
+TEST_F(LeasedComplexServiceTest, TestLeaseExpires)
+{
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(server_service->nr_gets, 1);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(250));
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(server_service->nr_gets, 2);
+}
+
+TEST_F(LeasedComplexServiceTest, TestCacheOff)
+{
+  client->enable_result_cache(0);
+  Put(client, "K", "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(Get("K"), "Wall");
+  EXPECT_EQ(server_service->nr_gets, 2);
+  EXPECT_EQ(client->cache_hits(), 0u);
+}
+
+class HedgedComplexServiceTest : public ComplexServiceTest {
+ protected:
+  static constexpr int kBackupPort = 3889;
+  rpc::Server *backup_srv;
+  ComplexService *backup_service;
+  std::thread backup_thread;
+ public:
+  void SetUp() override {
+    ComplexServiceTest::SetUp();
+    backup_srv = new rpc::Server();
+    backup_srv->set_log_enabled(false);
+    backup_srv->Listen("127.0.0.1", kBackupPort);
+    backup_service = new ComplexService();
+    backup_srv->AddService(backup_service, kInstanceId);
+    backup_thread = std::thread([this]() { backup_srv->MainLoop(); });
+
+    srv->set_log_enabled(false);
+    client->set_log_enabled(false);
+    ASSERT_EQ(client->ConnectHedge("127.0.0.1", kBackupPort), true);
+  }
+  void TearDown() override {
+    ComplexServiceTest::TearDown();
+    backup_srv->SignalStop();
+    backup_thread.join();
+    delete backup_srv;
+  }
+
+  void PutBoth(std::string key, std::string value) {
+    rpc::Client backup_client;
+    backup_client.set_log_enabled(false);
+    ASSERT_EQ(backup_client.Connect("127.0.0.1", kBackupPort), true);
+    for (auto cl: {client, &backup_client}) {
+      auto r = cl->Call(client_service, &ComplexService::Put, key, value);
+      cl->Flush();
+      ASSERT_EQ(cl->has_error(), false);
+      delete r;
+    }
+  }
+
+  int GetFuncId() {
+    return client_service->LookupExportFunction(
+        rpc::MemberFunctionPtr::From(&ComplexService::Get));
+  }
+
+  // Returns the call latency in microseconds.
+  long TimedGet(std::string key, std::string expect) {
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+    auto r = client->Call(client_service, &ComplexService::Get, key);
+    client->Flush();
+    gettimeofday(&end, nullptr);
+    EXPECT_EQ(r->has_error(), false);
+    EXPECT_EQ(r->data(), expect);
+    delete r;
+    return 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
+  }
+};
+
+TEST_F(HedgedComplexServiceTest, TestSlowPrimary)
+{
+  PutBoth("K", "Wall");
+  ASSERT_EQ(client->EnableHedging(client_service, &ComplexService::Get,
+                                  0.9, 0.5, 1000), true);
+  for (int i = 0; i < 32; i++) TimedGet("K", "Wall");
+
+  auto policy = client->hedge_policy(kInstanceId, GetFuncId());
+  ASSERT_NE(policy, nullptr);
+  EXPECT_EQ(policy->nr_backup_wins, 0u);
+
+  server_service->get_delay_us = 200000;
+  EXPECT_LT(TimedGet("K", "Wall"), 100000);
+  EXPECT_EQ(policy->nr_hedged, 1u);
+  EXPECT_EQ(policy->nr_backup_wins, 1u);
+
+  // The primary's late reply to the hedged call is dropped, not handed to
+  // the next call.
+  server_service->get_delay_us = 0;
+  PutBoth("K", "Door");
+  TimedGet("K", "Door");
+  TimedGet("Nothing", "");
+  EXPECT_EQ(client->has_error(), false);
+}
+
+TEST_F(HedgedComplexServiceTest, TestStuckPrimaryIsDropped)
+{
+  PutBoth("K", "Wall");
+  ASSERT_EQ(client->EnableHedging(client_service, &ComplexService::Get,
+                                  0.5, 1.0, 1000), true);
+  for (int i = 0; i < 32; i++) TimedGet("K", "Wall");
+
+  // Every call is hedged and won by the backup, and the primary falls
+  // further behind with every Flush().
+  server_service->get_delay_us = 20000;
+  for (int round = 0; round < 2; round++) {
+    std::array<rpc::Result<std::string>, rpc::BaseService::kMaxPipelineRequests> results;
+    for (auto &r: results) client->Call(r, client_service, &ComplexService::Get, std::string("K"));
+    client->Flush();
+    for (auto &r: results) EXPECT_EQ(r.data(), "Wall");
+  }
+
+  // Rather than wait for it, the client moved on to the backup.
+  auto r = client->Call(client_service, &ComplexService::Put, std::string("K"), std::string("Door"));
+  client->Flush();
+  delete r;
+  EXPECT_EQ(client->has_error(), false);
+  EXPECT_EQ(backup_service->Get("K"), "Door");
+  server_service->get_delay_us = 0;
+}
+
+TEST_F(HedgedComplexServiceTest, TestHedgeBudget)
+{
+  PutBoth("K", "Wall");
+  ASSERT_EQ(client->EnableHedging(client_service, &ComplexService::Get,
+                                  0.5, 0.1, 1000), true);
+  for (int i = 0; i < 16; i++) TimedGet("K", "Wall");
+
+  // 16 calls at 10% earn 1.6 hedges, so only one of the slow calls below may
+  // be hedged. The other one waits for the primary.
+  server_service->get_delay_us = 20000;
+  long fast = TimedGet("K", "Wall");
+  long slow = TimedGet("K", "Wall");
+  auto policy = client->hedge_policy(kInstanceId, GetFuncId());
+  EXPECT_EQ(policy->nr_hedged, 1u);
+  EXPECT_LT(fast, 20000);
+  EXPECT_GE(slow, 20000);
+}
+
 }
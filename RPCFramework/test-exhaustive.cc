@@ -229,7 +229,7 @@ TEST_F(RandomTest, RandomGeneratedCode)
 
   ASSERT_EQ(
       0,
-      system("g++ -g --std=c++11 -include test-rpc-common.h -include cassert "
+      system("g++ -g --std=c++17 -include test-rpc-common.h -include cassert "
         "-include rpc.cc " GEN_FILE " -fPIC -pthread -shared -o gen.so"))
       << "Your code cannot compile! Check with " GEN_FILE;
 
@@ -18,6 +18,28 @@ protected:
     void TearDown() override {
         delete [] buf;
     }
+
+    // Encodes x under the wire format of tag, decodes it back, and checks
+    // that Size predicted the encoding and every truncation of it is
+    // rejected.
+    template <template <typename> class P, typename T>
+    bool Roundtrip(rpc::WireTag<P>, const T &x) {
+        T y;
+        len = 256;
+        ok = true;
+        EXPECT_EQ(true, P<T>::Encode(buf, &len, x));
+        uint32_t encoded = len;
+        EXPECT_EQ(P<T>::Size(x), encoded);
+        EXPECT_EQ(true, P<T>::Decode(buf, &len, &ok, y));
+        EXPECT_EQ(ok, true);
+        EXPECT_EQ(len, encoded);
+        EXPECT_EQ(x, y);
+        for (uint32_t cut = 0; cut < encoded; cut++) {
+            len = cut;
+            EXPECT_EQ(false, P<T>::Decode(buf, &len, &ok, y)) << cut;
+        }
+        return true;
+    }
 };
 
 TEST_F(ProtocolTest, UnalignedTest)
@@ -123,6 +145,615 @@ TEST_F(ProtocolTest, EmptyStringTest)
     EXPECT_EQ(x, "");
 }
 
+TEST_F(ProtocolTest, LongStringTest)
+{
+    for (size_t n : { 127, 128, 255, 256, 300, 16383, 16384, 1 << 20 }) {
+        std::string x(n, 'x'), y;
+        for (size_t i = 0; i < n; i += 7) x[i] = 'a' + i % 26;
+        std::vector<uint8_t> big(n + rpc::VarintLength::MAX_SIZE);
+        len = big.size();
+
+        EXPECT_EQ(true, rpc::Protocol<std::string>::Encode(big.data(), &len, x));
+        EXPECT_EQ(len, n + (n < 128 ? 1 : n < 16384 ? 2 : 3));
+        EXPECT_EQ(true, rpc::Protocol<std::string>::Decode(big.data(), &len, &ok, y));
+        ASSERT_EQ(ok, true);
+        ASSERT_EQ(x, y) << n << " bytes";
+
+        len--;
+        EXPECT_EQ(false, rpc::Protocol<std::string>::Decode(big.data(), &len, &ok, y));
+        ASSERT_EQ(ok, true);
+        EXPECT_EQ(false, rpc::Protocol<std::string>::Encode(big.data(), &len, x));
+    }
+}
+
+TEST_F(ProtocolTest, StringViewTest)
+{
+    std::string x("a string that is longer than the small buffer"), y;
+    std::string_view v;
+
+    EXPECT_EQ(true, rpc::Protocol<std::string_view>::Encode(buf, &len, x));
+    EXPECT_EQ(len, x.size() + 1);
+    uint32_t encoded = len;
+    // Same bytes as a std::string, both ways.
+    EXPECT_EQ(true, rpc::Protocol<std::string>::Decode(buf, &len, &ok, y));
+    EXPECT_EQ(x, y);
+    EXPECT_EQ(true, rpc::Protocol<std::string_view>::Decode(buf, &len, &ok, v));
+    ASSERT_EQ(ok, true);
+    EXPECT_EQ(len, encoded);
+    EXPECT_EQ(v, x);
+    EXPECT_EQ((const uint8_t *) v.data(), buf + 1);
+
+    len--;
+    EXPECT_EQ(false, rpc::Protocol<std::string_view>::Decode(buf, &len, &ok, v));
+    EXPECT_EQ(false, rpc::Protocol<std::string_view>::Encode(buf, &len, x));
+}
+
+TEST_F(ProtocolTest, VarintLengthTest)
+{
+    uint32_t n, used;
+    for (uint32_t x : { 0u, 1u, 127u, 128u, 300u, 1u << 21, 0xffffffffu }) {
+        auto size = rpc::VarintLength::Encode(buf, x);
+        EXPECT_EQ(size, rpc::VarintLength::Size(x));
+        EXPECT_EQ(true, rpc::VarintLength::Decode(buf, size, &ok, &n, &used));
+        EXPECT_EQ(n, x);
+        EXPECT_EQ(used, size);
+        if (size > 1) {
+            EXPECT_EQ(false, rpc::VarintLength::Decode(buf, size - 1, &ok, &n, &used));
+            EXPECT_EQ(ok, true) << "a cut-off prefix only needs more bytes";
+        }
+    }
+
+    // Longer than any uint32_t needs.
+    memset(buf, 0xff, 5);
+    EXPECT_EQ(false, rpc::VarintLength::Decode(buf, 256, &ok, &n, &used));
+    EXPECT_EQ(ok, false);
+    ok = true;
+    buf[4] = 0x10;
+    EXPECT_EQ(false, rpc::VarintLength::Decode(buf, 256, &ok, &n, &used));
+    EXPECT_EQ(ok, false);
+}
+
+TEST_F(ProtocolTest, VectorTest)
+{
+    std::vector<int> x = { 1, -2, 3, std::numeric_limits<int>::min() };
+    std::vector<int> y = { 42 };
+
+    EXPECT_EQ(true, rpc::Protocol<std::vector<int>>::Encode(buf, &len, x));
+    EXPECT_EQ(len, 1 + 4 * sizeof(int));
+    EXPECT_EQ(true, rpc::Protocol<std::vector<int>>::Decode(buf, &len, &ok, y));
+
+    ASSERT_EQ(ok, true);
+    ASSERT_EQ(x, y);
+
+    len--;
+    EXPECT_EQ(false, rpc::Protocol<std::vector<int>>::Decode(buf, &len, &ok, y));
+    ASSERT_EQ(ok, true);
+    len = 8;
+    EXPECT_EQ(false, rpc::Protocol<std::vector<int>>::Encode(buf, &len, x));
+}
+
+TEST_F(ProtocolTest, VectorOfStringsTest)
+{
+    std::vector<std::string> x = { "hello", "", "world" };
+    std::vector<std::string> y;
+
+    EXPECT_EQ(true, rpc::Protocol<std::vector<std::string>>::Encode(buf, &len, x));
+    EXPECT_EQ(len, 1u + 6 + 1 + 6);
+    EXPECT_EQ(true, rpc::Protocol<std::vector<std::string>>::Decode(buf, &len, &ok, y));
+
+    ASSERT_EQ(ok, true);
+    ASSERT_EQ(x, y);
+
+    std::vector<bool> bx = { true, false, true }, by;
+    len = 256;
+    EXPECT_EQ(true, rpc::Protocol<std::vector<bool>>::Encode(buf, &len, bx));
+    EXPECT_EQ(true, rpc::Protocol<std::vector<bool>>::Decode(buf, &len, &ok, by));
+    ASSERT_EQ(bx, by);
+}
+
+TEST_F(ProtocolTest, ArrayTest)
+{
+    static_assert(rpc::FixedWireSize<std::array<short, 5>>::value == 10,
+                  "arrays of fixed-size values have a fixed size");
+    static_assert(rpc::FixedWireSize<std::array<std::string, 2>>::value == 0,
+                  "arrays of strings don't");
+
+    using ShortArray = rpc::Protocol<std::array<short, 5>>;
+    using StringArray = rpc::Protocol<std::array<std::string, 2>>;
+
+    std::array<short, 5> x = {{ 1, 2, 3, 4, -5 }}, y;
+    EXPECT_EQ(true, ShortArray::Encode(buf, &len, x));
+    EXPECT_EQ(len, 10u);
+    EXPECT_EQ(true, ShortArray::Decode(buf, &len, &ok, y));
+    ASSERT_EQ(x, y);
+
+    std::array<std::string, 2> sx = {{ "a", "bc" }}, sy;
+    len = 256;
+    EXPECT_EQ(true, StringArray::Encode(buf, &len, sx));
+    EXPECT_EQ(len, 5u);
+    EXPECT_EQ(true, StringArray::Decode(buf, &len, &ok, sy));
+    ASSERT_EQ(sx, sy);
+}
+
+TEST_F(ProtocolTest, SpanTest)
+{
+    std::vector<double> v = { 0.5, 1.5, 2.5, 3.5 };
+    rpc::Span<const double> x(v.data() + 1, 2);
+    std::vector<double> y;
+
+    EXPECT_EQ(true, rpc::Protocol<rpc::Span<const double>>::Encode(buf, &len, x));
+    EXPECT_EQ(true, rpc::Protocol<std::vector<double>>::Decode(buf, &len, &ok, y));
+    ASSERT_EQ(y, std::vector<double>({ 1.5, 2.5 }));
+
+    std::vector<uint8_t> blob = { 'b', 'l', 'o', 'b' };
+    rpc::Span<const uint8_t> b;
+    len = 256;
+    EXPECT_EQ(true, rpc::Protocol<std::vector<uint8_t>>::Encode(buf, &len, blob));
+    EXPECT_EQ(true, rpc::Protocol<rpc::Span<const uint8_t>>::Decode(buf, &len, &ok, b));
+    EXPECT_EQ(len, 5u);
+    ASSERT_EQ(b.size(), 4u);
+    EXPECT_EQ(b.data(), buf + 1) << "byte spans point into the buffer";
+}
+
+TEST_F(ProtocolTest, XdrNumberTest)
+{
+    using Bytes = std::vector<uint8_t>;
+    auto wire = [this]() { return Bytes(buf, buf + len); };
+
+    EXPECT_EQ(true, rpc::XdrProtocol<int>::Encode(buf, &len, -2));
+    EXPECT_EQ(wire(), Bytes({ 0xff, 0xff, 0xff, 0xfe }));
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<short>::Encode(buf, &len, 0x1234));
+    EXPECT_EQ(wire(), Bytes({ 0, 0, 0x12, 0x34 })) << "shorts travel as int";
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<bool>::Encode(buf, &len, true));
+    EXPECT_EQ(wire(), Bytes({ 0, 0, 0, 1 }));
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<unsigned long>::Encode(buf, &len, 0x0102030405060708ul));
+    EXPECT_EQ(wire(), Bytes({ 1, 2, 3, 4, 5, 6, 7, 8 }));
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<double>::Encode(buf, &len, -2.0));
+    EXPECT_EQ(wire(), Bytes({ 0xc0, 0, 0, 0, 0, 0, 0, 0 }));
+
+    double d;
+    EXPECT_EQ(true, rpc::XdrProtocol<double>::Decode(buf, &len, &ok, d));
+    EXPECT_EQ(d, -2.0);
+    len = 3;
+    EXPECT_EQ(false, rpc::XdrProtocol<float>::Encode(buf, &len, 1.0f));
+
+    // Values that don't fit back into the narrow type are garbage.
+    short sh;
+    bool b;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<int>::Encode(buf, &len, 70000));
+    EXPECT_EQ(false, rpc::XdrProtocol<short>::Decode(buf, &len, &ok, sh));
+    EXPECT_EQ(ok, false);
+    ok = true;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<int>::Encode(buf, &len, -7));
+    EXPECT_EQ(true, rpc::XdrProtocol<short>::Decode(buf, &len, &ok, sh));
+    EXPECT_EQ(sh, -7);
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<int>::Encode(buf, &len, 2));
+    EXPECT_EQ(false, rpc::XdrProtocol<bool>::Decode(buf, &len, &ok, b));
+    EXPECT_EQ(ok, false);
+}
+
+TEST_F(ProtocolTest, XdrOpaqueTest)
+{
+    using Bytes = std::vector<uint8_t>;
+    std::string x("hello"), y;
+
+    memset(buf, 0xaa, 256);
+    EXPECT_EQ(true, rpc::XdrProtocol<std::string>::Encode(buf, &len, x));
+    EXPECT_EQ(Bytes(buf, buf + len),
+              Bytes({ 0, 0, 0, 5, 'h', 'e', 'l', 'l', 'o', 0, 0, 0 }));
+    EXPECT_EQ(true, rpc::XdrProtocol<std::string>::Decode(buf, &len, &ok, y));
+    EXPECT_EQ(len, 12u);
+    EXPECT_EQ(x, y);
+    len = 11;
+    EXPECT_EQ(false, rpc::XdrProtocol<std::string>::Decode(buf, &len, &ok, y));
+    EXPECT_EQ(false, rpc::XdrProtocol<std::string>::Encode(buf, &len, x));
+    ASSERT_EQ(ok, true);
+
+    std::vector<uint8_t> blob = { 1, 2, 3, 4 };
+    rpc::Span<const uint8_t> view;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<uint8_t>>::Encode(buf, &len, blob));
+    EXPECT_EQ(len, 8u) << "byte vectors are opaque, not arrays of ints";
+    EXPECT_EQ(true, rpc::XdrProtocol<rpc::Span<const uint8_t>>::Decode(buf, &len, &ok, view));
+    EXPECT_EQ(view.data(), buf + 4);
+    EXPECT_EQ(Bytes(view.begin(), view.end()), blob);
+
+    using Chars = std::array<char, 3>;
+    Chars fixed = { 'a', 'b', 'c' }, fixed2;
+    static_assert(rpc::FixedWireSize<Chars, rpc::XdrProtocol>::value == 4,
+                  "fixed opaque data is padded");
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<Chars>::Encode(buf, &len, fixed));
+    EXPECT_EQ(Bytes(buf, buf + len), Bytes({ 'a', 'b', 'c', 0 }));
+    EXPECT_EQ(true, rpc::XdrProtocol<Chars>::Decode(buf, &len, &ok, fixed2));
+    EXPECT_EQ(fixed, fixed2);
+}
+
+TEST_F(ProtocolTest, XdrArrayTest)
+{
+    using Bytes = std::vector<uint8_t>;
+    std::vector<int> x = { 1, -2, 3 }, y;
+
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<int>>::Encode(buf, &len, x));
+    EXPECT_EQ(Bytes(buf, buf + len),
+              Bytes({ 0, 0, 0, 3, 0, 0, 0, 1, 0xff, 0xff, 0xff, 0xfe, 0, 0, 0, 3 }));
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<int>>::Decode(buf, &len, &ok, y));
+    EXPECT_EQ(x, y);
+
+    std::vector<short> s = { -1, 2 }, s2;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<short>>::Encode(buf, &len, s));
+    EXPECT_EQ(len, 12u);
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<short>>::Decode(buf, &len, &ok, s2));
+    EXPECT_EQ(s, s2);
+
+    std::vector<bool> v = { true, false, true }, v2;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<bool>>::Encode(buf, &len, v));
+    EXPECT_EQ(len, 16u);
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<bool>>::Decode(buf, &len, &ok, v2));
+    EXPECT_EQ(v, v2);
+
+    std::vector<std::string> strs = { "a", "", "xdr" }, strs2;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<std::string>>::Encode(buf, &len, strs));
+    EXPECT_EQ(len, 4u + 8 + 4 + 8);
+    EXPECT_EQ(true, rpc::XdrProtocol<std::vector<std::string>>::Decode(buf, &len, &ok, strs2));
+    EXPECT_EQ(strs, strs2);
+
+    using Doubles = std::array<double, 2>;
+    Doubles a = { 0.25, -8.0 }, a2;
+    len = 256;
+    EXPECT_EQ(true, rpc::XdrProtocol<Doubles>::Encode(buf, &len, a));
+    EXPECT_EQ(len, 16u);
+    EXPECT_EQ(buf[8], 0xc0);
+    EXPECT_EQ(true, rpc::XdrProtocol<Doubles>::Decode(buf, &len, &ok, a2));
+    EXPECT_EQ(a, a2);
+}
+
+TEST_F(ProtocolTest, ByteSwapTest)
+{
+    std::vector<uint8_t> src(1024 + 7), want(src.size()), got(src.size());
+    for (size_t i = 0; i < src.size(); i++) src[i] = i * 37 + 11;
+
+    // Every length up to a few registers, so each kernel's tail is covered.
+    for (int level = 0; level <= (int) rpc::DetectSimdLevel(); level++) {
+        for (size_t n = 0; n <= 100; n++) {
+            rpc::ByteSwap32(got.data(), src.data() + 1, n, (rpc::SimdLevel) level);
+            for (size_t i = 0; i < 4 * n; i++) want[i] = src[1 + i / 4 * 4 + 3 - i % 4];
+            ASSERT_TRUE(std::equal(want.begin(), want.begin() + 4 * n, got.begin()))
+                << "32-bit, level " << level << ", " << n << " values";
+
+            rpc::ByteSwap64(got.data(), src.data(), n, (rpc::SimdLevel) level);
+            for (size_t i = 0; i < 8 * n; i++) want[i] = src[i / 8 * 8 + 7 - i % 8];
+            ASSERT_TRUE(std::equal(want.begin(), want.begin() + 8 * n, got.begin()))
+                << "64-bit, level " << level << ", " << n << " values";
+        }
+    }
+
+    // In place, as decoding into the buffer would.
+    got = src;
+    rpc::ByteSwap32(got.data(), got.data(), 256);
+    rpc::ByteSwap32(got.data(), got.data(), 256);
+    EXPECT_EQ(got, src);
+}
+
+TEST_F(ProtocolTest, CompressBlockTest)
+{
+    using Bytes = std::vector<uint8_t>;
+
+    // Long runs, short repeats and noise, around the sizes where the format
+    // stops allowing matches.
+    std::vector<std::pair<Bytes, bool>> inputs;
+    for (size_t n: { 1, 11, 12, 13, 100, 5000, 70000 }) {
+        Bytes runs(n), text(n), noise(n);
+        for (size_t i = 0; i < n; i++) {
+            runs[i] = i / 300;
+            text[i] = "key=value; "[i % 11] + i / 4096;
+            noise[i] = (i * 2654435761u) >> 13;
+        }
+        inputs.push_back({ runs, n >= 100 });
+        inputs.push_back({ text, n >= 100 });
+        inputs.push_back({ noise, false });
+    }
+    inputs.push_back({ Bytes(), false });
+
+    for (auto &[x, compressible]: inputs) {
+        Bytes z(rpc::CompressBlockBound(x.size()));
+        auto n = rpc::CompressBlock(z.data(), z.size(), x.data(), x.size());
+        ASSERT_GT(n, 0u);
+        Bytes y(x.size());
+        ASSERT_EQ(true, rpc::DecompressBlock(y.data(), y.size(), z.data(), n))
+            << x.size() << " bytes";
+        EXPECT_EQ(x, y);
+        if (compressible) {
+            EXPECT_LT(n, x.size() / 4 + 16) << x.size() << " bytes";
+        }
+        if (x.empty())
+            continue;
+
+        // Truncated blocks, wrong sizes and a too small buffer are refused.
+        for (size_t len = 0; len < n; len += 1 + len / 8)
+            EXPECT_EQ(false, rpc::DecompressBlock(y.data(), y.size(), z.data(), len));
+        EXPECT_EQ(false, rpc::DecompressBlock(y.data(), y.size() - 1, z.data(), n));
+        y.push_back(0);
+        EXPECT_EQ(false, rpc::DecompressBlock(y.data(), y.size(), z.data(), n));
+        EXPECT_EQ(0u, rpc::CompressBlock(z.data(), n - 1, x.data(), x.size()));
+    }
+
+    // A match may not reach back before the start of the output.
+    uint8_t bad[] = { 0x10, 'a', 0x02, 0x00 };
+    uint8_t out[5];
+    EXPECT_EQ(false, rpc::DecompressBlock(out, sizeof(out), bad, sizeof(bad)));
+}
+
+TEST_F(ProtocolTest, Crc32cTest)
+{
+    for (bool hardware: { false, true }) {
+        EXPECT_EQ(0u, rpc::Crc32c(0, "", 0, hardware));
+        EXPECT_EQ(0xe3069283u, rpc::Crc32c(0, "123456789", 9, hardware));
+        // RFC 3720, B.4.
+        std::vector<uint8_t> zeros(32, 0), ones(32, 0xff), up(32);
+        for (int i = 0; i < 32; i++) up[i] = i;
+        EXPECT_EQ(0x8a9136aau, rpc::Crc32c(0, zeros.data(), 32, hardware));
+        EXPECT_EQ(0x62a8ab43u, rpc::Crc32c(0, ones.data(), 32, hardware));
+        EXPECT_EQ(0x46dd794eu, rpc::Crc32c(0, up.data(), 32, hardware));
+    }
+
+    // Both ways agree at every length and alignment, and in pieces.
+    std::vector<uint8_t> src(300);
+    for (size_t i = 0; i < src.size(); i++) src[i] = i * 37 + 11;
+    for (size_t offset = 0; offset < 8; offset++) {
+        for (size_t n = 0; n + offset <= src.size(); n += 1 + n / 16) {
+            auto crc = rpc::Crc32c(0, src.data() + offset, n, false);
+            ASSERT_EQ(crc, rpc::Crc32c(0, src.data() + offset, n, true)) << n;
+            auto half = rpc::Crc32c(0, src.data() + offset, n / 2);
+            ASSERT_EQ(crc, rpc::Crc32c(half, src.data() + offset + n / 2, n - n / 2));
+        }
+    }
+}
+
+TEST_F(ProtocolTest, CompactIntegerTest)
+{
+    using Bytes = std::vector<uint8_t>;
+    auto wire = [this]() { return Bytes(buf, buf + len); };
+
+    EXPECT_EQ(true, rpc::CompactProtocol<int>::Encode(buf, &len, -1));
+    EXPECT_EQ(wire(), Bytes({ 0x01 }));
+    len = 256;
+    EXPECT_EQ(true, rpc::CompactProtocol<int>::Encode(buf, &len, 64));
+    EXPECT_EQ(wire(), Bytes({ 0x80, 0x01 }));
+    len = 256;
+    EXPECT_EQ(true, rpc::CompactProtocol<unsigned int>::Encode(buf, &len, 300));
+    EXPECT_EQ(wire(), Bytes({ 0xac, 0x02 }));
+
+    long l;
+    for (long x : { 0l, 1l, -64l, 63l, std::numeric_limits<long>::min(),
+                    std::numeric_limits<long>::max() }) {
+        len = 256;
+        EXPECT_EQ(true, rpc::CompactProtocol<long>::Encode(buf, &len, x));
+        EXPECT_EQ(len, rpc::Varint::Size(rpc::CompactProtocol<long>::ToVarint(x)));
+        EXPECT_EQ(true, rpc::CompactProtocol<long>::Decode(buf, &len, &ok, l));
+        ASSERT_EQ(ok, true);
+        EXPECT_EQ(x, l);
+    }
+    unsigned long long u;
+    len = 256;
+    EXPECT_EQ(true, rpc::CompactProtocol<unsigned long long>::Encode(buf, &len, ~0ull));
+    EXPECT_EQ(len, 10u);
+    len--;
+    EXPECT_EQ(false, rpc::CompactProtocol<unsigned long long>::Decode(buf, &len, &ok, u));
+    EXPECT_EQ(ok, true) << "a cut off varint may still arrive";
+    len = 1;
+    EXPECT_EQ(false, rpc::CompactProtocol<unsigned long long>::Encode(buf, &len, 128));
+
+    // Too long for any uint64_t, or too big for the type: garbage.
+    memset(buf, 0x80, 11);
+    len = 11;
+    EXPECT_EQ(false, rpc::CompactProtocol<unsigned long long>::Decode(buf, &len, &ok, u));
+    EXPECT_EQ(ok, false);
+    ok = true;
+    short sh;
+    len = 256;
+    EXPECT_EQ(true, rpc::CompactProtocol<int>::Encode(buf, &len, 40000));
+    EXPECT_EQ(false, rpc::CompactProtocol<short>::Decode(buf, &len, &ok, sh));
+    EXPECT_EQ(ok, false);
+}
+
+TEST_F(ProtocolTest, CompactArrayTest)
+{
+    // Runs of one-byte values long and short enough to take every branch of
+    // the eight-at-a-time decoder.
+    std::vector<int> x, y;
+    for (int i = 0; i < 100; i++) x.push_back(i % 13 == 0 ? -100000 * i : i % 7 - 3);
+    x.push_back(std::numeric_limits<int>::min());
+
+    uint8_t big[1024];
+    len = sizeof(big);
+    EXPECT_EQ(true, rpc::CompactProtocol<std::vector<int>>::Encode(big, &len, x));
+    EXPECT_LT(len, x.size() * 2);
+    uint32_t encoded = len;
+    EXPECT_EQ(true, rpc::CompactProtocol<std::vector<int>>::Decode(big, &len, &ok, y));
+    ASSERT_EQ(ok, true);
+    EXPECT_EQ(len, encoded);
+    EXPECT_EQ(x, y);
+    for (uint32_t cut = 0; cut < encoded; cut++) {
+        len = cut;
+        ASSERT_EQ(false, rpc::CompactProtocol<std::vector<int>>::Decode(big, &len, &ok, y));
+        ASSERT_EQ(ok, true);
+    }
+
+    using Shorts = std::array<unsigned short, 3>;
+    Shorts a = { 1, 200, 65535 }, a2;
+    static_assert(rpc::FixedWireSize<Shorts, rpc::CompactProtocol>::value == 0,
+                  "varints have no fixed size");
+    len = 256;
+    EXPECT_EQ(true, rpc::CompactProtocol<Shorts>::Encode(buf, &len, a));
+    EXPECT_EQ(len, 1u + 2 + 3);
+    EXPECT_EQ(true, rpc::CompactProtocol<Shorts>::Decode(buf, &len, &ok, a2));
+    EXPECT_EQ(a, a2);
+
+    std::vector<uint8_t> blob = { 1, 2, 3 };
+    rpc::Span<const uint8_t> view;
+    len = 256;
+    EXPECT_EQ(true, rpc::CompactProtocol<std::vector<uint8_t>>::Encode(buf, &len, blob));
+    EXPECT_EQ(len, 4u) << "bytes keep their native encoding";
+    EXPECT_EQ(true, rpc::CompactProtocol<rpc::Span<const uint8_t>>::Decode(buf, &len, &ok, view));
+    EXPECT_EQ(view.data(), buf + 1);
+}
+
+struct Sample {
+    int a, b;
+    double c;
+    RPC_FIELDS(a, b, c)
+};
+
+struct Padded {
+    char tag;
+    int value;
+    RPC_FIELDS(tag, value)
+};
+
+struct Record {
+    int id;
+    short flags;
+    std::string name;
+    std::vector<int> values;
+    Sample sample;
+    RPC_FIELDS(id, flags, name, values, sample)
+};
+
+bool operator==(const Sample &x, const Sample &y) {
+    return x.a == y.a && x.b == y.b && x.c == y.c;
+}
+
+bool operator==(const Record &x, const Record &y) {
+    return x.id == y.id && x.flags == y.flags && x.name == y.name
+        && x.values == y.values && x.sample == y.sample;
+}
+
+TEST_F(ProtocolTest, StructTest)
+{
+    static_assert(rpc::IsMemcpyWire<Sample>::value, "no padding, all raw fields");
+    static_assert(rpc::FixedWireSize<Sample>::value == sizeof(Sample), "");
+    static_assert(!rpc::IsMemcpyWire<Padded>::value, "padding stays off the wire");
+    static_assert(rpc::FixedWireSize<Padded>::value == 5, "");
+    static_assert(rpc::FixedWireSize<Record>::value == 0, "");
+    static_assert(!rpc::IsMemcpyWire<Sample, rpc::XdrProtocol>::value || rpc::kHostIsBigEndian,
+                  "XDR swaps every field");
+    static_assert(rpc::FixedWireSize<Sample, rpc::XdrProtocol>::value == 16, "");
+
+    Padded p = { 'x', -7 }, p2 = { 0, 0 };
+    EXPECT_EQ(true, rpc::Protocol<Padded>::Encode(buf, &len, p));
+    EXPECT_EQ(len, 5u);
+    EXPECT_EQ(true, rpc::Protocol<Padded>::Decode(buf, &len, &ok, p2));
+    EXPECT_EQ(p2.tag, 'x');
+    EXPECT_EQ(p2.value, -7);
+
+    Record r = { 42, -1, "name", { 1, -2, 300 }, { 1, 2, 0.5 } };
+    for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                      rpc::WireFormat::kCompact }) {
+        rpc::WithWireFormat(wire, [&](auto tag) {
+            return Roundtrip(tag, r);
+        });
+    }
+
+    // The memcpy path in arrays of structs.
+    std::vector<Sample> v = { { 1, 2, 3.0 }, { -1, -2, -3.0 } }, v2;
+    len = 256;
+    EXPECT_EQ(true, rpc::Protocol<std::vector<Sample>>::Encode(buf, &len, v));
+    EXPECT_EQ(len, 1 + 2 * sizeof(Sample));
+    EXPECT_EQ(true, rpc::Protocol<std::vector<Sample>>::Decode(buf, &len, &ok, v2));
+    EXPECT_EQ(v, v2);
+}
+
+TEST_F(ProtocolTest, CompositeTest)
+{
+    using Strings = std::map<std::string, int>;
+    using Fixed = std::map<int, double>;
+    using Hashed = std::unordered_map<int, std::string>;
+    using Tuple = std::tuple<int, short, double>;
+    using Variant = std::variant<int, std::string, std::vector<int>>;
+    static_assert(rpc::FixedWireSize<Tuple>::value == 14, "");
+    static_assert(rpc::FixedWireSize<Tuple, rpc::XdrProtocol>::value == 16, "");
+    static_assert(rpc::FixedWireSize<std::optional<int>>::value == 0, "");
+
+    for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                      rpc::WireFormat::kCompact }) {
+        rpc::WithWireFormat(wire, [&](auto tag) {
+            Roundtrip(tag, Strings{ { "a", 1 }, { "bc", -2 }, { "", 300 } });
+            Roundtrip(tag, Strings{});
+            Roundtrip(tag, Fixed{ { 1, 0.5 }, { -1, 2.5 } });
+            Roundtrip(tag, Hashed{ { 1, "one" }, { 2, "two" }, { 3, "" } });
+            Roundtrip(tag, std::optional<std::string>("x"));
+            Roundtrip(tag, std::optional<std::string>());
+            Roundtrip(tag, std::make_pair(7, std::string("seven")));
+            Roundtrip(tag, Tuple(1, -1, 0.25));
+            Roundtrip(tag, Variant(-5));
+            Roundtrip(tag, Variant("five"));
+            return Roundtrip(tag, Variant(std::vector<int>{ 5, 5 }));
+        });
+    }
+
+    // Decoding replaces what was there.
+    Strings m = { { "a", 1 } }, m2 = { { "z", 26 } };
+    len = 256;
+    EXPECT_EQ(true, rpc::Protocol<Strings>::Encode(buf, &len, m));
+    EXPECT_EQ(true, rpc::Protocol<Strings>::Decode(buf, &len, &ok, m2));
+    EXPECT_EQ(m, m2);
+
+    std::optional<int> o = 3;
+    buf[0] = 0;
+    len = 256;
+    EXPECT_EQ(true, rpc::Protocol<std::optional<int>>::Decode(buf, &len, &ok, o));
+    EXPECT_EQ(len, 1u);
+    EXPECT_EQ(o.has_value(), false);
+
+    Variant v;
+    buf[0] = 3;
+    len = 256;
+    EXPECT_EQ(false, rpc::Protocol<Variant>::Decode(buf, &len, &ok, v));
+    EXPECT_EQ(ok, false) << "no fourth alternative";
+}
+
+TEST_F(ProtocolTest, SizeTest)
+{
+    static_assert(rpc::Protocol<int>::Size(1) == 4, "fixed sizes are constexpr");
+    static_assert(rpc::XdrProtocol<short>::Size(1) == 4, "");
+    static_assert(rpc::Protocol<std::array<double, 3>>::Size({}) == 24, "");
+    static_assert(rpc::XdrProtocol<std::array<char, 5>>::Size({}) == 8, "");
+
+    for (auto wire: { rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                      rpc::WireFormat::kCompact }) {
+        rpc::WithWireFormat(wire, [&](auto tag) {
+            Roundtrip(tag, -1);
+            Roundtrip(tag, 1ul << 40);
+            Roundtrip(tag, 'c');
+            Roundtrip(tag, 2.5);
+            Roundtrip(tag, std::string(200, 's'));
+            Roundtrip(tag, std::vector<int>{ 0, -100, 100000 });
+            Roundtrip(tag, std::vector<uint8_t>{ 1, 2, 3 });
+            Roundtrip(tag, std::vector<bool>{ true, false });
+            Roundtrip(tag, std::vector<std::string>{ "a", "", "bc" });
+            return Roundtrip(tag, std::array<std::string, 2>{ "x", "yz" });
+        });
+    }
+
+    std::string s = "abc";
+    int i = 5;
+    rpc::Param<std::string, int> params(s, i);
+    EXPECT_EQ(params.Size(rpc::WireFormat::kNative), 4u + 4);
+    EXPECT_EQ(params.Size(rpc::WireFormat::kXdr), 8u + 4);
+    EXPECT_EQ(params.Size(rpc::WireFormat::kCompact), 4u + 1);
+}
+
 #define UPDATE_BUFFER() \
     ASSERT_GE(remain, len) << "Encode wrote more than buffer size of " \
         << remain << " bytes!"; \
@@ -8,6 +8,8 @@ class SimpleService : public rpc::Service<SimpleService> {
  public:
   SimpleService() {
     Export(&SimpleService::DoHash);
+    ExportBatch(&SimpleService::DoHash, &SimpleService::DoHashBatch);
+    Export(&SimpleService::Mix);
   }
 
   int DoHash(int x) {
@@ -15,16 +17,32 @@ class SimpleService : public rpc::Service<SimpleService> {
     l *= 2654435761;
     return l % 2147483647;
   }
+
+  // DoHash() of every x, in a loop the compiler can vectorize.
+  void DoHashBatch(rpc::Span<const int> xs, rpc::Span<int> out) {
+    nr_batches++;
+    nr_batched_calls += xs.size();
+    for (size_t i = 0; i < xs.size(); i++)
+      out[i] = DoHash(xs[i]);
+  }
+
+  // No batch handler: batches of it run one call at a time.
+  int Mix(int x, int y) { return DoHash(x) ^ y; }
+
+  int nr_batches = 0;
+  size_t nr_batched_calls = 0;
 };
 
 class SimpleServiceTest : public testing::Test, public ServiceTestUtil {
  protected:
   static constexpr int kInstanceId = 123;
   SimpleService *client_service;
+  SimpleService *server_service;
  public:
   void SetUp() override {
     SetUpServer();
-    srv->AddService(new SimpleService(), kInstanceId);
+    server_service = new SimpleService();
+    srv->AddService(server_service, kInstanceId);
 
     SetUpClient();
     client_service = new SimpleService();
@@ -124,4 +142,221 @@ TEST_F(SimpleServiceTest, TestConcurrentCalls)
   }
 }
 
+
+TEST_F(SimpleServiceTest, TestAutoBatching)
+{
+  srv->set_log_enabled(false);
+  // Sun RPC headers keep every call at 40 + 4 bytes. Compact ones would
+  // leave the pipeline limit, not the byte window, to send the batches.
+  rpc::Client cl;
+  cl.set_log_enabled(false);
+  cl.enable_compact_headers(false);
+  ASSERT_EQ(cl.Connect("127.0.0.1", 3888), true);
+  cl.set_batch_window(1000000, 4 * 44);
+
+  // No explicit Flush() between calls: every fourth 44-byte call fills the byte window
+  // and the batch goes out on its own.
+  std::vector<rpc::Result<int> *> results;
+  for (int i = 0; i < 30; i++) {
+    auto r = cl.Call(client_service, &SimpleService::DoHash, 1998);
+    ASSERT_NE(r, nullptr);
+    results.push_back(r);
+  }
+  EXPECT_EQ(cl.uses_compact_headers(), false);
+  EXPECT_EQ(results[0]->is_ready(), true);
+  EXPECT_EQ(results[27]->is_ready(), true);
+  // Two calls, under the window.
+  EXPECT_EQ(results[29]->is_ready(), false);
+  cl.Flush();
+
+  for (auto r: results) {
+    EXPECT_EQ(r->is_ready(), true);
+    EXPECT_EQ(r->data(), 1425526035);
+    EXPECT_EQ(r->has_error(), false);
+    delete r;
+  }
+}
+
+TEST_F(SimpleServiceTest, TestAutoBatchingThroughput)
+{
+  static constexpr int kNrCalls = 20000;
+  srv->set_log_enabled(false);
+  client->set_log_enabled(false);
+
+  auto run = [this](const char *mode, bool flush_each) {
+    struct timeval start, end;
+    std::vector<rpc::Result<int> *> results;
+    results.reserve(kNrCalls);
+    gettimeofday(&start, nullptr);
+    for (int i = 0; i < kNrCalls; i++) {
+      results.push_back(client->Call(client_service, &SimpleService::DoHash, i));
+      if (flush_each) client->Flush();
+    }
+    client->Flush();
+    gettimeofday(&end, nullptr);
+
+    auto duration = 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
+    printf("%s: %d calls in %ld us, %.2f us/call, thru %ld req/s\n", mode,
+           kNrCalls, duration, (double) duration / kNrCalls,
+           1000000L * kNrCalls / duration);
+    for (auto r: results) {
+      EXPECT_EQ(r->has_error(), false);
+      delete r;
+    }
+  };
+
+  run("flush per call", true);
+  client->set_batch_window(200, 0);
+  run("batch window 200us", false);
+  client->set_batch_window(200, 256);
+  run("batch window 200us/256B", false);
+}
+
+TEST_F(SimpleServiceTest, TestBatchCall)
+{
+  std::vector<int> xs;
+  for (int i = 0; i < 1000; i++)
+    xs.push_back(i * 7919);
+
+  // A batch is answered in order with the calls around it.
+  rpc::BatchResult<int> batch;
+  rpc::Result<int> before, after;
+  ASSERT_TRUE(client->Call(before, client_service, &SimpleService::DoHash, 1998));
+  ASSERT_TRUE(client->Call(batch, client_service, &SimpleService::DoHash, xs));
+  ASSERT_TRUE(client->Call(after, client_service, &SimpleService::DoHash, 1998));
+  client->Flush();
+
+  ASSERT_EQ(batch.has_error(), false);
+  ASSERT_EQ(batch.is_ready(), true);
+  ASSERT_EQ(batch.data().size(), xs.size());
+  for (size_t i = 0; i < xs.size(); i++)
+    EXPECT_EQ(batch.data()[i], client_service->DoHash(xs[i]));
+  EXPECT_EQ(before.data(), 1425526035);
+  EXPECT_EQ(after.data(), 1425526035);
+  EXPECT_EQ(server_service->nr_batches, 1);
+
+  // The result is reused, and an empty batch is answered too.
+  ASSERT_TRUE(client->Call(batch, client_service, &SimpleService::DoHash,
+                           rpc::Span<const int>()));
+  client->Flush();
+  EXPECT_EQ(batch.has_error(), false);
+  EXPECT_EQ(batch.is_ready(), true);
+  EXPECT_EQ(batch.data().size(), 0u);
+}
+
+TEST_F(SimpleServiceTest, TestBatchWithoutHandler)
+{
+  std::vector<std::tuple<int, int>> args;
+  for (int i = 0; i < 300; i++)
+    args.emplace_back(i * 31, -i);
+
+  for (auto wire: {rpc::WireFormat::kNative, rpc::WireFormat::kXdr,
+                   rpc::WireFormat::kCompact}) {
+    client->set_wire_format(wire);
+    rpc::BatchResult<int> batch;
+    ASSERT_TRUE(client->Call(batch, client_service, &SimpleService::Mix, args));
+    client->Flush();
+
+    ASSERT_EQ(batch.has_error(), false);
+    ASSERT_EQ(batch.data().size(), args.size());
+    for (size_t i = 0; i < args.size(); i++) {
+      EXPECT_EQ(batch.data()[i], client_service->Mix(std::get<0>(args[i]),
+                                                     std::get<1>(args[i])));
+    }
+  }
+  EXPECT_EQ(server_service->nr_batches, 0);
+}
+
+TEST_F(SimpleServiceTest, TestBatchThroughput)
+{
+  static constexpr int kNrCalls = 20000;
+  static constexpr int kBatchSize = 4000;
+  srv->set_log_enabled(false);
+  client->set_log_enabled(false);
+
+  std::vector<int> xs;
+  for (int i = 0; i < kNrCalls; i++)
+    xs.push_back(i);
+
+  struct timeval start, end;
+  auto report = [&](const char *mode) {
+    gettimeofday(&end, nullptr);
+    auto duration = 1000000 * (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec);
+    printf("%s: %d calls in %ld us, thru %ld req/s\n", mode, kNrCalls, duration,
+           1000000L * kNrCalls / std::max<long>(duration, 1));
+  };
+
+  std::vector<rpc::Result<int>> results(rpc::BaseService::kMaxPipelineRequests);
+  gettimeofday(&start, nullptr);
+  for (int i = 0; i < kNrCalls; i += results.size()) {
+    for (size_t j = 0; j < results.size(); j++)
+      client->Call(results[j], client_service, &SimpleService::DoHash, xs[i + j]);
+    client->Flush();
+    for (size_t j = 0; j < results.size(); j++)
+      ASSERT_EQ(results[j].data(), client_service->DoHash(xs[i + j]));
+  }
+  report("pipelined calls");
+
+  rpc::BatchResult<int> batch;
+  gettimeofday(&start, nullptr);
+  for (int i = 0; i < kNrCalls; i += kBatchSize) {
+    client->Call(batch, client_service, &SimpleService::DoHash,
+                 rpc::Span<const int>(xs.data() + i, kBatchSize));
+    client->Flush();
+    ASSERT_EQ(batch.data().size(), (size_t) kBatchSize);
+    ASSERT_EQ(batch.data().back(), client_service->DoHash(xs[i + kBatchSize - 1]));
+  }
+  report("batches of 4000");
+}
+
+TEST_F(SimpleServiceTest, TestCoalescedCalls)
+{
+  static constexpr int kNrClients = 16;
+  static constexpr int kNrRounds = 100;
+  static constexpr size_t kNrHashes = rpc::BaseService::kMaxPipelineRequests - 1;
+  srv->set_log_enabled(false);
+  srv->set_coalescing(true);
+
+  // Every client pipelines calls that are coalesced with one that isn't.
+  std::atomic_int nr_wrong(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNrClients; t++) {
+    threads.emplace_back([this, t, &nr_wrong] {
+      rpc::Client cl;
+      if (!cl.Connect("127.0.0.1", 3888)) {
+        nr_wrong++;
+        return;
+      }
+      cl.set_log_enabled(false);
+      std::array<rpc::Result<int>, kNrHashes> hashes;
+      rpc::Result<int> mix;
+      for (int round = 0; round < kNrRounds; round++) {
+        int x = t * kNrRounds + round;
+        for (size_t i = 0; i < kNrHashes; i++) {
+          cl.Call(hashes[i], client_service, &SimpleService::DoHash, x + (int) i);
+          if (i == kNrHashes / 2)
+            cl.Call(mix, client_service, &SimpleService::Mix, x, t);
+        }
+        cl.Flush();
+        for (size_t i = 0; i < kNrHashes; i++) {
+          if (hashes[i].has_error() || hashes[i].data() != client_service->DoHash(x + (int) i))
+            nr_wrong++;
+        }
+        if (mix.has_error() || mix.data() != client_service->Mix(x, t))
+          nr_wrong++;
+      }
+    });
+  }
+  for (auto &thread: threads)
+    thread.join();
+
+  EXPECT_EQ(nr_wrong.load(), 0);
+  // The batch handler ran every DoHash() call, and in fewer runs.
+  size_t nr_calls = kNrClients * kNrRounds * kNrHashes;
+  EXPECT_EQ(server_service->nr_batched_calls, nr_calls);
+  EXPECT_LT((size_t) server_service->nr_batches, nr_calls);
+  printf("%lu calls coalesced into %d runs of the batch handler\n",
+         nr_calls, server_service->nr_batches);
+}
+
 }